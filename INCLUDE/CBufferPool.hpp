@@ -0,0 +1,132 @@
+#ifndef BUFFERPOOL_HPP
+#define BUFFERPOOL_HPP
+
+#include <mutex>
+#include <vector>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+
+#ifdef WIN32
+#include <malloc.h>
+#endif
+
+namespace NPL
+{
+  /*
+   * Fixed set of equally sized buffers aligned to "align" bytes
+   * (a power of two, at least the page or sector size for direct
+   * I/O). All buffers are allocated up front and recycled, Get()
+   * returns nullptr when they are all handed out.
+   */
+  class CBufferPool
+  {
+    public:
+
+    CBufferPool(size_t count, size_t size, size_t align = 4096)
+    {
+      iSize = size;
+      iAlign = align;
+
+      for (size_t i = 0; i < count; i++)
+      {
+        auto b = Allocate(size, align);
+
+        if (!b) break;
+
+        iAll.push_back(b);
+      }
+
+      iFree = iAll;
+    }
+
+    virtual ~CBufferPool()
+    {
+      for (auto b : iAll)
+      {
+        #ifdef WIN32
+        _aligned_free(b);
+        #else
+        free(b);
+        #endif
+      }
+    }
+
+    CBufferPool(const CBufferPool&) = delete;
+
+    CBufferPool& operator=(const CBufferPool&) = delete;
+
+    virtual uint8_t * Get(void)
+    {
+      std::lock_guard<std::mutex> lg(iLock);
+
+      if (iFree.empty())
+      {
+        return nullptr;
+      }
+
+      auto b = iFree.back();
+
+      iFree.pop_back();
+
+      return b;
+    }
+
+    virtual void Put(uint8_t *b)
+    {
+      std::lock_guard<std::mutex> lg(iLock);
+
+      iFree.push_back(b);
+    }
+
+    size_t GetBufferSize(void) const
+    {
+      return iSize;
+    }
+
+    size_t GetAlignment(void) const
+    {
+      return iAlign;
+    }
+
+    size_t GetCount(void) const
+    {
+      return iAll.size();
+    }
+
+    static uint8_t * Allocate(size_t size, size_t align)
+    {
+      void *p = nullptr;
+
+      #ifdef WIN32
+      p = _aligned_malloc(size, align);
+      #else
+      if (posix_memalign(&p, align, size) != 0)
+      {
+        p = nullptr;
+      }
+      #endif
+
+      if (!p)
+      {
+        std::cout << "CBufferPool failed to allocate " << size << " bytes\n";
+      }
+
+      return (uint8_t *) p;
+    }
+
+    protected:
+
+    std::mutex iLock;
+
+    size_t iSize;
+
+    size_t iAlign;
+
+    std::vector<uint8_t *> iAll;
+
+    std::vector<uint8_t *> iFree;
+  };
+}
+
+#endif //BUFFERPOOL_HPP
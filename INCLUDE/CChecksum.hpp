@@ -0,0 +1,354 @@
+#ifndef CHECKSUM_HPP
+#define CHECKSUM_HPP
+
+#include <array>
+#include <algorithm>
+#include <string>
+#include <cstdint>
+#include <cstring>
+
+#include <zlib.h>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(_M_AMD64)
+  #include <nmmintrin.h>
+  #define NPL_CRC32C_X86
+  #ifdef _MSC_VER
+  #include <intrin.h>
+  #endif
+#endif
+
+namespace NPL
+{
+  enum class ChecksumType : uint8_t
+  {
+    None = 0,
+    CRC32,      // zlib CRC32, what FTP servers report for HASH CRC32 / XCRC
+    CRC32C,     // Castagnoli, SSE4.2 crc32 instruction where available
+    XXH64
+  };
+
+  /*
+   * Streaming checksum over data as it is transferred. CRC32 is the
+   * one that can be checked against a server; CRC32C and XXH64 are
+   * cheaper for local integrity records.
+   */
+  class CChecksum
+  {
+    public:
+
+    CChecksum(ChecksumType type = ChecksumType::CRC32C) : iType(type)
+    {
+      Reset();
+    }
+
+    void Reset(void)
+    {
+      iCRC = 0;
+      iTotal = 0;
+      iBuffered = 0;
+      iV[0] = XXH_P1 + XXH_P2;
+      iV[1] = XXH_P2;
+      iV[2] = 0;
+      iV[3] = 0 - XXH_P1;
+    }
+
+    void Update(const uint8_t *b, size_t n)
+    {
+      switch (iType)
+      {
+        case ChecksumType::CRC32:
+          while (n)
+          {
+            uInt chunk = static_cast<uInt>(std::min<size_t>(n, 1u << 30));
+            iCRC = static_cast<uint32_t>(crc32(iCRC, b, chunk));
+            b += chunk;
+            n -= chunk;
+          }
+          break;
+        case ChecksumType::CRC32C:
+          iCRC = ~CRC32C(~iCRC, b, n);
+          break;
+        case ChecksumType::XXH64:
+          UpdateXXH64(b, n);
+          break;
+        default:
+          break;
+      }
+    }
+
+    uint64_t GetValue(void)
+    {
+      return (iType == ChecksumType::XXH64) ? DigestXXH64() : iCRC;
+    }
+
+    /*
+     * lower case hex, 8 digits for the CRCs and 16 for XXH64
+     */
+    std::string GetDigest(void)
+    {
+      static const char hex[] = "0123456789abcdef";
+
+      int digits = (iType == ChecksumType::XXH64) ? 16 : 8;
+
+      uint64_t v = GetValue();
+
+      std::string s(digits, '0');
+
+      for (int i = digits - 1; i >= 0; i--, v >>= 4)
+      {
+        s[i] = hex[v & 0xF];
+      }
+
+      return s;
+    }
+
+    ChecksumType GetType(void)
+    {
+      return iType;
+    }
+
+    static const char * GetName(ChecksumType type)
+    {
+      switch (type)
+      {
+        case ChecksumType::CRC32:  return "CRC32";
+        case ChecksumType::CRC32C: return "CRC32C";
+        case ChecksumType::XXH64:  return "XXH64";
+        default:                   return "NONE";
+      }
+    }
+
+    /*
+     * raw (not pre/post inverted) CRC32C update
+     */
+    static uint32_t CRC32C(uint32_t crc, const uint8_t *b, size_t n)
+    {
+      #ifdef NPL_CRC32C_X86
+      if (HasSSE42())
+      {
+        return CRC32CHardware(crc, b, n);
+      }
+      #endif
+
+      static const auto table = MakeCRC32CTable();
+
+      while (n--)
+      {
+        crc = table[(crc ^ *b++) & 0xFF] ^ (crc >> 8);
+      }
+
+      return crc;
+    }
+
+    protected:
+
+    static constexpr uint64_t XXH_P1 = 11400714785074694791ULL;
+    static constexpr uint64_t XXH_P2 = 14029467366897019727ULL;
+    static constexpr uint64_t XXH_P3 = 1609587929392839161ULL;
+    static constexpr uint64_t XXH_P4 = 9650029242287828579ULL;
+    static constexpr uint64_t XXH_P5 = 2870177450012600261ULL;
+
+    ChecksumType iType;
+
+    uint32_t iCRC = 0;
+
+    uint64_t iV[4];
+
+    uint64_t iTotal = 0;
+
+    uint8_t iBuffer[32];
+
+    size_t iBuffered = 0;
+
+    static std::array<uint32_t, 256> MakeCRC32CTable(void)
+    {
+      std::array<uint32_t, 256> t{};
+
+      for (uint32_t i = 0; i < 256; i++)
+      {
+        uint32_t c = i;
+
+        for (int k = 0; k < 8; k++)
+        {
+          c = (c & 1) ? (0x82F63B78 ^ (c >> 1)) : (c >> 1);
+        }
+
+        t[i] = c;
+      }
+
+      return t;
+    }
+
+    #ifdef NPL_CRC32C_X86
+
+    static bool HasSSE42(void)
+    {
+      #ifdef _MSC_VER
+      static const bool has = [] {
+        int r[4];
+        __cpuid(r, 1);
+        return (r[2] & (1 << 20)) != 0;
+      }();
+      #else
+      static const bool has = __builtin_cpu_supports("sse4.2");
+      #endif
+
+      return has;
+    }
+
+    #ifndef _MSC_VER
+    __attribute__((target("sse4.2")))
+    #endif
+    static uint32_t CRC32CHardware(uint32_t crc, const uint8_t *b, size_t n)
+    {
+      uint64_t c = crc;
+
+      for (; n >= 8; b += 8, n -= 8)
+      {
+        uint64_t v;
+        memcpy(&v, b, 8);
+        c = _mm_crc32_u64(c, v);
+      }
+
+      uint32_t c32 = static_cast<uint32_t>(c);
+
+      while (n--)
+      {
+        c32 = _mm_crc32_u8(c32, *b++);
+      }
+
+      return c32;
+    }
+
+    #endif
+
+    static uint64_t Rotl(uint64_t x, int r)
+    {
+      return (x << r) | (x >> (64 - r));
+    }
+
+    static uint64_t Read64(const uint8_t *p)
+    {
+      uint64_t v;
+      memcpy(&v, p, 8);
+      return v;
+    }
+
+    static uint32_t Read32(const uint8_t *p)
+    {
+      uint32_t v;
+      memcpy(&v, p, 4);
+      return v;
+    }
+
+    static uint64_t Round(uint64_t acc, uint64_t input)
+    {
+      acc += input * XXH_P2;
+      acc = Rotl(acc, 31);
+      return acc * XXH_P1;
+    }
+
+    static uint64_t MergeRound(uint64_t acc, uint64_t v)
+    {
+      acc ^= Round(0, v);
+      return acc * XXH_P1 + XXH_P4;
+    }
+
+    void UpdateXXH64(const uint8_t *b, size_t n)
+    {
+      iTotal += n;
+
+      if (iBuffered)
+      {
+        size_t fill = std::min(n, sizeof(iBuffer) - iBuffered);
+
+        memcpy(iBuffer + iBuffered, b, fill);
+
+        iBuffered += fill;
+        b += fill;
+        n -= fill;
+
+        if (iBuffered < sizeof(iBuffer))
+        {
+          return;
+        }
+
+        for (int i = 0; i < 4; i++)
+        {
+          iV[i] = Round(iV[i], Read64(iBuffer + 8 * i));
+        }
+
+        iBuffered = 0;
+      }
+
+      for (; n >= 32; b += 32, n -= 32)
+      {
+        iV[0] = Round(iV[0], Read64(b));
+        iV[1] = Round(iV[1], Read64(b + 8));
+        iV[2] = Round(iV[2], Read64(b + 16));
+        iV[3] = Round(iV[3], Read64(b + 24));
+      }
+
+      if (n)
+      {
+        memcpy(iBuffer, b, n);
+        iBuffered = n;
+      }
+    }
+
+    uint64_t DigestXXH64(void)
+    {
+      uint64_t h;
+
+      if (iTotal >= 32)
+      {
+        h = Rotl(iV[0], 1) + Rotl(iV[1], 7) + Rotl(iV[2], 12) + Rotl(iV[3], 18);
+
+        for (int i = 0; i < 4; i++)
+        {
+          h = MergeRound(h, iV[i]);
+        }
+      }
+      else
+      {
+        h = XXH_P5;
+      }
+
+      h += iTotal;
+
+      const uint8_t *p = iBuffer;
+
+      size_t n = iBuffered;
+
+      for (; n >= 8; p += 8, n -= 8)
+      {
+        h ^= Round(0, Read64(p));
+        h = Rotl(h, 27) * XXH_P1 + XXH_P4;
+      }
+
+      if (n >= 4)
+      {
+        h ^= static_cast<uint64_t>(Read32(p)) * XXH_P1;
+        h = Rotl(h, 23) * XXH_P2 + XXH_P3;
+        p += 4;
+        n -= 4;
+      }
+
+      while (n--)
+      {
+        h ^= (*p++) * XXH_P5;
+        h = Rotl(h, 11) * XXH_P1;
+      }
+
+      h ^= h >> 33;
+      h *= XXH_P2;
+      h ^= h >> 29;
+      h *= XXH_P3;
+      h ^= h >> 32;
+
+      return h;
+    }
+  };
+}
+
+#endif //CHECKSUM_HPP
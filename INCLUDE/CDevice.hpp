@@ -3,14 +3,19 @@
 
 #include <Common.hpp>
 #include <CSubject.hpp>
+#include <CBufferPool.hpp>
 
+#include <mutex>
+#include <atomic>
 #include <memory>
+#include <vector>
 #include <iostream>
 #include <assert.h>
 #include <inttypes.h>
 
 #ifdef linux
 #include <string.h>
+#include <sys/uio.h>
 #endif
 
 namespace NPL 
@@ -41,6 +46,7 @@ namespace NPL
     #endif
       EIOTYPE         type;
       void          * k;
+      uint64_t        id;
       const uint8_t * b;
       unsigned long   n;
       bool            bFree;
@@ -48,6 +54,22 @@ namespace NPL
 
   constexpr uint32_t DEVICE_BUFFER_SIZE = 256;
 
+  constexpr uint32_t DIRECT_IO_BUFFER_SIZE = (1 * 1024 * 1024);
+
+  /*
+   * scatter/gather element for ReadV/WriteV, 
+   * layout compatible with struct iovec
+   */
+  #ifdef linux
+  using IOVec = struct iovec;
+  #else
+  struct IOVec
+  {
+    void   *iov_base;
+    size_t  iov_len;
+  };
+  #endif
+
   class CDevice : public CSubject<uint8_t, uint8_t>
   {
     public:
@@ -60,21 +82,72 @@ namespace NPL
 
     EDeviceType iDevicetype = EDeviceType::EDevNone;
 
+    /*
+     * opened for reading only, writes to it fail
+     */
+    bool iReadOnly = false;
+
+    #ifdef linux
+    std::string iFileName;
+
+    FD iFDdirect = -1;
+    #endif
+
+    bool iDirectIO = false;
+
+    size_t iAlign = 4096;
+
+    std::mutex iDirectLock;
+
+    std::unique_ptr<CBufferPool> iDirectPool;
+
+    uint8_t *iStage = nullptr;
+
+    uint64_t iStageOffset = 0;
+
+    size_t iStageLen = 0;
+
+    /*
+     * first error of a file read or write, 0 if none; a failed read
+     * still ends with an empty READ, this tells it from end of file
+     */
+    std::atomic<int> iIOError{0};
+
+    std::mutex iWriteLock;
+
+    size_t iWritesInFlight = 0;
+
+    void SetIOError(int e)
+    {
+      int none = 0;
+      iIOError.compare_exchange_strong(none, e ? e : EIO);
+    }
+
+    void EndWrite(void)
+    {
+      std::lock_guard<std::mutex> lg(iWriteLock);
+      iWritesInFlight--;
+    }
+
     public:
 
     CDevice() = default;
 
     #ifdef linux
-    CDevice(const std::string& aFilename, bool bCreateNew)
+    CDevice(const std::string& aFilename, bool bCreateNew, bool bReadOnly = false)
     {
-      int flags = 0|O_RDWR ;
+      iReadOnly = bReadOnly && !bCreateNew;
+
+      int flags = 0|(iReadOnly ? O_RDONLY : O_RDWR)|O_CLOEXEC ;
 
       if (bCreateNew)
       {
-        flags |= O_CREAT;
+        flags |= O_CREAT|O_TRUNC;
       }
 
-      iFD = open(aFilename.c_str(), flags);
+      iFileName = aFilename;
+
+      iFD = open(aFilename.c_str(), flags, 0644);
       
       if (iFD >= 0)
       {
@@ -90,13 +163,17 @@ namespace NPL
     #endif
 
     #ifdef WIN32
-    CDevice(const std::string& aFilename, bool bCreateNew)
+    CDevice(const std::string& aFilename, bool bCreateNew, bool bReadOnly = false)
     {
       iConnected = true;
 
+      iReadOnly = bReadOnly && !bCreateNew;
+
+      DWORD access = iReadOnly ? GENERIC_READ : GENERIC_READ|GENERIC_WRITE;
+
       iFD = CreateFileA(
         aFilename.c_str(),
-        GENERIC_READ|GENERIC_WRITE,
+        access,
         FILE_SHARE_READ|FILE_SHARE_WRITE,
         NULL,
         (bCreateNew ? CREATE_ALWAYS : OPEN_EXISTING),
@@ -111,7 +188,7 @@ namespace NPL
 
       iFDsync = CreateFileA(
               aFilename.c_str(),
-              GENERIC_READ|GENERIC_WRITE,
+              access,
               FILE_SHARE_READ|FILE_SHARE_WRITE,
               NULL,
               OPEN_EXISTING,
@@ -127,13 +204,17 @@ namespace NPL
       iDevicetype = EDeviceType::EDevFile;
     }
 
-    CDevice(const std::wstring& aFilename, bool bCreateNew)
+    CDevice(const std::wstring& aFilename, bool bCreateNew, bool bReadOnly = false)
     {
       iConnected = true;
 
+      iReadOnly = bReadOnly && !bCreateNew;
+
+      DWORD access = iReadOnly ? GENERIC_READ : GENERIC_READ|GENERIC_WRITE;
+
       iFD = CreateFileW(
         aFilename.c_str(),
-        GENERIC_READ|GENERIC_WRITE,
+        access,
         FILE_SHARE_READ|FILE_SHARE_WRITE,
         NULL,
         (bCreateNew ? CREATE_ALWAYS : OPEN_EXISTING),
@@ -148,7 +229,7 @@ namespace NPL
 
       iFDsync = CreateFileW(
               aFilename.c_str(),
-              GENERIC_READ|GENERIC_WRITE,
+              access,
               FILE_SHARE_READ|FILE_SHARE_WRITE,
               NULL,
               OPEN_EXISTING,
@@ -167,10 +248,18 @@ namespace NPL
 
     virtual ~CDevice()
     {
+      MarkDestroying();
+
       if (iDevicetype == EDeviceType::EDevFile)
       {
+        #ifdef linux
+        SetDirectIO(false);
+
+        if (iFD >= 0) close(iFD);
+        #else
         CloseHandle(iFD);
         CloseHandle(iFDsync);
+        #endif
       }
     }
 
@@ -179,6 +268,218 @@ namespace NPL
       return iDevicetype;
     }
 
+    virtual bool IsWriteBlocked(void)
+    {
+      return false;
+    }
+
+    /*
+     * Linux only. File I/O bypasses the page cache (O_DIRECT) on a 
+     * second descriptor. Writes are staged in an aligned buffer and 
+     * go out in aligned blocks, the unaligned head and tail of a run 
+     * of writes through the buffered descriptor. Reads of unaligned 
+     * ranges are bounced through an aligned buffer. Returns false if 
+     * the filesystem does not support direct I/O.
+     */
+    virtual bool SetDirectIO(bool enable, size_t align = 4096)
+    {
+      #ifdef linux
+
+      std::lock_guard<std::mutex> lg(iDirectLock);
+
+      if (iDevicetype != EDeviceType::EDevFile)
+      {
+        return false;
+      }
+
+      if (!enable)
+      {
+        if (iDirectIO)
+        {
+          FlushStage();
+
+          iDirectPool->Put(iStage);
+
+          iStage = nullptr;
+
+          close(iFDdirect);
+
+          iFDdirect = -1;
+
+          iDirectIO = false;
+        }
+
+        return true;
+      }
+
+      if (iDirectIO)
+      {
+        return true;
+      }
+
+      iFDdirect = open(iFileName.c_str(), (iReadOnly ? O_RDONLY : O_RDWR)|O_CLOEXEC|O_DIRECT);
+
+      if (iFDdirect < 0)
+      {
+        std::cout << GetProperty("name") << " O_DIRECT open failed, error : " << strerror(errno) << "\n";
+        return false;
+      }
+
+      if (!iDirectPool || iDirectPool->GetAlignment() != align)
+      {
+        /*
+         * one staging and three bounce buffers
+         */
+        iDirectPool = std::make_unique<CBufferPool>(4, DIRECT_IO_BUFFER_SIZE, align);
+      }
+
+      iAlign = align;
+
+      iStage = iDirectPool->Get();
+
+      iStageLen = 0;
+
+      iDirectIO = true;
+
+      return true;
+
+      #else
+
+      return false;
+
+      #endif
+    }
+
+    /*
+     * the errno of the first file read or write that failed, 0 if
+     * none did
+     */
+    virtual int GetIOError(void)
+    {
+      return iIOError;
+    }
+
+    /*
+     * file writes handed to the I/O engine and not yet in the file;
+     * each one ends with a WRITE completion, so whoever waits for
+     * the count to drop checks it again from there
+     */
+    virtual size_t GetWritesInFlight(void)
+    {
+      std::lock_guard<std::mutex> lg(iWriteLock);
+
+      return iWritesInFlight;
+    }
+
+    /*
+     * writes out what direct I/O has staged
+     */
+    virtual bool Flush(void)
+    {
+      #ifdef linux
+
+      std::lock_guard<std::mutex> lg(iDirectLock);
+
+      return FlushStage();
+
+      #else
+
+      return true;
+
+      #endif
+    }
+
+    /*
+     * Flush() on the I/O engine, counted and completed like a write;
+     * false if nothing is staged
+     */
+    virtual bool FlushAsync(void)
+    {
+      #ifdef linux
+
+      {
+        std::lock_guard<std::mutex> lg(iDirectLock);
+
+        if (!iDirectIO || !iStageLen)
+        {
+          return false;
+        }
+      }
+
+      {
+        std::lock_guard<std::mutex> lg(iWriteLock);
+        iWritesInFlight++;
+      }
+
+      auto self = std::static_pointer_cast<CDevice>(this->shared_from_this());
+
+      auto job = [self] () {
+        if (!self->Flush()) self->SetIOError(errno);
+
+        Context *ctx = (Context *) calloc(1, sizeof(Context));
+
+        ctx->type = EIOTYPE::WRITE;
+
+        self->EndWrite();
+        self->QueuePendingContext(self, ctx);
+      };
+
+      if (!SubmitFileIO(job))
+      {
+        job();
+      }
+
+      return true;
+
+      #else
+
+      return false;
+
+      #endif
+    }
+
+    /*
+     * reserves disk space for a file that will grow to "size" bytes 
+     * without changing its current size, so a partial file still 
+     * shows how much has been written
+     */
+    virtual bool Preallocate(uint64_t size)
+    {
+      #ifdef linux
+
+      if (fallocate(iFD, FALLOC_FL_KEEP_SIZE, 0, static_cast<off_t>(size)) == 0)
+      {
+        return true;
+      }
+
+      std::cout << GetProperty("name") << " fallocate failed, error : " << strerror(errno) << "\n";
+
+      #else
+
+      FILE_ALLOCATION_INFO fai;
+
+      fai.AllocationSize.QuadPart = size;
+
+      if (SetFileInformationByHandle(iFD, FileAllocationInfo, &fai, sizeof(fai)))
+      {
+        return true;
+      }
+
+      std::cout << GetProperty("name") << " SetFileInformationByHandle failed : " << GetLastError() << "\n";
+
+      #endif
+
+      return false;
+    }
+
+    /*
+     * On Linux file reads and writes go to the dispatcher's file I/O
+     * engine and complete like they do on IOCP: Read() returns nullptr
+     * and the READ (or WRITE) context is delivered later. Only when
+     * the engine can not take the job the I/O is done inline: a read
+     * returns its context, for the caller to QueuePendingContext(), a
+     * write queues its own.
+     */
     virtual void * Read(const uint8_t *b = nullptr, size_t l = 0, uint64_t o = 0) override
     {
       if (!iConnected)
@@ -200,14 +501,47 @@ namespace NPL
       {
         ctx->b = (uint8_t *) calloc(1, DEVICE_BUFFER_SIZE);
         ctx->bFree = true;
-        l = DEVICE_BUFFER_SIZE;
+        l = (l && l < DEVICE_BUFFER_SIZE) ? l : DEVICE_BUFFER_SIZE;
       }
 
       #ifdef linux
 
-      ctx->n = read(iFD, (void *) ctx->b, l);
+      if (iDevicetype == EDeviceType::EDevFile)
+      {
+        auto self = std::static_pointer_cast<CDevice>(this->shared_from_this());
+
+        /*
+         * an I/O error ends the read like end of file, GetIOError()
+         * tells the two apart
+         */
+        bool queued = SubmitFileIO([self, ctx, l, o] () {
+          int32_t rc = self->ReadSync(ctx->b, l, o);
+          if (rc < 0) self->SetIOError(errno);
+          ctx->n = (rc > 0) ? rc : 0;
+          self->QueuePendingContext(self, ctx);
+        });
+
+        if (queued)
+        {
+          return nullptr;
+        }
+      }
+
+      ctx->n = (iDevicetype == EDeviceType::EDevFile) ? 
+                 pread(iFD, (void *) ctx->b, l, o) : 
+                 read(iFD, (void *) ctx->b, l);
+
+      if ((int)ctx->n == -1 && iDevicetype == EDeviceType::EDevFile)
+      {
+        std::cout << GetProperty("name") << " pread() failed, error : " << strerror(errno) << "\n";
+
+        SetIOError(errno);
 
-      if ((int)ctx->n == -1)
+        ctx->n = 0;
+
+        return (void *) ctx;
+      }
+      else if ((int)ctx->n == -1)
       {
         std::cout << GetProperty("name") << " read() failed, error : " << strerror(errno) << "\n";
 
@@ -254,6 +588,59 @@ namespace NPL
 
       #ifdef linux
 
+      if (iDevicetype == EDeviceType::EDevFile)
+      {
+        Context *ctx = (Context *) calloc(1, sizeof(Context));
+
+        ctx->type = EIOTYPE::WRITE;
+
+        ctx->b = (uint8_t *) calloc(l, 1);
+
+        memmove((void *)ctx->b, b, l);
+
+        ctx->bFree = true;
+
+        auto self = std::static_pointer_cast<CDevice>(this->shared_from_this());
+
+        {
+          std::lock_guard<std::mutex> lg(iWriteLock);
+          iWritesInFlight++;
+        }
+
+        bool queued = SubmitFileIO([self, ctx, l, o] () {
+          int32_t rc = self->WriteSync(ctx->b, l, o);
+          if (rc != (int32_t) l) self->SetIOError(rc < 0 ? errno : EIO);
+          ctx->n = (rc > 0) ? rc : 0;
+          self->EndWrite();
+          self->QueuePendingContext(self, ctx);
+        });
+
+        if (queued)
+        {
+          return;
+        }
+
+        EndWrite();
+
+        /*
+         * the engine is full, written inline but completed the
+         * same way
+         */
+        int32_t rc = WriteSync(ctx->b, l, o);
+
+        if (rc != (int32_t) l)
+        {
+          std::cout << GetProperty("name") << " CDevice::Write() failed, error : " << strerror(errno) << "\n";
+          SetIOError(rc < 0 ? errno : EIO);
+        }
+
+        ctx->n = (rc > 0) ? rc : 0;
+
+        QueuePendingContext(self, ctx);
+
+        return;
+      }
+
       int rc = write(iFD, b, l);
 
       if (rc == -1)
@@ -287,8 +674,27 @@ namespace NPL
       #endif
     }
 
+    /*
+     * On Linux positional reads and writes never touch the file 
+     * position, so any number of them may be outstanding on one 
+     * device at different offsets. On Windows they seek the shared
+     * synchronous handle first, so only one may run at a time. The 
+     * Sync variants loop over short transfers and return the byte 
+     * count (short only at end of file) or -1.
+     */
     virtual int32_t ReadSync(const uint8_t *b = nullptr, size_t l = 0, uint64_t o = 0) override
     {
+      #ifdef linux
+
+      if (iDirectIO)
+      {
+        return ReadDirect(b, l, o);
+      }
+
+      return PRead(iFD, b, l, o);
+
+      #else
+
       DWORD nBytesRead;
       LARGE_INTEGER offset;
       offset.QuadPart = o;
@@ -314,10 +720,23 @@ namespace NPL
       }
 
       return -1;
+
+      #endif
     }
 
     virtual int32_t WriteSync(const uint8_t *b = nullptr, size_t l = 0, uint64_t o = 0) override
     {
+      #ifdef linux
+
+      if (iDirectIO)
+      {
+        return WriteDirect(b, l, o);
+      }
+
+      return PWrite(iFD, b, l, o);
+
+      #else
+
       DWORD nBytesWritten;
       LARGE_INTEGER offset;
       offset.QuadPart = o;
@@ -343,7 +762,350 @@ namespace NPL
       }
 
       return -1;
+
+      #endif
+    }
+
+    /*
+     * scatter read of cnt buffers starting at file offset o 
+     * (preadv on Linux); returns the bytes read or -1
+     */
+    virtual int64_t ReadV(const IOVec *v, int cnt, uint64_t o)
+    {
+      #ifdef linux
+
+      if (!iDirectIO)
+      {
+        ssize_t rc;
+
+        do
+        {
+          rc = preadv(iFD, v, cnt, static_cast<off_t>(o));
+        } while (rc == -1 && errno == EINTR);
+
+        if (rc == -1)
+        {
+          std::cout << GetProperty("name") << " ReadV preadv failed, error : " << strerror(errno) << "\n";
+        }
+
+        return rc;
+      }
+
+      #endif
+
+      int64_t total = 0;
+
+      for (int i = 0; i < cnt; i++)
+      {
+        int32_t rc = ReadSync((const uint8_t *) v[i].iov_base, v[i].iov_len, o + total);
+
+        if (rc < 0) return -1;
+
+        total += rc;
+
+        if ((size_t) rc < v[i].iov_len) break;
+      }
+
+      return total;
     }
+
+    /*
+     * gather write of cnt buffers at file offset o (pwritev on 
+     * Linux); short writes are completed, returns the bytes 
+     * written or -1
+     */
+    virtual int64_t WriteV(const IOVec *v, int cnt, uint64_t o)
+    {
+      int64_t total = 0;
+
+      #ifdef linux
+
+      if (iDirectIO)
+      {
+        for (int i = 0; i < cnt; i++)
+        {
+          if (WriteDirect((const uint8_t *) v[i].iov_base, v[i].iov_len, o + total) < 0) return -1;
+
+          total += v[i].iov_len;
+        }
+
+        return total;
+      }
+
+      std::vector<IOVec> iov(v, v + cnt);
+
+      IOVec *p = iov.data();
+
+      while (cnt)
+      {
+        ssize_t rc = pwritev(iFD, p, cnt, static_cast<off_t>(o + total));
+
+        if (rc == -1)
+        {
+          if (errno == EINTR) continue;
+
+          std::cout << GetProperty("name") << " WriteV pwritev failed, error : " << strerror(errno) << "\n";
+
+          return -1;
+        }
+
+        total += rc;
+
+        while (cnt && (size_t) rc >= p->iov_len)
+        {
+          rc -= p->iov_len;
+          p++;
+          cnt--;
+        }
+
+        if (cnt)
+        {
+          p->iov_base = (uint8_t *) p->iov_base + rc;
+          p->iov_len -= rc;
+        }
+      }
+
+      #else
+
+      for (int i = 0; i < cnt; i++)
+      {
+        int32_t rc = WriteSync((const uint8_t *) v[i].iov_base, v[i].iov_len, o + total);
+
+        if (rc < 0) return -1;
+
+        total += rc;
+      }
+
+      #endif
+
+      return total;
+    }
+
+    protected:
+
+    #ifdef linux
+
+    int32_t PRead(FD fd, const uint8_t *b, size_t l, uint64_t o)
+    {
+      size_t done = 0;
+
+      while (done < l)
+      {
+        ssize_t rc = pread(fd, (void *)(b + done), l - done, o + done);
+
+        if (rc == -1)
+        {
+          if (errno == EINTR) continue;
+
+          std::cout << GetProperty("name") << " ReadSync pread failed, error : " << strerror(errno) << "\n";
+
+          return -1;
+        }
+
+        if (rc == 0) break;
+
+        done += rc;
+      }
+
+      return static_cast<int32_t>(done);
+    }
+
+    int32_t PWrite(FD fd, const uint8_t *b, size_t l, uint64_t o)
+    {
+      size_t done = 0;
+
+      while (done < l)
+      {
+        ssize_t rc = pwrite(fd, b + done, l - done, o + done);
+
+        if (rc == -1)
+        {
+          if (errno == EINTR) continue;
+
+          std::cout << GetProperty("name") << " WriteSync pwrite failed, error : " << strerror(errno) << "\n";
+
+          return -1;
+        }
+
+        done += rc;
+      }
+
+      return static_cast<int32_t>(done);
+    }
+
+    uint64_t AlignUp(uint64_t x)
+    {
+      return (x + iAlign - 1) / iAlign * iAlign;
+    }
+
+    /*
+     * appends to the staged run if the write continues it, else the 
+     * run is flushed first; full staging buffers go out right away
+     */
+    int32_t WriteDirect(const uint8_t *b, size_t l, uint64_t o)
+    {
+      std::lock_guard<std::mutex> lg(iDirectLock);
+
+      if (iStageLen && o != iStageOffset + iStageLen)
+      {
+        if (!FlushStage()) return -1;
+      }
+
+      if (!iStageLen && (o % iAlign) == 0 && (l % iAlign) == 0 && (reinterpret_cast<uintptr_t>(b) % iAlign) == 0)
+      {
+        /*
+         * already aligned, e.g. a write-behind block
+         */
+        return PWrite(iFDdirect, b, l, o);
+      }
+
+      size_t done = 0;
+
+      if (!iStageLen)
+      {
+        if (o % iAlign)
+        {
+          done = std::min<size_t>(l, iAlign - (o % iAlign));
+
+          if (PWrite(iFD, b, done, o) < 0) return -1;
+        }
+
+        iStageOffset = o + done;
+      }
+
+      while (done < l)
+      {
+        size_t n = std::min<size_t>(l - done, iDirectPool->GetBufferSize() - iStageLen);
+
+        memmove(iStage + iStageLen, b + done, n);
+
+        iStageLen += n;
+
+        done += n;
+
+        if (iStageLen == iDirectPool->GetBufferSize())
+        {
+          if (PWrite(iFDdirect, iStage, iStageLen, iStageOffset) < 0) return -1;
+
+          iStageOffset += iStageLen;
+
+          iStageLen = 0;
+        }
+      }
+
+      return static_cast<int32_t>(l);
+    }
+
+    /*
+     * called with iDirectLock held; the aligned part of the staged 
+     * run is written direct, the unaligned tail buffered
+     */
+    bool FlushStage(void)
+    {
+      if (!iStageLen) return true;
+
+      size_t aligned = iStageLen - (iStageLen % iAlign);
+
+      if (aligned && PWrite(iFDdirect, iStage, aligned, iStageOffset) < 0)
+      {
+        return false;
+      }
+
+      if (iStageLen > aligned && PWrite(iFD, iStage + aligned, iStageLen - aligned, iStageOffset + aligned) < 0)
+      {
+        return false;
+      }
+
+      iStageOffset += iStageLen;
+
+      iStageLen = 0;
+
+      return true;
+    }
+
+    /*
+     * staged writes are flushed first so that reads see them; an 
+     * unaligned range is read in aligned spans through a bounce 
+     * buffer, or buffered if none is free
+     */
+    int32_t ReadDirect(const uint8_t *b, size_t l, uint64_t o)
+    {
+      {
+        std::lock_guard<std::mutex> lg(iDirectLock);
+
+        if (!FlushStage()) return -1;
+      }
+
+      if ((reinterpret_cast<uintptr_t>(b) % iAlign) == 0 && (o % iAlign) == 0 && (l % iAlign) == 0)
+      {
+        return PReadOnce(b, l, o);
+      }
+
+      uint8_t *bounce = iDirectPool->Get();
+
+      if (!bounce)
+      {
+        return PRead(iFD, b, l, o);
+      }
+
+      size_t done = 0;
+
+      while (done < l)
+      {
+        uint64_t pos = o + done;
+
+        uint64_t start = pos - (pos % iAlign);
+
+        size_t span = static_cast<size_t>(std::min<uint64_t>(iDirectPool->GetBufferSize(), AlignUp(o + l) - start));
+
+        int32_t rc = PReadOnce(bounce, span, start);
+
+        if (rc < 0)
+        {
+          iDirectPool->Put(bounce);
+          return -1;
+        }
+
+        size_t skip = static_cast<size_t>(pos - start);
+
+        if ((size_t) rc <= skip) break;
+
+        size_t n = std::min<size_t>(l - done, rc - skip);
+
+        memmove((void *)(b + done), bounce + skip, n);
+
+        done += n;
+
+        if ((size_t) rc < span) break;
+      }
+
+      iDirectPool->Put(bounce);
+
+      return static_cast<int32_t>(done);
+    }
+
+    /*
+     * a direct read is short only at end of file, and can not be 
+     * continued from the unaligned offset it stops at
+     */
+    int32_t PReadOnce(const uint8_t *b, size_t l, uint64_t o)
+    {
+      ssize_t rc;
+
+      do
+      {
+        rc = pread(iFDdirect, (void *) b, l, o);
+      } while (rc == -1 && errno == EINTR);
+
+      if (rc == -1)
+      {
+        std::cout << GetProperty("name") << " O_DIRECT pread failed, error : " << strerror(errno) << "\n";
+      }
+
+      return static_cast<int32_t>(rc);
+    }
+
+    #endif
   };
 
   const char EIOToChar(EIOTYPE t)
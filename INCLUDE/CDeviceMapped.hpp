@@ -0,0 +1,267 @@
+#ifndef DEVICEMAPPED_HPP
+#define DEVICEMAPPED_HPP
+
+#include <CDevice.hpp>
+
+#include <string>
+#include <iostream>
+#include <algorithm>
+
+#ifdef linux
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+namespace NPL
+{
+  constexpr uint32_t MAPPED_READ_SIZE = (256 * 1024);
+
+  constexpr uint32_t MAPPED_WINDOW_SIZE = (64 * 1024 * 1024);
+
+  constexpr uint32_t MAPPED_PREFETCH_SIZE = (4 * 1024 * 1024);
+
+  struct MapSlice
+  {
+    const uint8_t *b;
+    size_t         n;
+  };
+
+  /*
+   * Read-only file device that maps the file, "window" bytes of it
+   * at a time, instead of reading it into freshly allocated buffers.
+   * Read() without a buffer delivers a READ context pointing into the
+   * mapping, so an upload sends (or encrypts) straight from the page
+   * cache. A slice stays valid until a read outside the current window
+   * remaps it; one outstanding read at a time, as the FTP upload path
+   * does, is always safe. The window is mapped with a sequential
+   * access hint and the data ahead of each read is prefetched.
+   */
+  class CDeviceMapped : public CDevice
+  {
+    public:
+
+    CDeviceMapped(const std::string& aFilename, size_t window = MAPPED_WINDOW_SIZE) : CDevice(aFilename, false, true)
+    {
+      #ifdef linux
+
+      iGranularity = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+
+      struct stat st;
+
+      iFileSize = (iConnected && fstat(iFD, &st) == 0) ? st.st_size : 0;
+
+      #else
+
+      SYSTEM_INFO si;
+
+      GetSystemInfo(&si);
+
+      iGranularity = si.dwAllocationGranularity;
+
+      LARGE_INTEGER size;
+
+      iFileSize = (iConnected && GetFileSizeEx(iFD, &size)) ? size.QuadPart : 0;
+
+      if (iFileSize)
+      {
+        iMapping = CreateFileMappingA(iFD, NULL, PAGE_READONLY, 0, 0, NULL);
+
+        if (!iMapping)
+        {
+          std::cout << "CDeviceMapped() " << aFilename << ", CreateFileMapping Error : " << GetLastError() << "\n";
+        }
+      }
+
+      #endif
+
+      iWindow = std::max<size_t>((window + iGranularity - 1) / iGranularity * iGranularity, iGranularity);
+    }
+
+    virtual ~CDeviceMapped()
+    {
+      MarkDestroying();
+
+      Unmap();
+
+      #ifdef WIN32
+      if (iMapping)
+      {
+        CloseHandle(iMapping);
+      }
+      #endif
+    }
+
+    virtual uint64_t GetFileSize(void)
+    {
+      return iFileSize;
+    }
+
+    /*
+     * up to l bytes at offset o, fewer at the end of the window or
+     * of the file; n is 0 at end of file and when the window can not
+     * be mapped, GetIOError() tells the two apart
+     */
+    virtual MapSlice GetSlice(uint64_t o, size_t l)
+    {
+      if (o >= iFileSize || !l)
+      {
+        return { nullptr, 0 };
+      }
+
+      if (!iBase || o < iWinOffset || o >= iWinOffset + iWinLen)
+      {
+        if (!MapWindow(o))
+        {
+          return { nullptr, 0 };
+        }
+      }
+
+      size_t n = static_cast<size_t>(std::min<uint64_t>(l, iWinOffset + iWinLen - o));
+
+      Prefetch(o + n);
+
+      return { iBase + (o - iWinOffset), n };
+    }
+
+    /*
+     * reads into a caller's buffer are ordinary file reads
+     */
+    virtual void * Read(const uint8_t *b = nullptr, size_t l = 0, uint64_t o = 0) override
+    {
+      if (b)
+      {
+        return CDevice::Read(b, l, o);
+      }
+
+      auto s = GetSlice(o, l ? l : MAPPED_READ_SIZE);
+
+      Context *ctx = (Context *) calloc(1, sizeof(Context));
+
+      ctx->type = EIOTYPE::READ;
+      ctx->b = s.b;
+      ctx->n = static_cast<unsigned long>(s.n);
+      ctx->bFree = false;
+
+      QueuePendingContext(shared_from_this(), ctx);
+
+      return nullptr;
+    }
+
+    protected:
+
+    uint64_t iFileSize = 0;
+
+    size_t iGranularity = 4096;
+
+    size_t iWindow = MAPPED_WINDOW_SIZE;
+
+    uint8_t *iBase = nullptr;
+
+    uint64_t iWinOffset = 0;
+
+    size_t iWinLen = 0;
+
+    uint64_t iPrefetched = 0;
+
+    #ifdef WIN32
+    HANDLE iMapping = NULL;
+    #endif
+
+    virtual bool MapWindow(uint64_t o)
+    {
+      Unmap();
+
+      uint64_t start = o - (o % iGranularity);
+
+      size_t len = static_cast<size_t>(std::min<uint64_t>(iWindow, iFileSize - start));
+
+      #ifdef linux
+
+      void *p = mmap(nullptr, len, PROT_READ, MAP_SHARED, iFD, static_cast<off_t>(start));
+
+      if (p == MAP_FAILED)
+      {
+        std::cout << GetProperty("name") << " mmap failed, error : " << strerror(errno) << "\n";
+        SetIOError(errno);
+        return false;
+      }
+
+      madvise(p, len, MADV_SEQUENTIAL);
+
+      #else
+
+      if (!iMapping)
+      {
+        SetIOError(EIO);
+        return false;
+      }
+
+      void *p = MapViewOfFile(iMapping, FILE_MAP_READ,
+                  static_cast<DWORD>(start >> 32),
+                  static_cast<DWORD>(start & 0xFFFFFFFF),
+                  len);
+
+      if (!p)
+      {
+        std::cout << GetProperty("name") << " MapViewOfFile failed : " << GetLastError() << "\n";
+        SetIOError(EIO);
+        return false;
+      }
+
+      #endif
+
+      iBase = (uint8_t *) p;
+      iWinOffset = start;
+      iWinLen = len;
+      iPrefetched = start;
+
+      return true;
+    }
+
+    virtual void Unmap(void)
+    {
+      if (!iBase) return;
+
+      #ifdef linux
+      munmap(iBase, iWinLen);
+      #else
+      UnmapViewOfFile(iBase);
+      #endif
+
+      iBase = nullptr;
+      iWinLen = 0;
+    }
+
+    /*
+     * keeps up to MAPPED_PREFETCH_SIZE bytes past offset o
+     * requested, in steps of at least half that
+     */
+    virtual void Prefetch(uint64_t o)
+    {
+      #ifdef linux
+
+      uint64_t winEnd = iWinOffset + iWinLen;
+
+      uint64_t end = std::min<uint64_t>(o + MAPPED_PREFETCH_SIZE, winEnd);
+
+      if (iPrefetched >= end || (end - iPrefetched < MAPPED_PREFETCH_SIZE / 2 && end < winEnd))
+      {
+        return;
+      }
+
+      uint64_t from = std::max(iPrefetched, o);
+
+      from -= from % iGranularity;
+
+      madvise(iBase + (from - iWinOffset), static_cast<size_t>(end - from), MADV_WILLNEED);
+
+      iPrefetched = end;
+
+      #endif
+    }
+  };
+
+  using SPCDeviceMapped = std::shared_ptr<CDeviceMapped>;
+}
+
+#endif //DEVICEMAPPED_HPP
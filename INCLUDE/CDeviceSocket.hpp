@@ -2,13 +2,21 @@
 #define SOCKET_HPP
 
 #include <CDevice.hpp>
+#include <CTokenBucket.hpp>
 
+#include <mutex>
 #include <memory>
 #include <string>
 
+#include <algorithm>
+
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 
+#ifdef linux
+#include <sys/sendfile.h>
+#endif
+
 namespace NPL 
 {
   using TOnHandshake = std::function<void (void)>;
@@ -55,9 +63,48 @@ namespace NPL
 
     bool iHandshakeDone = false;
 
+    bool iWriteBlocked = false;
+
+    std::string iPendingTx;
+
+    /*
+     * the SSL object, its write BIO and iPendingTx are used by the
+     * dispatcher thread (OnRead, OnWrite) and by writers on other
+     * threads (Write, TryWrite); recursive as draining the BIO may
+     * stop the socket, which drains it again
+     */
+    std::recursive_mutex iTxLock;
+
+    SPCTokenBucket iRxBucket = nullptr;
+
+    SPCTokenBucket iTxBucket = nullptr;
+
+    bool iReadPaused = false;
+
+    bool iWritePaused = false;
+
+    bool iReadHeld = false;
+
+    #ifdef linux
+
+    int iPipe[2] = { -1, -1 };
+
+    FD iSpliceFD = -1;
+
+    uint64_t iSpliceOffset = 0;
+
+    uint64_t iSpliceRemaining = 0;
+
+    bool iSpliceLimited = false;
+
+    #endif
+
     TOnHandshake iOnHandShake = nullptr;
 
-    uint32_t iSocketType = ESocketType::EInvalidSocket;
+    /*
+     * set on the starting thread, read on the dispatcher thread
+     */
+    std::atomic<uint32_t> iSocketType{ESocketType::EInvalidSocket};
 
     public:
 
@@ -77,6 +124,7 @@ namespace NPL
 
     ~CDeviceSocket()
     {
+      MarkDestroying();
       std::cout << "~CDeviceSocket : " << GetProperty("name") << " ->\n";
       StopSocket();
       shutdown((SOCKET)iFD, 0); //sd_recv
@@ -85,6 +133,13 @@ namespace NPL
       {
         SSL_free(ssl);
       }
+      #ifdef linux
+      if (iPipe[0] >= 0)
+      {
+        close(iPipe[0]);
+        close(iPipe[1]);
+      }
+      #endif
       std::cout << "~" << GetProperty("name") << " shutdown(sd_recv)\n";
     }
 
@@ -92,6 +147,8 @@ namespace NPL
     {
       if (!iStopped)
       {
+        std::lock_guard<std::recursive_mutex> lg(iTxLock);
+
         if (ssl)
         {
           int flag = SSL_get_shutdown(ssl);
@@ -116,8 +173,6 @@ namespace NPL
     {
       assert(iHost.size() && iPort);
 
-      iSocketType = ESocketType::EClientSocket;
-
       #ifdef linux
 
         SetSocketBlockingEnabled(iFD, false);
@@ -132,8 +187,15 @@ namespace NPL
 
         int rc = connect((SOCKET)iFD, (const sockaddr *) &sa, sizeof(sa));
 
+        /*
+         * only now is the readiness of the socket the connect's
+         */
+        iSocketType = ESocketType::EClientSocket;
+
       #else
 
+        iSocketType = ESocketType::EClientSocket;
+
         struct sockaddr_in addr;
         ZeroMemory(&addr, sizeof(addr));
         addr.sin_addr.s_addr = INADDR_ANY;
@@ -296,6 +358,27 @@ namespace NPL
       iPort = aPort;
     }
 
+    virtual const std::string& GetHost(void)
+    {
+      return iHost;
+    }
+
+    virtual int GetPort(void)
+    {
+      return iPort;
+    }
+
+    /*
+     * Zero linger, closing the socket sends a RST instead 
+     * of a FIN and discards any data still in flight
+     */
+    virtual void SetAbortiveClose(void)
+    {
+      struct linger l = { 1, 0 };
+
+      setsockopt((SOCKET)iFD, SOL_SOCKET, SO_LINGER, (const char *) &l, sizeof(l));
+    }
+
     virtual void CheckPeerSSLShutdown()
     {
       int flag = SSL_get_shutdown(ssl);
@@ -313,6 +396,8 @@ namespace NPL
 
     virtual void UpdateWBIO()
     {
+      std::lock_guard<std::recursive_mutex> lg(iTxLock);
+
       CheckPeerSSLShutdown();
 
       int pending = BIO_pending(wbio);
@@ -325,7 +410,14 @@ namespace NPL
       {
         int rc = BIO_read(wbio, buf, BioRBufSize);
 
-        CDevice::Write(buf, rc);
+        if (iPendingTx.size())
+        {
+          iPendingTx.append((char *) buf, rc);
+        }
+        else
+        {
+          CDevice::Write(buf, rc);
+        }
 
         pending = BIO_pending(wbio);
       }
@@ -361,7 +453,7 @@ namespace NPL
 
       iConnectedClient.reset();
 
-      iConnectedClient = std::make_shared<CDeviceSocket>(iAS);
+      iConnectedClient = MakeAcceptedSocket(iAS);
 
       iConnectedClient->iSocketType = ESocketType::EAcceptedSocket;
 
@@ -369,8 +461,17 @@ namespace NPL
 
       iConnectedClient->iConnected = true;
 
+      /*
+       * none while the dispatcher is being torn down
+       */
       auto D = GetDispatcher();
 
+      if (!D)
+      {
+        iConnectedClient.reset();
+        return;
+      }
+
       D->AddEventListener(iConnectedClient);
 
       CDevice::OnAccept();
@@ -384,6 +485,18 @@ namespace NPL
 
     virtual void OnConnect() override
     {
+      #ifdef linux
+      /*
+       * a socket is watched from the time it is added; not started
+       * yet, or accepted and since disconnected, it reports EPOLLOUT
+       * | EPOLLHUP, which is no connect
+       */
+      if (!IsClientSocket())
+      {
+        return;
+      }
+      #endif
+
       assert(IsClientSocket());
 
       CDevice::OnConnect();
@@ -416,6 +529,10 @@ namespace NPL
 
       if (ssl)
       {
+        std::unique_lock<std::recursive_mutex> ul(iTxLock);
+
+        bool handshake = false;
+
         int rc = BIO_write(rbio, b, static_cast<int>(n));
 
         assert(rc == n);
@@ -428,12 +545,9 @@ namespace NPL
           {
             iHandshakeDone = true;
 
-            std::cout << GetProperty("name") << " handshake done\n";
+            handshake = true;
 
-            if (iOnHandShake)
-            {
-              iOnHandShake();
-            }
+            std::cout << GetProperty("name") << " handshake done\n";
           }
         }
 
@@ -458,6 +572,17 @@ namespace NPL
 
         UpdateWBIO();
 
+        /*
+         * the lock is not held into the callbacks, they may write
+         * from behind locks of their own
+         */
+        ul.unlock();
+
+        if (handshake && iOnHandShake)
+        {
+          iOnHandShake();
+        }
+
         if (msg.size())
         {
           _b = (uint8_t *)msg.data(), _n = msg.size();
@@ -473,13 +598,27 @@ namespace NPL
 
     virtual void OnWrite(const uint8_t *b, size_t n) override
     {
-      if (ssl)
       {
-        if (!iHandshakeDone)
+        std::lock_guard<std::recursive_mutex> lg(iTxLock);
+
+        iWriteBlocked = false;
+
+        if (ssl)
         {
-          SSL_do_handshake(ssl);
-          return;
+          if (!iHandshakeDone)
+          {
+            SSL_do_handshake(ssl);
+            return;
+          }
         }
+
+        #ifdef linux
+        /*
+         * the tail of a record TryWrite could not send goes out first,
+         * also when nothing else is queued behind it
+         */
+        FlushPendingTx();
+        #endif
       }
 
       CDevice::OnWrite(b, n);
@@ -509,15 +648,77 @@ namespace NPL
 
         return ctx;
       }
-      #endif
 
+      if (iRxBucket && !b)
+      {
+        size_t avail = iRxBucket->Available();
+
+        if (!avail)
+        {
+          PauseRead(iRxBucket->DelayMs(DEVICE_BUFFER_SIZE));
+          return nullptr;
+        }
+
+        l = avail;
+      }
+
+      if (iSpliceFD >= 0)
+      {
+        return Meter(iRxBucket, SpliceRead(l));
+      }
+
+      return Meter(iRxBucket, CDevice::Read(b, l, o));
+      #else
       return CDevice::Read(b, l, o);
+      #endif
+    }
+
+    /*
+     * Shapes this socket to the given buckets, either may be null. 
+     * While a bucket is empty the socket stops asking the dispatcher 
+     * for read or write readiness and resumes from a timer once 
+     * enough tokens have accumulated; the dispatcher thread never 
+     * sleeps. Write() is metered but not held back, callers pace 
+     * themselves with GetTxDelayMs(). Linux only.
+     */
+    virtual void SetRateLimit(SPCTokenBucket rx, SPCTokenBucket tx)
+    {
+      iRxBucket = rx;
+      iTxBucket = tx;
+    }
+
+    /*
+     * ms until the tx bucket allows another buffer, 0 if unshaped
+     */
+    virtual uint32_t GetTxDelayMs(void)
+    {
+      return iTxBucket ? iTxBucket->DelayMs(DEVICE_BUFFER_SIZE) : 0;
+    }
+
+    /*
+     * stops reading until HoldRead(false), for a consumer that has
+     * fallen behind, e.g. a download whose disk writes are all busy.
+     * Independent of the rate limit pauses. Linux only.
+     */
+    virtual void HoldRead(bool hold)
+    {
+      if (iReadHeld == hold) return;
+
+      iReadHeld = hold;
+
+      UpdateEventInterest();
     }
 
     virtual void Write(const uint8_t *b = nullptr, size_t l = 0, uint64_t o = 0) override
     {
+      if (iTxBucket)
+      {
+        iTxBucket->Consume(l);
+      }
+
       if (ssl)
       {
+        std::lock_guard<std::recursive_mutex> lg(iTxLock);
         SSL_write(ssl, b, static_cast<int>(l));
         UpdateWBIO();
       }
@@ -526,9 +727,385 @@ namespace NPL
         CDevice::Write(b, l);
       }
     }
+
+    /*
+     * Non blocking send. Returns the number of bytes accepted, 0 if 
+     * the socket would block, -1 on error. A short or zero count 
+     * marks the socket write blocked; the dispatcher then delivers 
+     * OnWrite(nullptr, 0) once the socket becomes writable again.
+     * With TLS at most one record (16 KiB of plaintext) is accepted
+     * per call and any ciphertext the kernel did not take is held in
+     * iPendingTx; no new record is taken until that is sent, so it
+     * never holds more than one record. Elsewhere than Linux this is
+     * a plain, blocking Write() that always accepts all l bytes, so
+     * a caller never sees the socket back up.
+     */
+    virtual int32_t TryWrite(const uint8_t *b, size_t l)
+    {
+      #ifdef linux
+
+      std::lock_guard<std::recursive_mutex> lg(iTxLock);
+
+      if (!FlushPendingTx())
+      {
+        return iWriteBlocked ? 0 : -1;
+      }
+
+      if (iTxBucket)
+      {
+        size_t avail = iTxBucket->Available();
+
+        if (!avail)
+        {
+          iWriteBlocked = true;
+          PauseWrite(iTxBucket->DelayMs(l));
+          return 0;
+        }
+
+        l = std::min(l, avail);
+      }
+
+      if (ssl)
+      {
+        constexpr size_t TLSRecordSize = 16 * 1024;
+
+        l = std::min(l, TLSRecordSize);
+
+        int rc = SSL_write(ssl, b, static_cast<int>(l));
+
+        if (rc <= 0)
+        {
+          return -1;
+        }
+
+        if (iTxBucket)
+        {
+          iTxBucket->Consume(rc);
+        }
+
+        int pending = BIO_pending(wbio);
+
+        size_t off = iPendingTx.size();
+
+        iPendingTx.resize(off + pending);
+
+        BIO_read(wbio, iPendingTx.data() + off, pending);
+
+        FlushPendingTx();
+
+        return rc;
+      }
+
+      ssize_t rc = send((SOCKET)iFD, b, l, MSG_NOSIGNAL);
+
+      if (rc == -1)
+      {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+          iWriteBlocked = true;
+          return 0;
+        }
+
+        std::cout << GetProperty("name") << " TryWrite() failed, error : " << strerror(errno) << "\n";
+
+        return -1;
+      }
+
+      if ((size_t) rc < l)
+      {
+        iWriteBlocked = true;
+      }
+
+      if (iTxBucket)
+      {
+        iTxBucket->Consume(rc);
+      }
+
+      return static_cast<int32_t>(rc);
+
+      #else
+
+      Write(b, l);
+
+      return static_cast<int32_t>(l);
+
+      #endif
+    }
+
+    #ifdef linux
+    /*
+     * Zero copy receive : from now on readable data is moved socket -> 
+     * pipe -> file with splice() at the given file offset instead of 
+     * being read into a buffer. OnRead is then delivered with a null 
+     * buffer and the number of bytes written to the file. A non zero 
+     * limit stops reading after that many bytes. Not usable with TLS.
+     */
+    virtual bool SetSpliceTarget(FD file, uint64_t offset, uint64_t limit = 0)
+    {
+      if (ssl)
+      {
+        return false;
+      }
+
+      if (iPipe[0] < 0 && pipe2(iPipe, O_NONBLOCK) != 0)
+      {
+        std::cout << GetProperty("name") << " pipe2() failed, error : " << strerror(errno) << "\n";
+        return false;
+      }
+
+      iSpliceFD = file;
+      iSpliceOffset = offset;
+      iSpliceRemaining = limit;
+      iSpliceLimited = (limit != 0);
+
+      return true;
+    }
+
+    /*
+     * Zero copy send of up to count bytes of file from offset, which 
+     * is advanced. Returns the bytes sent, 0 if the socket would block 
+     * (OnWrite(nullptr, 0) follows once it is writable) or -1 on error.
+     */
+    virtual int64_t SendFile(FD file, uint64_t& offset, size_t count)
+    {
+      if (ssl)
+      {
+        return -1;
+      }
+
+      if (iTxBucket)
+      {
+        size_t avail = iTxBucket->Available();
+
+        if (!avail)
+        {
+          iWriteBlocked = true;
+          PauseWrite(iTxBucket->DelayMs(count));
+          return 0;
+        }
+
+        count = std::min(count, avail);
+      }
+
+      off_t off = static_cast<off_t>(offset);
+
+      ssize_t rc = sendfile((SOCKET)iFD, file, &off, count);
+
+      if (rc == -1)
+      {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+          iWriteBlocked = true;
+          return 0;
+        }
+
+        std::cout << GetProperty("name") << " sendfile() failed, error : " << strerror(errno) << "\n";
+
+        return -1;
+      }
+
+      offset = static_cast<uint64_t>(off);
+
+      if ((size_t) rc < count)
+      {
+        iWriteBlocked = true;
+      }
+
+      if (iTxBucket)
+      {
+        iTxBucket->Consume(rc);
+      }
+
+      return rc;
+    }
+    #endif
+
+    virtual bool IsWriteBlocked(void) override
+    {
+      return iWriteBlocked;
+    }
     
     protected:
 
+    /*
+     * the device serving an accepted connection
+     */
+    virtual SPCDeviceSocket MakeAcceptedSocket(FD aSocket)
+    {
+      return std::make_shared<CDeviceSocket>(aSocket);
+    }
+
+    #ifdef linux
+    /*
+     * charges the bytes of a completed read to the bucket
+     */
+    virtual void * Meter(SPCTokenBucket& bucket, void *c)
+    {
+      Context *ctx = (Context *) c;
+
+      if (bucket && ctx && ctx->type == EIOTYPE::READ)
+      {
+        bucket->Consume(ctx->n);
+      }
+
+      return c;
+    }
+
+    virtual void UpdateEventInterest(void)
+    {
+      SetEventInterest(shared_from_this(), !iReadPaused && !iReadHeld, !iWritePaused);
+    }
+
+    virtual void PauseRead(uint32_t ms)
+    {
+      if (iReadPaused) return;
+
+      iReadPaused = true;
+
+      UpdateEventInterest();
+
+      ScheduleTimer(ms, [w = weak_from_this()] () {
+        auto sp = std::static_pointer_cast<CDeviceSocket>(w.lock());
+        if (sp)
+        {
+          sp->iReadPaused = false;
+          sp->UpdateEventInterest();
+        }
+      });
+    }
+
+    /*
+     * the socket stays write blocked, so the resumed EPOLLOUT 
+     * is delivered as OnWrite(nullptr, 0)
+     */
+    virtual void PauseWrite(uint32_t ms)
+    {
+      if (iWritePaused) return;
+
+      iWritePaused = true;
+
+      UpdateEventInterest();
+
+      ScheduleTimer(ms, [w = weak_from_this()] () {
+        auto sp = std::static_pointer_cast<CDeviceSocket>(w.lock());
+        if (sp)
+        {
+          sp->iWritePaused = false;
+          sp->UpdateEventInterest();
+        }
+      });
+    }
+
+    virtual void * SpliceRead(size_t max = 0)
+    {
+      constexpr size_t SpliceChunk = 64 * 1024;
+
+      size_t len = max ? std::min(max, SpliceChunk) : SpliceChunk;
+
+      if (iSpliceLimited)
+      {
+        if (!iSpliceRemaining)
+        {
+          return nullptr;
+        }
+
+        len = static_cast<size_t>(std::min<uint64_t>(len, iSpliceRemaining));
+      }
+
+      Context *ctx = (Context *) calloc(1, sizeof(Context));
+
+      ctx->type = EIOTYPE::READ;
+      ctx->b = nullptr;
+      ctx->bFree = false;
+
+      ssize_t n = splice((SOCKET)iFD, NULL, iPipe[1], NULL, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+      if (n == -1)
+      {
+        if (errno == EAGAIN)
+        {
+          free(ctx);
+          return nullptr;
+        }
+
+        std::cout << GetProperty("name") << " splice() failed, error : " << strerror(errno) << "\n";
+
+        n = 0;
+      }
+
+      ssize_t left = n;
+
+      while (left > 0)
+      {
+        loff_t off = static_cast<loff_t>(iSpliceOffset);
+
+        ssize_t w = splice(iPipe[0], NULL, iSpliceFD, &off, left, SPLICE_F_MOVE);
+
+        if (w <= 0)
+        {
+          /*
+           * the data left in the pipe can not go anywhere, the pipe
+           * is dropped and the read ends with an error and a reset,
+           * the peer must not take the transfer as complete
+           */
+          int e = w ? errno : EIO;
+
+          std::cout << GetProperty("name") << " splice() to file failed, error : " << strerror(e) << "\n";
+
+          close(iPipe[0]);
+          close(iPipe[1]);
+
+          iPipe[0] = iPipe[1] = -1;
+
+          iSpliceFD = -1;
+
+          SetIOError(e);
+
+          SetAbortiveClose();
+
+          ctx->n = 0;
+
+          return ctx;
+        }
+
+        iSpliceOffset = static_cast<uint64_t>(off);
+
+        left -= w;
+      }
+
+      if (iSpliceLimited)
+      {
+        iSpliceRemaining -= n;
+      }
+
+      ctx->n = static_cast<unsigned long>(n);
+
+      return ctx;
+    }
+
+    virtual bool FlushPendingTx(void)
+    {
+      while (iPendingTx.size())
+      {
+        ssize_t rc = send((SOCKET)iFD, iPendingTx.data(), iPendingTx.size(), MSG_NOSIGNAL);
+
+        if (rc == -1)
+        {
+          if (errno == EAGAIN || errno == EWOULDBLOCK)
+          {
+            iWriteBlocked = true;
+          }
+
+          return false;
+        }
+
+        iPendingTx.erase(0, rc);
+      }
+
+      return true;
+    }
+    #endif
+
     #ifdef WIN32
     void * GetExtentionPfn(GUID guid, FD fd)
     {
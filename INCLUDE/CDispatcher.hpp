@@ -5,13 +5,18 @@
 #include <CSubject.hpp>
 #include <CListener.hpp>
 #include <CDeviceSocket.hpp>
+#include <CFileIOEngine.hpp>
 
+#include <map>
+#include <chrono>
 #include <thread>
+#include <vector>
 #include <iostream>
 
 #ifdef linux
  #include <unistd.h>
  #include <sys/epoll.h>
+ #include <sys/timerfd.h>
  #include <string.h>
 #endif
 
@@ -29,6 +34,27 @@ namespace NPL
 
     SPCDeviceSocket iDClient;
 
+    using TTimerClock = std::chrono::steady_clock;
+
+    std::mutex iTimerLock;
+
+    std::multimap<TTimerClock::time_point, TTimerCbk> iTimers;
+
+    std::mutex iPendingLock;
+
+    std::mutex iFileIOLock;
+
+    std::unique_ptr<CFileIOEngine> iFileIO;
+
+    #ifdef linux
+    FD iTimerFD = -1;
+
+    /*
+     * asks the loop to return, it is woken through the timer
+     */
+    std::atomic<bool> iStopping{false};
+    #endif
+
     public:
 
     CDispatcher()
@@ -37,6 +63,16 @@ namespace NPL
 
       #ifdef linux
       iEventPort = epoll_create1(0);
+
+      iTimerFD = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+      struct epoll_event te;
+
+      te.events = EPOLLIN;
+
+      te.data.ptr = &iTimerFD;
+
+      epoll_ctl(iEventPort, EPOLL_CTL_ADD, iTimerFD, &te);
       #else
       iEventPort = CreateIoCompletionPort(INVALID_HANDLE_VALUE, 0, 0, 0);
       #endif
@@ -49,20 +85,40 @@ namespace NPL
 
     ~CDispatcher()
     {
+      /*
+       * the loop goes first, the events it is still handling reach
+       * the dispatcher through the bindings of its observers
+       */
       #ifdef linux
+      iStopping = true;
+      ArmTimer();
+      #else
+      PostQueuedCompletionStatus(iEventPort, 0, 0, 0);
+      #endif
+
+      iWorker.join();
 
-        iWorker.join();
+      /*
+       * devices still signalling while the dispatcher shuts down 
+       * no longer reach it
+       */
+      MarkDestroying();
+
+      iFileIO.reset();
+
+      #ifdef linux
 
         if (iEventPort >= 0)
         {
           close(iEventPort);
         }
 
-      #else
-
-        PostQueuedCompletionStatus(iEventPort, 0, 0, 0);
+        if (iTimerFD >= 0)
+        {
+          close(iTimerFD);
+        }
 
-        iWorker.join();
+      #else
 
         if (iEventPort != INVALID_HANDLE_VALUE)
         {
@@ -74,7 +130,7 @@ namespace NPL
 
     void InitializeControl(void)
     {
-      iTarget = weak_from_this();
+      SetTarget(weak_from_this());
 
       iDServer = std::make_shared<CDeviceSocket>();
 
@@ -88,14 +144,19 @@ namespace NPL
             nullptr,
             [this, m = std::string("")] 
             (const uint8_t *b, size_t n) mutable {
+              /*
+               * one read may carry several completions, or end
+               * inside one
+               */
               m.append((char *)b, n);
-              if (m.size() == sizeof(Context))
+              size_t done = 0;
+              for (; m.size() - done >= sizeof(Context); done += sizeof(Context))
               {
                 Context *ctx = (Context *) calloc(1, sizeof(Context));
-                memmove(ctx, m.data(), sizeof(Context));
+                memmove(ctx, m.data() + done, sizeof(Context));
                 ProcessContext((CSubject *) ctx->k, ctx, 0);
-                m.clear();                
               }
+              m.erase(0, done);
             }
           );
           this->iDServer->iConnectedClient->AddEventListener(aso);
@@ -166,10 +227,152 @@ namespace NPL
       return observer;
     }
 
+    virtual void ScheduleTimer(uint32_t ms, TTimerCbk cbk) override
+    {
+      {
+        std::lock_guard<std::mutex> lg(iTimerLock);
+
+        iTimers.emplace(TTimerClock::now() + std::chrono::milliseconds(ms), cbk);
+      }
+
+      #ifdef linux
+      ArmTimer();
+      #else
+      PostQueuedCompletionStatus(iEventPort, 0, (ULONG_PTR) &iTimers, 0);
+      #endif
+    }
+
+    /*
+     * I/O threads and queue depth for file devices; the default engine
+     * (2 threads, depth 64) is created on the first file I/O. Jobs
+     * already queued on a replaced engine are completed first.
+     */
+    virtual void SetFileIOEngine(size_t threads, size_t depth)
+    {
+      auto engine = std::make_unique<CFileIOEngine>(threads, depth);
+
+      std::lock_guard<std::mutex> lg(iFileIOLock);
+
+      iFileIO.swap(engine);
+    }
+
+    virtual bool SubmitFileIO(TFileIOJob job) override
+    {
+      std::lock_guard<std::mutex> lg(iFileIOLock);
+
+      if (!iFileIO)
+      {
+        iFileIO = std::make_unique<CFileIOEngine>();
+      }
+
+      return iFileIO->Submit(job);
+    }
+
+    /*
+     * Linux only; IOCP has no readiness interest, reads and writes 
+     * are posted explicitly by the devices
+     */
+    virtual void SetEventInterest(SPCSubject s, bool read, bool write) override
+    {
+      #ifdef linux
+
+      auto device = std::dynamic_pointer_cast<CDevice>(s);
+
+      if (!device) return;
+
+      struct epoll_event e;
+
+      e.events = (read ? (uint32_t) EPOLLIN : 0) | (write ? (uint32_t) EPOLLOUT : 0);
+
+      e.data.ptr = s.get();
+
+      if (epoll_ctl(iEventPort, EPOLL_CTL_MOD, device->iFD, &e) == -1)
+      {
+        std::cout << "epoll_ctl(MOD) failed, error " << strerror(errno) << "\n";
+      }
+
+      #endif
+    }
+
     private:
 
+    /*
+     * runs the expired timers outside of iTimerLock
+     */
+    void RunTimers(void)
+    {
+      std::vector<TTimerCbk> due;
+
+      {
+        std::lock_guard<std::mutex> lg(iTimerLock);
+
+        auto now = TTimerClock::now();
+
+        while (iTimers.size() && iTimers.begin()->first <= now)
+        {
+          due.push_back(iTimers.begin()->second);
+          iTimers.erase(iTimers.begin());
+        }
+      }
+
+      for (auto& cbk : due)
+      {
+        if (cbk) cbk();
+      }
+
+      #ifdef linux
+      ArmTimer();
+      #endif
+    }
+
+    #ifdef linux
+    void ArmTimer(void)
+    {
+      struct itimerspec ts = {};
+
+      if (iStopping)
+      {
+        ts.it_value.tv_nsec = 1;
+      }
+      else
+      {
+        std::lock_guard<std::mutex> lg(iTimerLock);
+
+        if (iTimers.size())
+        {
+          auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            iTimers.begin()->first - TTimerClock::now()).count();
+
+          if (ns < 1) ns = 1;
+
+          ts.it_value.tv_sec = ns / 1000000000;
+          ts.it_value.tv_nsec = ns % 1000000000;
+        }
+      }
+
+      timerfd_settime(iTimerFD, 0, &ts, nullptr);
+    }
+    #else
+    DWORD NextTimeout(void)
+    {
+      std::lock_guard<std::mutex> lg(iTimerLock);
+
+      if (!iTimers.size())
+      {
+        return INFINITE;
+      }
+
+      auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+        iTimers.begin()->first - TTimerClock::now()).count();
+
+      return (ms > 0) ? static_cast<DWORD>(ms) : 0;
+    }
+    #endif
+
     void Worker(void)
     {
+      EnterLoop();
+
       while (true)
       {
         Context *ctx = nullptr;
@@ -195,13 +398,33 @@ namespace NPL
 
           e = ee.events;
 
+          if (k == &iTimerFD)
+          {
+            uint64_t expirations;
+            read(iTimerFD, &expirations, sizeof(expirations));
+            RunTimers();
+
+            if (iStopping)
+            {
+              break;
+            }
+
+            continue;
+          }
+
         #endif
 
         #ifdef WIN32
 
           LPOVERLAPPED o;
 
-          bool fRet = GetQueuedCompletionStatus(iEventPort, &n, (PULONG_PTR) &k, &o, INFINITE);
+          bool fRet = GetQueuedCompletionStatus(iEventPort, &n, (PULONG_PTR) &k, &o, NextTimeout());
+
+          if ((!fRet && !o) || k == &iTimers)
+          {
+            RunTimers();
+            continue;
+          }
 
           if (!fRet)
           {
@@ -222,18 +445,24 @@ namespace NPL
         ProcessContext(k, ctx, e);
       }
 
-      std::cout << "Dispatcher thread returning. Observers : " << iObservers.size() << "\n";
+      std::cout << "Dispatcher thread returning. Observers : " << GetObservers()->size() << "\n";
     }
 
     void ProcessContext(void *k, Context *ctx, uint32_t e)
     {
-        std::unique_lock<std::mutex> ul(iLock);
+        auto observers = GetObservers();
+
+        bool found = false;
 
-        for (auto o : iObservers)
+        for (auto& o : *observers)
         {
-          if (k == (void *)o.get())
+          /*
+           * a queued completion names its device by address and
+           * serial, the address alone may be a new device's by now
+           */
+          if (k == (void *)o.get() && !(ctx && ctx->id && ctx->id != o->GetSerial()))
           {
-            ul.unlock();
+            found = true;
 
             #ifdef linux
 
@@ -245,6 +474,10 @@ namespace NPL
             {
               ctx = (Context *) o->Read();
             }
+            else if ((e & EPOLLOUT) && std::static_pointer_cast<CDevice>(o)->IsWriteBlocked())
+            {
+              o->OnWrite(nullptr, 0);
+            }
 
             if (!ctx)
             {
@@ -287,20 +520,38 @@ namespace NPL
 
             free(ctx);
 
-            ul.lock();
-
             break;
           }
         }
 
+        if (!found && ctx)
+        {
+          /*
+           * completion for a device that has been removed meanwhile,
+           * e.g. a file read finishing after an aborted transfer, or
+           * freed with another one allocated at its address since
+           */
+          if (ctx->bFree) free((void *)ctx->b);
+
+          free(ctx);
+        }
+
         ProcessMarkRemoveAllListeners();
     }
 
     virtual void QueuePendingContext(SPCSubject s, void *c) override
     {
       ((Context *)c)->k = s.get();
+      ((Context *)c)->id = s->GetSerial();
 
-      iDClient->Write((const uint8_t *)c, sizeof(Context));
+      {
+        /*
+         * file I/O threads post their completions concurrently
+         */
+        std::lock_guard<std::mutex> lg(iPendingLock);
+
+        iDClient->Write((const uint8_t *)c, sizeof(Context));
+      }
 
       free (c);
     }
@@ -0,0 +1,541 @@
+#ifndef FTPLISTPARSER_HPP
+#define FTPLISTPARSER_HPP
+
+#include <ctime>
+#include <cctype>
+#include <memory>
+#include <vector>
+#include <algorithm>
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <string_view>
+
+namespace NPL
+{
+  enum class FTPEntryType : uint8_t
+  {
+    File = 0,
+    Dir,
+    Link,
+    Other
+  };
+
+  /*
+   * one directory entry; iName points into the parser arena and
+   * is valid only for the duration of the batch callback
+   */
+  struct FTPEntry
+  {
+    std::string_view iName;
+    uint64_t         iSize = 0;
+    int64_t          iModify = -1; // unix time (UTC), -1 if unknown
+    FTPEntryType     iType = FTPEntryType::Other;
+  };
+
+  /*
+   * return false to stop listing; last is true for the final batch,
+   * which may be empty, ok is false on it when the server refused
+   * the listing or it did not complete
+   */
+  using TListCbk = std::function<bool (const std::vector<FTPEntry>& entries, bool last, bool ok)>;
+
+  /*
+   * Bump allocator for entry names. Blocks are kept across Reset()
+   * so a listing of any size runs in the memory of one batch.
+   */
+  class CNameArena
+  {
+    public:
+
+    CNameArena(size_t blockSize = 64 * 1024) : iBlockSize(blockSize) {}
+
+    std::string_view Store(std::string_view s)
+    {
+      if (iBlock == iBlocks.size() || iUsed + s.size() > iBlocks[iBlock].second)
+      {
+        NextBlock(s.size());
+      }
+
+      char *p = iBlocks[iBlock].first.get() + iUsed;
+
+      memcpy(p, s.data(), s.size());
+
+      iUsed += s.size();
+
+      return std::string_view(p, s.size());
+    }
+
+    void Reset(void)
+    {
+      iBlock = 0;
+      iUsed = 0;
+    }
+
+    protected:
+
+    void NextBlock(size_t need)
+    {
+      if (iBlock < iBlocks.size())
+      {
+        iBlock++;
+      }
+
+      while (iBlock < iBlocks.size() && iBlocks[iBlock].second < need)
+      {
+        iBlock++;
+      }
+
+      if (iBlock == iBlocks.size())
+      {
+        size_t size = std::max(iBlockSize, need);
+
+        iBlocks.emplace_back(std::unique_ptr<char[]>(new char[size]), size);
+      }
+
+      iUsed = 0;
+    }
+
+    size_t iBlockSize;
+
+    size_t iBlock = 0;
+
+    size_t iUsed = 0;
+
+    std::vector<std::pair<std::unique_ptr<char[]>, size_t>> iBlocks;
+  };
+
+  /*
+   * Streaming parser for MLSD (rfc 3659 7) and LIST output. Feed()
+   * takes data channel bytes in whatever chunks they arrive; a line
+   * split between chunks is carried over. Entries are handed out in
+   * batches of up to "batch" records. LIST understands the common
+   * unix "ls -l" and DOS/IIS formats; unparsable lines are skipped.
+   */
+  class CFTPListParser
+  {
+    public:
+
+    CFTPListParser(bool mlsd, TListCbk cbk, size_t batch = 1024) :
+      iMLSD(mlsd), iCbk(cbk), iBatch(batch ? batch : 1)
+    {
+      iEntries.reserve(iBatch);
+    }
+
+    virtual ~CFTPListParser() {}
+
+    /*
+     * returns false once the callback asked to stop
+     */
+    virtual bool Feed(const char *b, size_t n)
+    {
+      size_t start = 0;
+
+      while (iContinue && start < n)
+      {
+        auto p = (const char *) memchr(b + start, '\n', n - start);
+
+        if (!p)
+        {
+          iCarry.append(b + start, n - start);
+          break;
+        }
+
+        size_t end = p - b;
+
+        if (iCarry.size())
+        {
+          iCarry.append(b + start, end - start);
+          OnLine(iCarry);
+          iCarry.clear();
+        }
+        else
+        {
+          OnLine(std::string_view(b + start, end - start));
+        }
+
+        start = end + 1;
+      }
+
+      return iContinue;
+    }
+
+    /*
+     * end of the listing: parse an unterminated last line and
+     * deliver the final batch with the listing's outcome
+     */
+    virtual void Finish(bool ok = true)
+    {
+      if (iContinue && iCarry.size())
+      {
+        OnLine(iCarry);
+      }
+
+      iCarry.clear();
+
+      if (iContinue && iCbk)
+      {
+        iCbk(iEntries, true, ok);
+      }
+
+      iContinue = false;
+
+      iEntries.clear();
+
+      iArena.Reset();
+    }
+
+    virtual void SetMLSD(bool mlsd)
+    {
+      iMLSD = mlsd;
+    }
+
+    protected:
+
+    bool iMLSD;
+
+    TListCbk iCbk;
+
+    size_t iBatch;
+
+    bool iContinue = true;
+
+    std::string iCarry;
+
+    CNameArena iArena;
+
+    std::vector<FTPEntry> iEntries;
+
+    virtual void OnLine(std::string_view line)
+    {
+      if (line.size() && line.back() == '\r')
+      {
+        line.remove_suffix(1);
+      }
+
+      if (line.empty())
+      {
+        return;
+      }
+
+      FTPEntry e;
+
+      if (iMLSD ? ParseMLSD(line, e) : ParseLIST(line, e))
+      {
+        e.iName = iArena.Store(e.iName);
+
+        iEntries.push_back(e);
+
+        if (iEntries.size() == iBatch)
+        {
+          if (iCbk)
+          {
+            iContinue = iCbk(iEntries, false, true);
+          }
+
+          iEntries.clear();
+
+          iArena.Reset();
+        }
+      }
+    }
+
+    static bool IEquals(std::string_view a, std::string_view b)
+    {
+      if (a.size() != b.size()) return false;
+
+      for (size_t i = 0; i < a.size(); i++)
+      {
+        if (tolower((unsigned char) a[i]) != tolower((unsigned char) b[i])) return false;
+      }
+
+      return true;
+    }
+
+    static bool ParseNumber(std::string_view s, uint64_t& v)
+    {
+      v = 0;
+
+      if (s.empty()) return false;
+
+      for (char c : s)
+      {
+        if (c < '0' || c > '9') return false;
+        v = v * 10 + (c - '0');
+      }
+
+      return true;
+    }
+
+    /*
+     * days since 1970-01-01 of a proleptic gregorian date
+     */
+    static int64_t DaysFromCivil(int64_t y, unsigned m, unsigned d)
+    {
+      y -= m <= 2;
+      int64_t era = (y >= 0 ? y : y - 399) / 400;
+      unsigned yoe = static_cast<unsigned>(y - era * 400);
+      unsigned doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+      unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+      return era * 146097 + static_cast<int64_t>(doe) - 719468;
+    }
+
+    static int64_t ToUnixTime(int64_t y, unsigned mo, unsigned d, unsigned h, unsigned mi, unsigned s)
+    {
+      return DaysFromCivil(y, mo, d) * 86400 + h * 3600 + mi * 60 + s;
+    }
+
+    /*
+     * YYYYMMDDHHMMSS[.sss]
+     */
+    static int64_t ParseMLSDTime(std::string_view v)
+    {
+      uint64_t y, mo, d, h, mi, s;
+
+      if (v.size() < 14 ||
+          !ParseNumber(v.substr(0, 4), y) || !ParseNumber(v.substr(4, 2), mo) ||
+          !ParseNumber(v.substr(6, 2), d) || !ParseNumber(v.substr(8, 2), h) ||
+          !ParseNumber(v.substr(10, 2), mi) || !ParseNumber(v.substr(12, 2), s))
+      {
+        return -1;
+      }
+
+      return ToUnixTime(y, mo, d, h, mi, s);
+    }
+
+    /*
+     * fact=value;fact=value; name
+     */
+    virtual bool ParseMLSD(std::string_view line, FTPEntry& e)
+    {
+      size_t sp = line.find(' ');
+
+      if (sp == std::string_view::npos || sp + 1 >= line.size())
+      {
+        return false;
+      }
+
+      std::string_view facts = line.substr(0, sp);
+
+      e.iName = line.substr(sp + 1);
+
+      while (facts.size())
+      {
+        size_t semi = facts.find(';');
+
+        std::string_view fact = facts.substr(0, semi);
+
+        facts = (semi == std::string_view::npos) ? std::string_view() : facts.substr(semi + 1);
+
+        size_t eq = fact.find('=');
+
+        if (eq == std::string_view::npos) continue;
+
+        std::string_view k = fact.substr(0, eq), v = fact.substr(eq + 1);
+
+        if (IEquals(k, "type"))
+        {
+          if (IEquals(v, "file"))
+            e.iType = FTPEntryType::File;
+          else if (IEquals(v, "dir"))
+            e.iType = FTPEntryType::Dir;
+          else if (IEquals(v, "cdir") || IEquals(v, "pdir"))
+            return false;
+          else if (IEquals(v.substr(0, 14), "OS.unix=slink:") || IEquals(v, "OS.unix=symlink"))
+            e.iType = FTPEntryType::Link;
+        }
+        else if (IEquals(k, "size") || IEquals(k, "sizd"))
+        {
+          ParseNumber(v, e.iSize);
+        }
+        else if (IEquals(k, "modify"))
+        {
+          e.iModify = ParseMLSDTime(v);
+        }
+      }
+
+      return true;
+    }
+
+    static int ParseMonth(std::string_view m)
+    {
+      static const char *months[] = {
+        "jan", "feb", "mar", "apr", "may", "jun",
+        "jul", "aug", "sep", "oct", "nov", "dec" };
+
+      for (int i = 0; i < 12; i++)
+      {
+        if (IEquals(m, months[i])) return i + 1;
+      }
+
+      return 0;
+    }
+
+    /*
+     * next space separated token of s starting at pos; pos is moved
+     * past the token and the spaces after it
+     */
+    static std::string_view NextToken(std::string_view s, size_t& pos)
+    {
+      while (pos < s.size() && s[pos] == ' ') pos++;
+
+      size_t start = pos;
+
+      while (pos < s.size() && s[pos] != ' ') pos++;
+
+      std::string_view t = s.substr(start, pos - start);
+
+      if (pos < s.size()) pos++;
+
+      return t;
+    }
+
+    virtual bool ParseLIST(std::string_view line, FTPEntry& e)
+    {
+      if (line[0] >= '0' && line[0] <= '9')
+      {
+        return ParseDOS(line, e);
+      }
+
+      switch (line[0])
+      {
+        case '-': e.iType = FTPEntryType::File; break;
+        case 'd': e.iType = FTPEntryType::Dir; break;
+        case 'l': e.iType = FTPEntryType::Link; break;
+        default:
+          if (line.substr(0, 5) == "total") return false;
+          e.iType = FTPEntryType::Other;
+          break;
+      }
+
+      /*
+       * owner and group columns vary between servers; anchor on the
+       * "Mon DD HH:MM|YYYY" date, the size is the token before it
+       */
+      size_t pos = 0;
+
+      std::string_view prev, tok = NextToken(line, pos);
+
+      int month = 0;
+
+      while (!month && pos < line.size())
+      {
+        prev = tok;
+
+        tok = NextToken(line, pos);
+
+        month = ParseNumber(prev, e.iSize) ? ParseMonth(tok) : 0;
+      }
+
+      if (!month) return false;
+
+      uint64_t day, y, h = 0, mi = 0;
+
+      if (!ParseNumber(NextToken(line, pos), day)) return false;
+
+      std::string_view t = NextToken(line, pos);
+
+      if (pos >= line.size()) return false;
+
+      size_t colon = t.find(':');
+
+      if (colon != std::string_view::npos)
+      {
+        ParseNumber(t.substr(0, colon), h);
+
+        ParseNumber(t.substr(colon + 1), mi);
+
+        /*
+         * no year: within the last six months, so this year unless
+         * that puts it in the future
+         */
+        time_t now = time(nullptr);
+
+        struct tm utc;
+        #ifdef WIN32
+        gmtime_s(&utc, &now);
+        #else
+        gmtime_r(&now, &utc);
+        #endif
+
+        y = utc.tm_year + 1900;
+
+        if (ToUnixTime(y, month, day, h, mi, 0) > now + 86400) y--;
+      }
+      else if (!ParseNumber(t, y))
+      {
+        return false;
+      }
+
+      e.iModify = ToUnixTime(y, month, day, h, mi, 0);
+
+      e.iName = line.substr(pos);
+
+      if (e.iType == FTPEntryType::Link)
+      {
+        size_t arrow = e.iName.find(" -> ");
+
+        if (arrow != std::string_view::npos) e.iName = e.iName.substr(0, arrow);
+      }
+
+      return (e.iName.size() && e.iName != "." && e.iName != "..");
+    }
+
+    /*
+     * MM-DD-YY  HH:MM(AM|PM)  <DIR>|size  name
+     */
+    virtual bool ParseDOS(std::string_view line, FTPEntry& e)
+    {
+      size_t pos = 0;
+
+      std::string_view date = NextToken(line, pos);
+      std::string_view time = NextToken(line, pos);
+      std::string_view what = NextToken(line, pos);
+
+      uint64_t mo, d, y, h, mi;
+
+      if (date.size() < 8 || time.size() < 5 || pos >= line.size() ||
+          !ParseNumber(date.substr(0, 2), mo) || !ParseNumber(date.substr(3, 2), d) ||
+          !ParseNumber(date.substr(6), y) ||
+          !ParseNumber(time.substr(0, 2), h) || !ParseNumber(time.substr(3, 2), mi))
+      {
+        return false;
+      }
+
+      if (y < 100) y += (y < 70) ? 2000 : 1900;
+
+      if (time.size() >= 7)
+      {
+        h %= 12;
+
+        if (time[5] == 'P' || time[5] == 'p') h += 12;
+      }
+
+      e.iModify = ToUnixTime(y, mo, d, h, mi, 0);
+
+      if (what == "<DIR>")
+      {
+        e.iType = FTPEntryType::Dir;
+      }
+      else if (ParseNumber(what, e.iSize))
+      {
+        e.iType = FTPEntryType::File;
+      }
+      else
+      {
+        return false;
+      }
+
+      while (pos < line.size() && line[pos] == ' ') pos++;
+
+      e.iName = line.substr(pos);
+
+      return (e.iName.size() && e.iName != "." && e.iName != "..");
+    }
+  };
+
+  using SPCFTPListParser = std::shared_ptr<CFTPListParser>;
+}
+
+#endif //FTPLISTPARSER_HPP
@@ -0,0 +1,590 @@
+#ifndef FTPMIRROR_HPP
+#define FTPMIRROR_HPP
+
+#include <CProtocolFTP.hpp>
+
+#include <map>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <tuple>
+#include <string>
+#include <filesystem>
+#include <functional>
+
+#include <sys/stat.h>
+
+namespace NPL
+{
+  enum class MirrorDirection : uint8_t
+  {
+    Download = 0,
+    Upload
+  };
+
+  struct MirrorStats
+  {
+    uint64_t iDirsScanned = 0;
+    uint64_t iDirsCreated = 0;
+    uint64_t iFilesChecked = 0;
+    uint64_t iFilesSkipped = 0;
+    uint64_t iFilesTransferred = 0;
+    uint64_t iFilesFailed = 0;
+    uint64_t iBytes = 0;
+  };
+
+  using TMirrorCbk = std::function<void (bool ok, const MirrorStats& stats)>;
+
+  /*
+   * Recursive tree sync between a remote and a local directory.
+   * Directories are listed (MLSD/LIST) and files are transferred on a
+   * set of sessions cloned from the one passed in, at most "concurrency"
+   * of them busy at a time. A file is skipped when the target has the
+   * same size and is not older than the source. Missing remote
+   * directories are created one MKD batch per parent directory; the
+   * batch goes out back to back when the session has pipelining
+   * enabled (SetPipelineDepth).
+   */
+  class CFTPMirror : public std::enable_shared_from_this<CFTPMirror>
+  {
+    public:
+
+    CFTPMirror(SPCProtocolFTP session, size_t concurrency = 4)
+    {
+      iConcurrency = concurrency ? concurrency : 1;
+
+      iSessions.push_back(session);
+    }
+
+    virtual ~CFTPMirror() {}
+
+    virtual void Start(MirrorDirection dir, const std::string& remote, const std::string& local, TMirrorCbk cbk = nullptr, DCProt P = DCProt::Clear)
+    {
+      {
+        std::lock_guard<std::mutex> lg(iLock);
+
+        iDirection = dir;
+        iCbk = cbk;
+        iProt = P;
+        iStats = {};
+        iFailed = false;
+        iStopped = false;
+        iCompleted = false;
+
+        while (iSessions.size() < iConcurrency)
+        {
+          auto s = iSessions[0]->CloneSession();
+
+          if (!s) break;
+
+          iSessions.push_back(s);
+        }
+
+        iBusy.assign(iSessions.size(), false);
+
+        if (dir == MirrorDirection::Download)
+        {
+          std::error_code ec;
+          std::filesystem::create_directories(local, ec);
+        }
+
+        iScans.push_back({ remote, local, false });
+      }
+
+      Pump();
+    }
+
+    /*
+     * no new listings or transfers are started; the ones in flight
+     * are abandoned at the next data callback
+     */
+    virtual void Stop(void)
+    {
+      {
+        std::lock_guard<std::mutex> lg(iLock);
+
+        iStopped = true;
+
+        iFailed = true;
+
+        iScans.clear();
+
+        iTransfers.clear();
+      }
+
+      Pump();
+    }
+
+    virtual MirrorStats GetStats(void)
+    {
+      std::lock_guard<std::mutex> lg(iLock);
+
+      return iStats;
+    }
+
+    protected:
+
+    struct Task
+    {
+      std::string iRemote;
+      std::string iLocal;
+      bool        iNew;     // remote directory was just created, nothing to list
+    };
+
+    struct RemoteInfo
+    {
+      uint64_t     iSize;
+      int64_t      iModify;
+      FTPEntryType iType;
+    };
+
+    using TRemoteMap = std::map<std::string, RemoteInfo>;
+
+    std::mutex iLock;
+
+    std::vector<SPCProtocolFTP> iSessions;
+
+    std::vector<bool> iBusy;
+
+    size_t iConcurrency;
+
+    size_t iInFlight = 0;
+
+    std::deque<Task> iScans;
+
+    std::deque<Task> iTransfers;
+
+    MirrorDirection iDirection = MirrorDirection::Download;
+
+    DCProt iProt = DCProt::Clear;
+
+    TMirrorCbk iCbk = nullptr;
+
+    MirrorStats iStats;
+
+    bool iFailed = false;
+
+    std::atomic<bool> iStopped = false;
+
+    bool iCompleted = false;
+
+    static std::string JoinRemote(const std::string& dir, std::string_view name)
+    {
+      if (dir.empty()) return std::string(name);
+
+      return (dir.back() == '/') ? (dir + std::string(name)) : (dir + "/" + std::string(name));
+    }
+
+    static std::string JoinLocal(const std::string& dir, std::string_view name)
+    {
+      return (std::filesystem::path(dir) / std::string(name)).string();
+    }
+
+    /*
+     * a listed name comes from the server and must be one path
+     * component, so that the target can not end up outside of the
+     * local tree ("../x", "a/b", "/etc/x", or "C:x" on Windows)
+     */
+    static bool IsSafeName(std::string_view name)
+    {
+      if (name.empty() || name == "." || name == "..")
+      {
+        return false;
+      }
+
+      #ifdef WIN32
+      return name.find_first_of(std::string_view("/\\:\0", 4)) == std::string_view::npos;
+      #else
+      return name.find_first_of(std::string_view("/\0", 2)) == std::string_view::npos;
+      #endif
+    }
+
+    /*
+     * path is below dir, compared lexically
+     */
+    static bool IsUnder(const std::string& dir, const std::string& path)
+    {
+      auto rel = std::filesystem::path(path).lexically_normal().lexically_relative(
+                   std::filesystem::path(dir).lexically_normal());
+
+      return !rel.empty() && rel.is_relative() && *rel.begin() != ".." && rel != ".";
+    }
+
+    static bool LocalInfo(const std::string& path, uint64_t& size, int64_t& mtime)
+    {
+      struct stat st;
+
+      if (stat(path.c_str(), &st) != 0) return false;
+
+      size = st.st_size;
+      mtime = st.st_mtime;
+
+      return true;
+    }
+
+    /*
+     * target is up to date if it has the source size and is not older;
+     * an unknown mtime (-1) only compares sizes
+     */
+    static bool IsUpToDate(uint64_t srcSize, int64_t srcTime, uint64_t dstSize, int64_t dstTime)
+    {
+      return (srcSize == dstSize) && (srcTime < 0 || dstTime < 0 || dstTime >= srcTime);
+    }
+
+    /*
+     * hands queued work to idle sessions, listings first so that
+     * the transfer queue fills up early; session calls are made
+     * outside of iLock
+     */
+    virtual void Pump(void)
+    {
+      std::vector<std::tuple<size_t, Task, bool>> launch;
+
+      TMirrorCbk done = nullptr;
+
+      bool ok = false;
+
+      MirrorStats stats;
+
+      {
+        std::lock_guard<std::mutex> lg(iLock);
+
+        for (size_t i = 0; i < iSessions.size() && iInFlight < iConcurrency; i++)
+        {
+          if (iBusy[i]) continue;
+
+          if (iScans.size())
+          {
+            launch.emplace_back(i, iScans.front(), true);
+            iScans.pop_front();
+          }
+          else if (iTransfers.size())
+          {
+            launch.emplace_back(i, iTransfers.front(), false);
+            iTransfers.pop_front();
+          }
+          else
+          {
+            break;
+          }
+
+          iBusy[i] = true;
+          iInFlight++;
+        }
+
+        if (!iInFlight && !iScans.size() && !iTransfers.size() && !iCompleted)
+        {
+          iCompleted = true;
+
+          done = iCbk;
+          ok = !iFailed;
+          stats = iStats;
+
+          for (size_t i = 1; i < iSessions.size(); i++)
+          {
+            iSessions[i]->Quit();
+          }
+
+          iSessions.resize(1);
+        }
+      }
+
+      for (auto& [i, task, scan] : launch)
+      {
+        if (scan)
+          LaunchScan(i, task);
+        else
+          LaunchTransfer(i, task);
+      }
+
+      if (done)
+      {
+        done(ok, stats);
+      }
+    }
+
+    virtual void Release(size_t i)
+    {
+      {
+        std::lock_guard<std::mutex> lg(iLock);
+
+        iBusy[i] = false;
+        iInFlight--;
+      }
+
+      Pump();
+    }
+
+    virtual void LaunchScan(size_t i, const Task& task)
+    {
+      auto self = shared_from_this();
+
+      if (task.iNew)
+      {
+        ScanLocal(i, task, nullptr);
+        return;
+      }
+
+      auto remote = std::make_shared<TRemoteMap>();
+
+      iSessions[i]->ListEntries(
+        [self, i, task, remote] (const std::vector<FTPEntry>& entries, bool last, bool ok) {
+          if (self->iDirection == MirrorDirection::Download)
+          {
+            self->OnRemoteEntries(task, entries);
+          }
+          else
+          {
+            for (auto& e : entries)
+            {
+              (*remote)[std::string(e.iName)] = { e.iSize, e.iModify, e.iType };
+            }
+          }
+
+          if (last && !ok)
+          {
+            {
+              std::lock_guard<std::mutex> lg(self->iLock);
+              self->iFailed = true;
+            }
+
+            self->Release(i);
+          }
+          else if (last)
+          {
+            if (self->iDirection == MirrorDirection::Download)
+            {
+              {
+                std::lock_guard<std::mutex> lg(self->iLock);
+                self->iStats.iDirsScanned++;
+              }
+
+              self->Release(i);
+            }
+            else
+              self->ScanLocal(i, task, remote);
+          }
+
+          return true;
+        },
+        task.iRemote, 1024, iProt);
+    }
+
+    /*
+     * download: one batch of a remote listing against the local tree
+     */
+    virtual void OnRemoteEntries(const Task& task, const std::vector<FTPEntry>& entries)
+    {
+      std::lock_guard<std::mutex> lg(iLock);
+
+      if (iStopped) return;
+
+      for (auto& e : entries)
+      {
+        auto remote = JoinRemote(task.iRemote, e.iName);
+        auto local = JoinLocal(task.iLocal, e.iName);
+
+        if (!IsSafeName(e.iName) || !IsUnder(task.iLocal, local))
+        {
+          std::cout << "CFTPMirror skipping unsafe name : " << e.iName << "\n";
+          iStats.iFilesFailed++;
+          iFailed = true;
+          continue;
+        }
+
+        if (e.iType == FTPEntryType::Dir)
+        {
+          std::error_code ec;
+
+          if (std::filesystem::create_directory(local, ec))
+          {
+            iStats.iDirsCreated++;
+          }
+
+          iScans.push_back({ remote, local, false });
+        }
+        else if (e.iType == FTPEntryType::File)
+        {
+          uint64_t size;
+          int64_t mtime;
+
+          iStats.iFilesChecked++;
+
+          if (LocalInfo(local, size, mtime) && IsUpToDate(e.iSize, e.iModify, size, mtime))
+          {
+            iStats.iFilesSkipped++;
+          }
+          else
+          {
+            iTransfers.push_back({ remote, local, false });
+          }
+        }
+      }
+    }
+
+    /*
+     * upload: the local directory against the remote listing (null
+     * for a directory that was just created); missing subdirectories
+     * are created as one MKD batch on the same session
+     */
+    virtual void ScanLocal(size_t i, const Task& task, std::shared_ptr<TRemoteMap> remote)
+    {
+      std::vector<Task> created;
+
+      {
+        std::lock_guard<std::mutex> lg(iLock);
+
+        std::error_code ec;
+
+        for (auto it = std::filesystem::directory_iterator(task.iLocal, ec);
+             !iStopped && !ec && it != std::filesystem::directory_iterator();
+             it.increment(ec))
+        {
+          auto name = it->path().filename().string();
+
+          auto rpath = JoinRemote(task.iRemote, name);
+          auto lpath = it->path().string();
+
+          const RemoteInfo *r = nullptr;
+
+          if (remote)
+          {
+            auto f = remote->find(name);
+            if (f != remote->end()) r = &f->second;
+          }
+
+          if (it->is_directory(ec))
+          {
+            if (r && r->iType == FTPEntryType::Dir)
+              iScans.push_back({ rpath, lpath, false });
+            else
+              created.push_back({ rpath, lpath, true });
+          }
+          else if (it->is_regular_file(ec))
+          {
+            uint64_t size;
+            int64_t mtime;
+
+            iStats.iFilesChecked++;
+
+            if (r && r->iType == FTPEntryType::File &&
+                LocalInfo(lpath, size, mtime) && IsUpToDate(size, mtime, r->iSize, r->iModify))
+            {
+              iStats.iFilesSkipped++;
+            }
+            else
+            {
+              iTransfers.push_back({ rpath, lpath, false });
+            }
+          }
+        }
+
+        iStats.iDirsScanned++;
+      }
+
+      if (created.empty())
+      {
+        Release(i);
+        return;
+      }
+
+      auto self = shared_from_this();
+
+      auto pending = std::make_shared<size_t>(created.size());
+
+      /*
+       * a 550 that says the directory exists (created meanwhile) is
+       * listed like any other; any other refusal fails the mirror and
+       * nothing is uploaded below that directory
+       */
+      for (auto& t : created)
+      {
+        iSessions[i]->CreateDir(t.iRemote, [self, i, t, pending] (const std::string& r) {
+          bool made = (r.size() && r[0] == '2');
+
+          bool exists = !made && !r.compare(0, 3, "550") && r.find("exist") != std::string::npos;
+
+          {
+            std::lock_guard<std::mutex> lg(self->iLock);
+
+            if (made)
+            {
+              self->iStats.iDirsCreated++;
+              self->iScans.push_back(t);
+            }
+            else if (exists)
+            {
+              self->iScans.push_back({ t.iRemote, t.iLocal, false });
+            }
+            else
+            {
+              self->iFailed = true;
+            }
+          }
+
+          if (--(*pending)) return;
+
+          self->Release(i);
+        });
+      }
+    }
+
+    virtual void LaunchTransfer(size_t i, const Task& task)
+    {
+      auto self = shared_from_this();
+
+      auto finished = std::make_shared<bool>(false);
+
+      TTransferCbk cbk = [self] (const char *b, size_t n) {
+        if (b || n)
+        {
+          std::lock_guard<std::mutex> lg(self->iLock);
+          self->iStats.iBytes += n;
+          return !self->iStopped;
+        }
+
+        return true;
+      };
+
+      /*
+       * the final reply decides, a 4xx/5xx (or 421 when the session
+       * dropped) fails the file and frees the session all the same
+       */
+      TResponseCbk rcbk = [self, i, finished] (const std::string& r) {
+        if (*finished || r.empty() || r[0] == '1' || r[0] == '3')
+        {
+          return;
+        }
+
+        *finished = true;
+
+        {
+          std::lock_guard<std::mutex> lg(self->iLock);
+
+          if (r[0] == '2')
+          {
+            self->iStats.iFilesTransferred++;
+          }
+          else
+          {
+            self->iStats.iFilesFailed++;
+            self->iFailed = true;
+          }
+        }
+
+        self->Release(i);
+      };
+
+      if (iDirection == MirrorDirection::Download)
+        iSessions[i]->Download(cbk, task.iRemote, task.iLocal, iProt, rcbk);
+      else
+        iSessions[i]->Upload(cbk, task.iRemote, task.iLocal, iProt, rcbk);
+    }
+  };
+
+  using SPCFTPMirror = std::shared_ptr<CFTPMirror>;
+}
+
+#endif //FTPMIRROR_HPP
@@ -0,0 +1,282 @@
+#ifndef FTPSESSIONPOOL_HPP
+#define FTPSESSIONPOOL_HPP
+
+#include <CProtocolFTP.hpp>
+
+#include <map>
+#include <mutex>
+#include <memory>
+#include <vector>
+#include <tuple>
+#include <string>
+#include <iostream>
+#include <algorithm>
+#include <functional>
+
+namespace NPL
+{
+  /*
+   * A pool job gets an idle logged in session and must call done
+   * exactly once when it no longer needs it; done(false) on a session
+   * that has disconnected puts the job back in the queue
+   */
+  using TPoolJob = std::function<void (SPCProtocolFTP session, TCompletionCbk done)>;
+
+  /*
+   * Keeps up to "cap" control sessions per server, cloned from a seed
+   * session, and runs queued jobs on whichever is idle. Higher priority
+   * jobs go first, equal priorities in submission order. Sessions are
+   * opened on demand and kept logged in between jobs; a session found
+   * disconnected is replaced by a fresh clone before it gets work.
+   */
+  class CFTPSessionPool : public std::enable_shared_from_this<CFTPSessionPool>
+  {
+    public:
+
+    CFTPSessionPool() = default;
+
+    virtual ~CFTPSessionPool() {}
+
+    /*
+     * "warm" sessions are opened (and logged in) right away
+     */
+    virtual void AddServer(const std::string& server, SPCProtocolFTP seed, size_t cap = 4, size_t warm = 1, int retries = 2)
+    {
+      std::lock_guard<std::mutex> lg(iLock);
+
+      auto& s = iServers[server];
+
+      s.iSeed = seed;
+      s.iCap = cap ? cap : 1;
+      s.iRetries = retries;
+
+      while (s.iSessions.size() < std::min(warm, s.iCap))
+      {
+        auto session = s.iSessions.empty() ? seed : seed->CloneSession();
+
+        if (!session) break;
+
+        s.iSessions.push_back({ session, false });
+      }
+    }
+
+    /*
+     * cbk gets the final result, after any retries
+     */
+    virtual void Submit(const std::string& server, TPoolJob job, int priority = 0, TCompletionCbk cbk = nullptr)
+    {
+      {
+        std::lock_guard<std::mutex> lg(iLock);
+
+        auto it = iServers.find(server);
+
+        if (it == iServers.end())
+        {
+          std::cout << "CFTPSessionPool::Submit unknown server " << server << "\n";
+          return;
+        }
+
+        it->second.iJobs.emplace(priority, PoolJob{ job, cbk, priority, 0 });
+      }
+
+      Schedule(server);
+    }
+
+    virtual void Download(const std::string& server, const std::string& fRemote, const std::string& fLocal, TCompletionCbk cbk = nullptr, int priority = 0, DCProt P = DCProt::Clear)
+    {
+      Submit(server, [=] (SPCProtocolFTP session, TCompletionCbk done) {
+        session->Download(nullptr, fRemote, fLocal, P, MakeReplyCbk(done));
+      }, priority, cbk);
+    }
+
+    virtual void Upload(const std::string& server, const std::string& fRemote, const std::string& fLocal, TCompletionCbk cbk = nullptr, int priority = 0, DCProt P = DCProt::Clear)
+    {
+      Submit(server, [=] (SPCProtocolFTP session, TCompletionCbk done) {
+        session->Upload(nullptr, fRemote, fLocal, P, MakeReplyCbk(done));
+      }, priority, cbk);
+    }
+
+    virtual size_t GetQueuedJobs(const std::string& server)
+    {
+      std::lock_guard<std::mutex> lg(iLock);
+
+      auto it = iServers.find(server);
+
+      return (it != iServers.end()) ? it->second.iJobs.size() : 0;
+    }
+
+    /*
+     * QUITs all sessions; queued jobs are dropped
+     */
+    virtual void Close(void)
+    {
+      std::map<std::string, Server> servers;
+
+      {
+        std::lock_guard<std::mutex> lg(iLock);
+
+        servers.swap(iServers);
+      }
+
+      for (auto& [name, s] : servers)
+      {
+        for (auto& e : s.iSessions)
+        {
+          e.iSession->Quit();
+        }
+      }
+    }
+
+    protected:
+
+    struct PoolJob
+    {
+      TPoolJob       iJob;
+      TCompletionCbk iCbk;
+      int            iPriority;
+      int            iAttempt;
+    };
+
+    struct PoolSession
+    {
+      SPCProtocolFTP iSession;
+      bool           iBusy;
+    };
+
+    struct Server
+    {
+      SPCProtocolFTP iSeed;
+      size_t iCap = 1;
+      int iRetries = 0;
+      std::vector<PoolSession> iSessions;
+      std::multimap<int, PoolJob, std::greater<int>> iJobs;
+    };
+
+    std::mutex iLock;
+
+    std::map<std::string, Server> iServers;
+
+    /*
+     * rcbk for a transfer job: done with the outcome of the final
+     * reply to RETR/STOR; a 4xx/5xx or a closed control connection
+     * (421) fails it
+     */
+    static TResponseCbk MakeReplyCbk(TCompletionCbk done)
+    {
+      return [done] (const std::string& r) {
+        if (r.size() && (r[0] == '2' || r[0] == '4' || r[0] == '5'))
+        {
+          done(r[0] == '2');
+        }
+      };
+    }
+
+    /*
+     * pairs queued jobs with idle sessions, opening new ones up to
+     * the cap; the jobs are started outside of iLock
+     */
+    virtual void Schedule(const std::string& server)
+    {
+      std::vector<std::tuple<size_t, SPCProtocolFTP, PoolJob>> launch;
+
+      {
+        std::lock_guard<std::mutex> lg(iLock);
+
+        auto it = iServers.find(server);
+
+        if (it == iServers.end()) return;
+
+        auto& s = it->second;
+
+        for (size_t i = 0; s.iJobs.size() && i < s.iCap; i++)
+        {
+          if (i == s.iSessions.size())
+          {
+            auto session = s.iSessions.empty() ? s.iSeed : s.iSeed->CloneSession();
+
+            if (!session) break;
+
+            s.iSessions.push_back({ session, false });
+          }
+
+          auto& e = s.iSessions[i];
+
+          if (e.iBusy) continue;
+
+          if (e.iSession->IsDisconnected())
+          {
+            auto fresh = e.iSession->CloneSession();
+
+            if (!fresh) continue;
+
+            e.iSession = fresh;
+          }
+
+          e.iBusy = true;
+
+          launch.emplace_back(i, e.iSession, s.iJobs.begin()->second);
+
+          s.iJobs.erase(s.iJobs.begin());
+        }
+      }
+
+      auto self = shared_from_this();
+
+      for (auto& [i, session, job] : launch)
+      {
+        auto finished = std::make_shared<bool>(false);
+
+        job.iJob(session, [self, server, i, session, job, finished] (bool ok) {
+          if (*finished) return;
+
+          *finished = true;
+
+          self->OnJobDone(server, i, session, job, ok);
+        });
+      }
+    }
+
+    virtual void OnJobDone(const std::string& server, size_t i, SPCProtocolFTP session, PoolJob job, bool ok)
+    {
+      bool retry = false;
+
+      {
+        std::lock_guard<std::mutex> lg(iLock);
+
+        auto it = iServers.find(server);
+
+        if (it == iServers.end()) return;
+
+        auto& s = it->second;
+
+        if (i < s.iSessions.size() && s.iSessions[i].iSession == session)
+        {
+          s.iSessions[i].iBusy = false;
+        }
+
+        if (!ok && session->IsDisconnected() && job.iAttempt < s.iRetries)
+        {
+          job.iAttempt++;
+
+          /*
+           * ahead of the jobs queued with the same priority
+           */
+          s.iJobs.emplace_hint(s.iJobs.lower_bound(job.iPriority), job.iPriority, job);
+
+          retry = true;
+        }
+      }
+
+      if (!retry && job.iCbk)
+      {
+        job.iCbk(ok);
+      }
+
+      Schedule(server);
+    }
+  };
+
+  using SPCFTPSessionPool = std::shared_ptr<CFTPSessionPool>;
+}
+
+#endif //FTPSESSIONPOOL_HPP
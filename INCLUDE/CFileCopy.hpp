@@ -0,0 +1,464 @@
+#ifndef FILECOPY_HPP
+#define FILECOPY_HPP
+
+#include <CDevice.hpp>
+#include <CBufferPool.hpp>
+#include <CFileIOEngine.hpp>
+
+#include <mutex>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <iostream>
+#include <algorithm>
+#include <functional>
+#include <condition_variable>
+
+#ifdef linux
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
+namespace NPL
+{
+  enum class CopyMethod : uint8_t
+  {
+    Auto = 0,       // reflink, then copy_file_range, then read/write
+    Reflink,
+    CopyRange,
+    ReadWrite
+  };
+
+  struct CopyStats
+  {
+    uint64_t   iBytes = 0;
+    uint64_t   iTotal = 0;
+    double     iSeconds = 0;
+    CopyMethod iMethod = CopyMethod::Auto;
+
+    double MBps(void) const
+    {
+      return iSeconds > 0 ? (iBytes / (1024.0 * 1024.0)) / iSeconds : 0.0;
+    }
+  };
+
+  using TCopyDoneCbk = std::function<void (bool ok, const CopyStats& stats)>;
+
+  using TCopyProgressCbk = std::function<void (const CopyStats& stats)>;
+
+  /*
+   * Bulk file copy with "depth" chunks in flight. Each chunk is a
+   * read and a write at the same offset run on its own I/O thread
+   * through a pooled, aligned buffer, so the source and target queues
+   * are kept full. On Linux a reflink (FICLONE) or copy_file_range is
+   * tried first; a method the filesystems do not support falls back
+   * to the next one. Callbacks run on the I/O threads, progress
+   * calls one at a time; the done callback must not Start() the
+   * next copy itself.
+   */
+  class CFileCopy
+  {
+    public:
+
+    CFileCopy(size_t depth = 8, size_t chunk = 1024 * 1024, CopyMethod method = CopyMethod::Auto)
+    {
+      iDepth = depth ? depth : 1;
+
+      #ifdef WIN32
+      /*
+       * the sync handle has a single file pointer
+       */
+      iDepth = 1;
+      #endif
+
+      iChunk = std::max<size_t>(chunk, 4096);
+
+      iMethod = method;
+    }
+
+    virtual ~CFileCopy()
+    {
+      Wait();
+    }
+
+    /*
+     * false if a copy is running or a file can not be opened;
+     * T is std::string or, on Windows, std::wstring
+     */
+    template <typename T>
+    bool Start(const T& src, const T& dst, TCopyDoneCbk done = nullptr, TCopyProgressCbk progress = nullptr)
+    {
+      std::lock_guard<std::mutex> lg(iLock);
+
+      if (iRunning)
+      {
+        return false;
+      }
+
+      /*
+       * the target is truncated on open, so only once the source
+       * is known to be there and readable; the source is only read,
+       * a read-only file can be copied
+       */
+      iSrc = std::make_shared<CDevice>(src, false, true);
+
+      uint64_t total = 0;
+
+      if (!iSrc->IsConnected() || !GetFileSize(iSrc, total))
+      {
+        iSrc.reset();
+        return false;
+      }
+
+      iDst = std::make_shared<CDevice>(dst, true);
+
+      if (!iDst->IsConnected())
+      {
+        iSrc.reset();
+        iDst.reset();
+        return false;
+      }
+
+      iDone = done;
+      iProgress = progress;
+
+      iStats = {};
+      iStats.iTotal = total;
+      iStats.iMethod = iMethod;
+
+      iNext = 0;
+      iInFlight = 0;
+      iFailed = false;
+      iStopped = false;
+      iRunning = true;
+
+      iStart = std::chrono::steady_clock::now();
+
+      if (!iEngine)
+      {
+        /*
+         * a finishing chunk queues its successor before its own
+         * slot is released
+         */
+        iEngine = std::make_unique<CFileIOEngine>(iDepth, 2 * iDepth);
+      }
+
+      if (!iPool)
+      {
+        iPool = std::make_unique<CBufferPool>(iDepth, iChunk);
+      }
+
+      #ifdef linux
+      if (iMethod == CopyMethod::Auto || iMethod == CopyMethod::Reflink)
+      {
+        if (ioctl(iDst->iFD, FICLONE, iSrc->iFD) == 0)
+        {
+          iStats.iMethod = CopyMethod::Reflink;
+          iStats.iBytes = iNext = iStats.iTotal;
+        }
+        else
+        {
+          iStats.iMethod = (iMethod == CopyMethod::Auto) ? CopyMethod::CopyRange : CopyMethod::ReadWrite;
+        }
+      }
+      #else
+      iStats.iMethod = CopyMethod::ReadWrite;
+      #endif
+
+      Pump();
+
+      return true;
+    }
+
+    /*
+     * chunks in flight are finished, nothing new is started
+     */
+    virtual void Stop(void)
+    {
+      std::lock_guard<std::mutex> lg(iLock);
+
+      iStopped = true;
+
+      Pump();
+    }
+
+    /*
+     * blocks until the current copy has finished
+     */
+    virtual bool Wait(void)
+    {
+      std::unique_lock<std::mutex> ul(iLock);
+
+      iCV.wait(ul, [this] { return !iRunning; });
+
+      return !iFailed;
+    }
+
+    virtual CopyStats GetStats(void)
+    {
+      std::lock_guard<std::mutex> lg(iLock);
+
+      auto stats = iStats;
+
+      stats.iSeconds = Elapsed();
+
+      return stats;
+    }
+
+    protected:
+
+    std::mutex iLock;
+
+    std::condition_variable iCV;
+
+    std::mutex iProgressLock;
+
+    std::unique_ptr<CFileIOEngine> iEngine;
+
+    std::unique_ptr<CBufferPool> iPool;
+
+    SPCDevice iSrc;
+
+    SPCDevice iDst;
+
+    size_t iDepth;
+
+    size_t iChunk;
+
+    CopyMethod iMethod;
+
+    CopyStats iStats;
+
+    uint64_t iNext = 0;
+
+    size_t iInFlight = 0;
+
+    bool iFailed = false;
+
+    bool iStopped = false;
+
+    bool iRunning = false;
+
+    TCopyDoneCbk iDone = nullptr;
+
+    TCopyProgressCbk iProgress = nullptr;
+
+    std::chrono::steady_clock::time_point iStart;
+
+    double Elapsed(void)
+    {
+      return std::chrono::duration<double>(std::chrono::steady_clock::now() - iStart).count();
+    }
+
+    static bool GetFileSize(const SPCDevice& d, uint64_t& size)
+    {
+      #ifdef linux
+      struct stat st;
+
+      if (fstat(d->iFD, &st) != 0)
+      {
+        std::cout << "CFileCopy fstat() failed, error : " << strerror(errno) << "\n";
+        return false;
+      }
+
+      size = st.st_size;
+      #else
+      LARGE_INTEGER li;
+
+      if (!GetFileSizeEx(d->iFDsync, &li))
+      {
+        std::cout << "CFileCopy GetFileSizeEx() failed : " << GetLastError() << "\n";
+        return false;
+      }
+
+      size = li.QuadPart;
+      #endif
+
+      return true;
+    }
+
+    /*
+     * called with iLock held; starts chunks up to the depth and
+     * completes the copy once the last one is back
+     */
+    virtual void Pump(void)
+    {
+      while (!iFailed && !iStopped && iNext < iStats.iTotal && iInFlight < iDepth)
+      {
+        uint64_t o = iNext;
+
+        size_t l = static_cast<size_t>(std::min<uint64_t>(iChunk, iStats.iTotal - o));
+
+        bool queued = iEngine->Submit([this, o, l] () {
+          CopyChunk(o, l);
+        });
+
+        if (!queued) break;
+
+        iNext += l;
+
+        iInFlight++;
+      }
+
+      if (iRunning && !iInFlight && (iFailed || iStopped || iNext >= iStats.iTotal))
+      {
+        iStats.iSeconds = Elapsed();
+
+        iSrc.reset();
+        iDst.reset();
+
+        if (iDone)
+        {
+          auto done = iDone;
+          auto stats = iStats;
+          bool ok = !iFailed && !iStopped;
+
+          iLock.unlock();
+          done(ok, stats);
+          iLock.lock();
+        }
+
+        iRunning = false;
+
+        iCV.notify_all();
+      }
+    }
+
+    /*
+     * runs on an I/O thread
+     */
+    virtual void CopyChunk(uint64_t o, size_t l)
+    {
+      CopyMethod method;
+      SPCDevice src, dst;
+
+      {
+        std::lock_guard<std::mutex> lg(iLock);
+        method = iStats.iMethod;
+        src = iSrc;
+        dst = iDst;
+      }
+
+      bool ok = false;
+
+      #ifdef linux
+      if (method == CopyMethod::CopyRange)
+      {
+        int rc = CopyRange(src, dst, o, l);
+
+        if (rc < 0)
+        {
+          /*
+           * not supported across these filesystems
+           */
+          std::lock_guard<std::mutex> lg(iLock);
+          iStats.iMethod = method = CopyMethod::ReadWrite;
+        }
+        else
+        {
+          ok = (rc > 0);
+        }
+      }
+      #endif
+
+      if (method == CopyMethod::ReadWrite)
+      {
+        ok = ReadWrite(src, dst, o, l);
+      }
+
+      TCopyProgressCbk progress;
+      CopyStats stats;
+
+      {
+        std::lock_guard<std::mutex> lg(iLock);
+
+        if (ok)
+          iStats.iBytes += l;
+        else
+          iFailed = true;
+
+        progress = iProgress;
+        stats = iStats;
+        stats.iSeconds = Elapsed();
+      }
+
+      if (ok && progress)
+      {
+        std::lock_guard<std::mutex> lg(iProgressLock);
+
+        progress(stats);
+      }
+
+      std::lock_guard<std::mutex> lg(iLock);
+
+      iInFlight--;
+
+      Pump();
+    }
+
+    virtual bool ReadWrite(SPCDevice& src, SPCDevice& dst, uint64_t o, size_t l)
+    {
+      auto b = iPool->Get();
+
+      if (!b)
+      {
+        std::cout << "CFileCopy no free buffer\n";
+        return false;
+      }
+
+      int32_t n = src->ReadSync(b, l, o);
+
+      bool ok = (n == static_cast<int32_t>(l)) && dst->WriteSync(b, l, o) == static_cast<int32_t>(l);
+
+      iPool->Put(b);
+
+      return ok;
+    }
+
+    #ifdef linux
+    /*
+     * 1 done, 0 I/O error, -1 copy_file_range not usable here
+     */
+    virtual int CopyRange(SPCDevice& src, SPCDevice& dst, uint64_t o, size_t l)
+    {
+      loff_t in = o, out = o;
+
+      while (l)
+      {
+        ssize_t rc = copy_file_range(src->iFD, &in, dst->iFD, &out, l, 0);
+
+        if (rc == -1)
+        {
+          if (errno == EINTR) continue;
+
+          if (errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP || errno == EINVAL)
+          {
+            return (in == static_cast<loff_t>(o)) ? -1 : 0;
+          }
+
+          std::cout << "CFileCopy copy_file_range failed, error : " << strerror(errno) << "\n";
+
+          return 0;
+        }
+
+        if (rc == 0)
+        {
+          std::cout << "CFileCopy source truncated during copy\n";
+
+          return 0;
+        }
+
+        l -= rc;
+      }
+
+      return 1;
+    }
+    #endif
+  };
+
+  using SPCFileCopy = std::shared_ptr<CFileCopy>;
+}
+
+#endif //FILECOPY_HPP
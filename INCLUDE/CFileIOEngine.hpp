@@ -0,0 +1,131 @@
+#ifndef FILEIOENGINE_HPP
+#define FILEIOENGINE_HPP
+
+#include <CSubject.hpp>
+
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <cstddef>
+#include <condition_variable>
+
+namespace NPL
+{
+  /*
+   * Runs blocking file I/O off the dispatcher thread. Regular files
+   * can not be waited on with epoll, so file devices hand their
+   * pread/pwrite jobs to a small pool of I/O threads; the job posts
+   * its completion back through the dispatcher as an ordinary
+   * READ/WRITE context. At most "depth" jobs are queued or running,
+   * Submit() returns false beyond that and the caller does the I/O
+   * inline.
+   */
+  class CFileIOEngine
+  {
+    public:
+
+    CFileIOEngine(size_t threads = 2, size_t depth = 64)
+    {
+      iDepth = depth ? depth : 1;
+
+      for (size_t i = 0; i < (threads ? threads : 1); i++)
+      {
+        iWorkers.emplace_back(&CFileIOEngine::Worker, this);
+      }
+    }
+
+    virtual ~CFileIOEngine()
+    {
+      {
+        std::lock_guard<std::mutex> lg(iLock);
+        iStop = true;
+      }
+
+      iCV.notify_all();
+
+      for (auto& t : iWorkers)
+      {
+        t.join();
+      }
+    }
+
+    CFileIOEngine(const CFileIOEngine&) = delete;
+
+    CFileIOEngine& operator=(const CFileIOEngine&) = delete;
+
+    virtual bool Submit(TFileIOJob job)
+    {
+      {
+        std::lock_guard<std::mutex> lg(iLock);
+
+        if (iStop || iInFlight >= iDepth)
+        {
+          return false;
+        }
+
+        iInFlight++;
+
+        iJobs.push_back(std::move(job));
+      }
+
+      iCV.notify_one();
+
+      return true;
+    }
+
+    virtual size_t GetInFlight(void)
+    {
+      std::lock_guard<std::mutex> lg(iLock);
+
+      return iInFlight;
+    }
+
+    protected:
+
+    std::mutex iLock;
+
+    std::condition_variable iCV;
+
+    std::deque<TFileIOJob> iJobs;
+
+    std::vector<std::thread> iWorkers;
+
+    size_t iDepth;
+
+    size_t iInFlight = 0;
+
+    bool iStop = false;
+
+    /*
+     * queued jobs are still run on shutdown
+     */
+    void Worker(void)
+    {
+      while (true)
+      {
+        TFileIOJob job;
+
+        {
+          std::unique_lock<std::mutex> ul(iLock);
+
+          iCV.wait(ul, [this] { return iStop || iJobs.size(); });
+
+          if (iJobs.empty()) return;
+
+          job = std::move(iJobs.front());
+
+          iJobs.pop_front();
+        }
+
+        job();
+
+        std::lock_guard<std::mutex> lg(iLock);
+
+        iInFlight--;
+      }
+    }
+  };
+}
+
+#endif //FILEIOENGINE_HPP
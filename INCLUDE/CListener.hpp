@@ -33,7 +33,10 @@ namespace NPL
       iCbkAccept = cbkAccept;
     }
 
-    virtual ~CListener(){}
+    virtual ~CListener()
+    {
+      MarkDestroying();
+    }
 
     virtual void OnRead(const uint8_t *b, size_t n)
     {
@@ -0,0 +1,238 @@
+#ifndef PIPELINE_HPP
+#define PIPELINE_HPP
+
+#include <CDeviceSocket.hpp>
+
+#include <tuple>
+#include <memory>
+#include <utility>
+
+namespace NPL
+{
+  /*
+   * Default stage behaviour, a stage derives from CStage and hides
+   * the calls it handles. Received data and events travel up with
+   * link.Up / link.Connected / link.Disconnected, data to send
+   * travels down with link.Down; "link" is the stage's position in
+   * the pipeline, see CPipeline::Link.
+   */
+  struct CStage
+  {
+    template <typename L>
+    void OnRead(const uint8_t *b, size_t n, L& link)
+    {
+      link.Up(b, n);
+    }
+
+    template <typename L>
+    void Write(const uint8_t *b, size_t n, L& link)
+    {
+      link.Down(b, n);
+    }
+
+    template <typename L>
+    void OnConnect(L& link)
+    {
+      link.Connected();
+    }
+
+    template <typename L>
+    void OnDisconnect(L& link)
+    {
+      link.Disconnected();
+    }
+  };
+
+  /*
+   * A fixed protocol stack as one socket device. The stages are held
+   * by value and called through templates, so a read goes socket ->
+   * TLS -> stage 0 -> ... -> last stage (the handler) and a Send()
+   * goes back down without a virtual call, shared_ptr or std::function
+   * between the stages. Socket and TLS are this CDeviceSocket; it is
+   * added to the dispatcher like any other socket. A listening pipeline
+   * serves each accepted connection with a pipeline of its own whose
+   * stages are copies of the listener's. TLS, as everywhere in this
+   * library, is client side only.
+   */
+  template <typename... Stages>
+  class CPipeline : public CDeviceSocket
+  {
+    public:
+
+    static constexpr size_t N = sizeof...(Stages);
+
+    template <size_t I>
+    class Link
+    {
+      CPipeline& iPipeline;
+
+      public:
+
+      Link(CPipeline& p) : iPipeline(p) {}
+
+      void Up(const uint8_t *b, size_t n)
+      {
+        iPipeline.template Up<I + 1>(b, n);
+      }
+
+      void Down(const uint8_t *b, size_t n)
+      {
+        iPipeline.template Down<I>(b, n);
+      }
+
+      void Connected(void)
+      {
+        iPipeline.template Connect<I + 1>();
+      }
+
+      void Disconnected(void)
+      {
+        iPipeline.template Disconnect<I + 1>();
+      }
+
+      /*
+       * sends from the top of the pipeline, as Send() does
+       */
+      void Reply(const uint8_t *b, size_t n)
+      {
+        iPipeline.template Down<N>(b, n);
+      }
+
+      void Close(void)
+      {
+        iPipeline.StopSocket();
+      }
+
+      bool IsClient(void)
+      {
+        return iPipeline.IsClientSocket();
+      }
+
+      CPipeline& GetPipeline(void)
+      {
+        return iPipeline;
+      }
+    };
+
+    CPipeline(Stages... stages) : iStages(std::move(stages)...)
+    {
+    }
+
+    /*
+     * accepted connection
+     */
+    CPipeline(FD aSocket, const std::tuple<Stages...>& stages) : CDeviceSocket(aSocket), iStages(stages)
+    {
+    }
+
+    virtual ~CPipeline()
+    {
+      MarkDestroying();
+    }
+
+    template <size_t I>
+    auto& GetStage(void)
+    {
+      return std::get<I>(iStages);
+    }
+
+    /*
+     * hands data to the last stage's Write, dispatcher thread
+     */
+    virtual void Send(const uint8_t *b, size_t n)
+    {
+      Down<N>(b, n);
+    }
+
+    template <size_t I>
+    void Up(const uint8_t *b, size_t n)
+    {
+      if constexpr (I < N)
+      {
+        Link<I> link(*this);
+        std::get<I>(iStages).OnRead(b, n, link);
+      }
+    }
+
+    template <size_t I>
+    void Down(const uint8_t *b, size_t n)
+    {
+      if constexpr (I == 0)
+      {
+        CDeviceSocket::Write(b, n);
+      }
+      else
+      {
+        Link<I - 1> link(*this);
+        std::get<I - 1>(iStages).Write(b, n, link);
+      }
+    }
+
+    template <size_t I>
+    void Connect(void)
+    {
+      if constexpr (I < N)
+      {
+        Link<I> link(*this);
+        std::get<I>(iStages).OnConnect(link);
+      }
+    }
+
+    template <size_t I>
+    void Disconnect(void)
+    {
+      if constexpr (I < N)
+      {
+        Link<I> link(*this);
+        std::get<I>(iStages).OnDisconnect(link);
+      }
+    }
+
+    protected:
+
+    std::tuple<Stages...> iStages;
+
+    virtual std::shared_ptr<CDeviceSocket> MakeAcceptedSocket(FD aSocket) override
+    {
+      return std::make_shared<CPipeline>(aSocket, iStages);
+    }
+
+    /*
+     * the dispatcher's entry points, the only virtual calls a
+     * message goes through
+     */
+    virtual void NotifyRead(const uint8_t *b, size_t n) override
+    {
+      Up<0>(b, n);
+    }
+
+    virtual void NotifyConnect(void) override
+    {
+      if (GetTLS() == TLS::Yes)
+      {
+        InitializeSSL([this] () {
+          Connect<0>();
+        });
+      }
+      else
+      {
+        Connect<0>();
+      }
+    }
+
+    virtual void NotifyAccept(void) override
+    {
+      std::static_pointer_cast<CPipeline>(iConnectedClient)->template Connect<0>();
+    }
+
+    virtual void NotifyDisconnect(void) override
+    {
+      Disconnect<0>();
+    }
+  };
+
+  template <typename... Stages>
+  using SPCPipeline = std::shared_ptr<CPipeline<Stages...>>;
+}
+
+#endif //PIPELINE_HPP
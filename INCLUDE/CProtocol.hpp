@@ -22,6 +22,8 @@ namespace NPL
       iMessage = m;
     }
 
+    CMessage(std::string&& m) : iMessage(std::move(m)) {}
+
     CMessage(const uint8_t *b, size_t l)
     {
       iMessage = std::string((char *)b, l);
@@ -63,7 +65,10 @@ namespace NPL
 
     CProtocol() = default;
 
-    virtual ~CProtocol() {}
+    virtual ~CProtocol()
+    {
+      this->MarkDestroying();
+    }
 
     virtual void StartClient(TOnConnectCbk cbk = nullptr)
     {
@@ -97,6 +102,20 @@ namespace NPL
       }      
     }
 
+    /*
+     * shapes the socket this protocol runs on, see 
+     * CDeviceSocket::SetRateLimit
+     */
+    virtual void SetRateLimit(SPCTokenBucket rx, SPCTokenBucket tx)
+    {
+      auto sock = GetTargetSocketDevice();
+
+      if (sock)
+      {
+        sock->SetRateLimit(rx, tx);
+      }
+    }
+
     virtual size_t GetMessageCount(void)
     {
       return iMessages.size();
@@ -175,16 +194,46 @@ namespace NPL
 
     virtual SPCDeviceSocket GetTargetSocketDevice(void)
     {
-      auto target = (this->iTarget).lock();
+      return std::dynamic_pointer_cast<CDeviceSocket>(this->GetTargetRef());
+    }
+
+    /*
+     * the socket this protocol runs on, for the per message paths on
+     * the dispatcher thread only, the bare pointer is not kept alive
+     * anywhere else; nullptr once the socket is gone or the protocol
+     * detached. Other threads use the above
+     */
+    CDeviceSocket * GetTargetSocket(void)
+    {
+      assert(this->IsLoopThread());
+
+      auto target = this->GetTargetPtr();
+
+      return (target && !target.iPin) ? iSocket.load() : nullptr;
+    }
 
-      if (target)
+    virtual TLS GetTargetTLS(void)
+    {
+      auto sock = this->IsLoopThread() ? GetTargetSocket() : nullptr;
+
+      if (sock)
       {
-        return std::dynamic_pointer_cast<CDeviceSocket>(target);
+        return sock->GetTLS();
       }
 
-      return nullptr;
+      auto device = GetTargetSocketDevice();
+
+      return device ? device->GetTLS() : TLS::No;
+    }
+
+    virtual void OnTargetChanged(void) override
+    {
+      std::lock_guard<std::mutex> lg(this->iBindingLock);
+      iSocket = dynamic_cast<CDeviceSocket *>(this->GetBinding()->iTarget);
     }
 
+    std::atomic<CDeviceSocket *> iSocket{nullptr};
+
     std::string iUserName;
 
     std::string iPassword;
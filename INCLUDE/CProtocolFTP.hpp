@@ -3,23 +3,234 @@
 
 #include <CProtocol.hpp>
 #include <CListener.hpp>
+#include <CDeviceMapped.hpp>
+#include <CWriteBehind.hpp>
+#include <CFTPListParser.hpp>
+#include <CZStream.hpp>
+#include <CChecksum.hpp>
 
 #include <list>
+#include <array>
 #include <tuple>
 #include <atomic>
 #include <vector>
 #include <string>
 #include <sstream>
+#include <cctype>
 #include <cstring>
+#include <fstream>
+#include <charconv>
+#include <algorithm>
+#include <filesystem>
 #include <functional>
+#include <string_view>
+
+#ifdef linux
+#include <sys/stat.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+  #include <emmintrin.h>
+  #define NPL_FTP_SSE2
+  #ifdef _MSC_VER
+  #include <intrin.h>
+  #endif
+#endif
 
 namespace NPL 
 {
+  struct FTPLineSpan
+  {
+    size_t iOffset;
+    size_t iLength;
+  };
+
   class CFTPMessage : public CMessage
   {
+    protected:
+
+    int iCode = 0;
+
+    std::vector<FTPLineSpan> iLines;
+
     public:
 
     CFTPMessage(const std::vector<uint8_t>& m) : CMessage(m) {}
+
+    CFTPMessage(std::string&& m, int code, std::vector<FTPLineSpan>&& lines) : 
+      CMessage(std::move(m)), iCode(code), iLines(std::move(lines)) {}
+
+    /*
+     * 3 digit reply code, 0 if the reply did not start with one
+     */
+    virtual int GetCode(void)
+    {
+      return iCode;
+    }
+
+    virtual size_t GetLineCount(void)
+    {
+      return iLines.size();
+    }
+
+    /*
+     * i'th line of the reply without its CRLF; valid as long as 
+     * the message is alive
+     */
+    virtual std::string_view GetLine(size_t i)
+    {
+      return std::string_view(iMessage).substr(iLines[i].iOffset, iLines[i].iLength);
+    }
+  };
+
+  using SPCFTPMessage = std::shared_ptr<CFTPMessage>;
+
+  /*
+   * Incremental, line oriented reply parser (rfc 959 4.2). Bytes are 
+   * appended once and scanned once for LF; a reply is complete after 
+   * a single "NNN " line or, for "NNN-" replies, after the first line 
+   * that starts with the same code followed by a space. Text lines in 
+   * between may start with anything, including other codes.
+   */
+  class CFTPReplyParser
+  {
+    public:
+
+    template <typename F>
+    void Feed(const uint8_t *b, size_t n, F&& onReply)
+    {
+      iReply.append((const char *) b, n);
+
+      while (iScan < iReply.size())
+      {
+        size_t lf = FindLF(iReply.data() + iScan, iReply.size() - iScan);
+
+        if (lf == std::string::npos)
+        {
+          iScan = iReply.size();
+          break;
+        }
+
+        size_t end = iScan + lf;
+
+        iScan = end + 1;
+
+        if (end > iLineStart && iReply[end - 1] == '\r')
+        {
+          end--;
+        }
+
+        if (OnLine(iLineStart, end - iLineStart))
+        {
+          onReply(TakeReply());
+        }
+        else
+        {
+          iLineStart = iScan;
+        }
+      }
+    }
+
+    protected:
+
+    std::string iReply;
+
+    size_t iScan = 0;
+
+    size_t iLineStart = 0;
+
+    int iCode = 0;
+
+    bool iMultiline = false;
+
+    std::vector<FTPLineSpan> iLines;
+
+    static int ParseCode(const char *p, size_t l)
+    {
+      if (l < 3 || 
+          !isdigit((unsigned char) p[0]) || 
+          !isdigit((unsigned char) p[1]) || 
+          !isdigit((unsigned char) p[2]))
+      {
+        return 0;
+      }
+
+      return (p[0] - '0') * 100 + (p[1] - '0') * 10 + (p[2] - '0');
+    }
+
+    /*
+     * returns true if the line completes the reply
+     */
+    bool OnLine(size_t off, size_t len)
+    {
+      const char *p = iReply.data() + off;
+
+      iLines.push_back({ off, len });
+
+      if (iLines.size() == 1)
+      {
+        iCode = ParseCode(p, len);
+
+        iMultiline = iCode && (len > 3) && (p[3] == '-');
+
+        return !iMultiline;
+      }
+
+      return (ParseCode(p, len) == iCode) && (len == 3 || p[3] == ' ');
+    }
+
+    SPCFTPMessage TakeReply(void)
+    {
+      std::string rest;
+
+      if (iScan < iReply.size())
+      {
+        rest = iReply.substr(iScan);
+        iReply.resize(iScan);
+      }
+
+      auto m = std::make_shared<CFTPMessage>(std::move(iReply), iCode, std::move(iLines));
+
+      iReply = std::move(rest);
+      iLines.clear();
+      iScan = iLineStart = 0;
+      iCode = 0;
+      iMultiline = false;
+
+      return m;
+    }
+
+    static size_t FindLF(const char *b, size_t n)
+    {
+      size_t i = 0;
+
+      #ifdef NPL_FTP_SSE2
+
+      const __m128i lf = _mm_set1_epi8('\n');
+
+      for (; i + 16 <= n; i += 16)
+      {
+        int mask = _mm_movemask_epi8(
+          _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(b + i)), lf));
+
+        if (mask)
+        {
+          #ifdef _MSC_VER
+          unsigned long bit;
+          _BitScanForward(&bit, mask);
+          return i + bit;
+          #else
+          return i + __builtin_ctz(mask);
+          #endif
+        }
+      }
+
+      #endif
+
+      auto p = (const char *) memchr(b + i, '\n', n - i);
+
+      return p ? (p - b) : std::string::npos;
+    }
   };
 
   enum class DCProt : uint8_t
@@ -28,8 +239,139 @@ namespace NPL
     Protected
   };
 
+  /*
+   * control channel states; 1yz and xyz are the DATA command 
+   * after its preliminary and its final reply respectively
+   */
+  enum class FTPState : uint8_t
+  {
+    Connecting = 0,
+    Connected,
+    Check,
+    Auth,
+    Adat,
+    Tls,
+    User,
+    Pass,
+    Acct,
+    Ready,
+    Pasv,
+    Data,
+    Prelim,
+    Final,
+    Gen,
+    Disconnected,
+    Count
+  };
+
+  enum class FTPAction : uint8_t
+  {
+    None = 0,
+    CheckExplicitFTPS,
+    CCHandshake,
+    SendUser,
+    SendPass,
+    SendAcct,
+    LoginFailed,
+    LoginDone,
+    SkipTransfer,
+    PasvResponse,
+    DataCmdResponse,
+    GenCmdResponse
+  };
+
+  struct FTPTransition
+  {
+    FTPState  iNextState;
+    FTPAction iAction;
+  };
+
+  /*
+   * reply class is the first digit of the reply code (rfc 959 4.2), 
+   * 0 for anything that is not a valid reply
+   */
+  constexpr size_t FTPReplyClass(uint8_t c)
+  {
+    return (c >= '1' && c <= '5') ? (c - '0') : 0;
+  }
+
+  constexpr size_t FTPStateCount = static_cast<size_t>(FTPState::Count);
+
+  constexpr size_t FTPReplyClassCount = 6;
+
+  using TFTPStateTable = std::array<std::array<FTPTransition, FTPReplyClassCount>, FTPStateCount>;
+
+  /*
+   * [state][reply-class] -> (next state, action). Cells not listed 
+   * keep the current state and do nothing.
+   */
+  constexpr TFTPStateTable MakeFTPStateTable(void)
+  {
+    TFTPStateTable t = {};
+
+    for (size_t s = 0; s < FTPStateCount; s++)
+    {
+      for (size_t r = 0; r < FTPReplyClassCount; r++)
+      {
+        t[s][r] = { static_cast<FTPState>(s), FTPAction::None };
+      }
+    }
+
+    auto set = [&t] (FTPState s, char r, FTPState n, FTPAction a) {
+      t[static_cast<size_t>(s)][FTPReplyClass(r)] = { n, a };
+    };
+
+    // Connection states
+    set(FTPState::Connected, '1', FTPState::Connected, FTPAction::None);
+    set(FTPState::Connected, '2', FTPState::Check,     FTPAction::CheckExplicitFTPS);
+    set(FTPState::Connected, '4', FTPState::Connected, FTPAction::None);
+    set(FTPState::Auth,      '2', FTPState::Tls,       FTPAction::CCHandshake);
+    set(FTPState::Auth,      '3', FTPState::Adat,      FTPAction::None);
+    set(FTPState::Auth,      '4', FTPState::User,      FTPAction::SendUser);
+    set(FTPState::Auth,      '5', FTPState::User,      FTPAction::SendUser);
+    // USER states
+    set(FTPState::User,      '1', FTPState::User,      FTPAction::None);
+    set(FTPState::User,      '2', FTPState::Ready,     FTPAction::None);
+    set(FTPState::User,      '3', FTPState::Pass,      FTPAction::SendPass);
+    set(FTPState::User,      '4', FTPState::User,      FTPAction::None);
+    set(FTPState::User,      '5', FTPState::User,      FTPAction::None);
+    // PASS states
+    set(FTPState::Pass,      '1', FTPState::User,      FTPAction::LoginFailed);
+    set(FTPState::Pass,      '2', FTPState::Ready,     FTPAction::LoginDone);
+    set(FTPState::Pass,      '3', FTPState::Acct,      FTPAction::SendAcct);
+    set(FTPState::Pass,      '4', FTPState::User,      FTPAction::LoginFailed);
+    set(FTPState::Pass,      '5', FTPState::User,      FTPAction::LoginFailed);
+    // PASV states
+    set(FTPState::Pasv,      '1', FTPState::Data,      FTPAction::SkipTransfer);
+    set(FTPState::Pasv,      '2', FTPState::Data,      FTPAction::PasvResponse);
+    set(FTPState::Pasv,      '4', FTPState::Ready,     FTPAction::SkipTransfer);
+    set(FTPState::Pasv,      '5', FTPState::Ready,     FTPAction::SkipTransfer);
+    // DATA command (LIST, RETR, STOR) states
+    set(FTPState::Data,      '1', FTPState::Prelim,    FTPAction::DataCmdResponse);
+    set(FTPState::Prelim,    '2', FTPState::Final,     FTPAction::DataCmdResponse);
+    set(FTPState::Prelim,    '4', FTPState::Final,     FTPAction::DataCmdResponse);
+    set(FTPState::Prelim,    '5', FTPState::Final,     FTPAction::DataCmdResponse);
+    set(FTPState::Data,      '4', FTPState::Final,     FTPAction::DataCmdResponse);
+    set(FTPState::Data,      '5', FTPState::Final,     FTPAction::DataCmdResponse);
+    // everything else
+    set(FTPState::Gen,       '1', FTPState::Ready,     FTPAction::GenCmdResponse);
+    set(FTPState::Gen,       '2', FTPState::Ready,     FTPAction::GenCmdResponse);
+    set(FTPState::Gen,       '3', FTPState::Ready,     FTPAction::GenCmdResponse);
+    set(FTPState::Gen,       '4', FTPState::Ready,     FTPAction::GenCmdResponse);
+    set(FTPState::Gen,       '5', FTPState::Ready,     FTPAction::GenCmdResponse);
+
+    return t;
+  }
+
+  inline constexpr TFTPStateTable FTPStateTable = MakeFTPStateTable();
+
+  constexpr uint32_t FTP_PIPELINE_REPLY_TIMEOUT_MS = 5000;
+
   using TTransferCbk = std::function<bool (const char *, size_t)>;
   using TResponseCbk = std::function<void (const std::string&)>;
+  using TCompletionCbk = std::function<void (bool)>;
+  using TChecksumCbk = std::function<void (const std::string& fRemote, const std::string& digest)>;
+  using TVerifyCbk = std::function<void (bool match, const std::string& local, const std::string& remote)>;
 
   class CProtocolFTP : public CProtocol<uint8_t, uint8_t>
   {
@@ -40,9 +382,17 @@ namespace NPL
       iCmdInProgress.test_and_set();
     }
 
-    virtual ~CProtocolFTP() {}
+    virtual ~CProtocolFTP()
+    {
+      MarkDestroying();
+    }
 
-    virtual void Upload(TTransferCbk cbk, const std::string& fRemote, const std::string& fLocal, DCProt P = DCProt::Clear)
+    /*
+     * cbk sees the data, rcbk (optional) the final reply to STOR/RETR :
+     * 2xx the transfer completed, 4xx/5xx it failed, 421 the control
+     * connection closed before it finished
+     */
+    virtual void Upload(TTransferCbk cbk, const std::string& fRemote, const std::string& fLocal, DCProt P = DCProt::Clear, TResponseCbk rcbk = nullptr)
     {
       {
         std::lock_guard<std::mutex> lg(iLock);
@@ -53,13 +403,13 @@ namespace NPL
 
         iCmdQ.emplace_back("PASV", "", "", nullptr, nullptr);
 
-        iCmdQ.emplace_back("STOR", fRemote, fLocal, nullptr, cbk);
+        iCmdQ.emplace_back("STOR", fRemote, fLocal, rcbk, cbk);
       }
 
       ProcessNextCmd();
     }
 
-    virtual void Download(TTransferCbk cbk, const std::string& fRemote, const std::string& fLocal, DCProt P = DCProt::Clear)
+    virtual void Download(TTransferCbk cbk, const std::string& fRemote, const std::string& fLocal, DCProt P = DCProt::Clear, TResponseCbk rcbk = nullptr)
     {
       {
         std::lock_guard<std::mutex> lg(iLock);
@@ -68,14 +418,146 @@ namespace NPL
 
         SetDCProtLevel(P);
 
+        if (iDirectIO && fLocal.size())
+        {
+          /*
+           * SIZE is refused in ASCII mode by some servers
+           */
+          iCmdQ.emplace_back("TYPE", "I", "", nullptr, nullptr);
+
+          iCmdQ.emplace_back("SIZE", fRemote, "",
+            [this](const std::string& res) {
+              int64_t size = ParseSizeReply(res);
+              iExpectedSize = (size > 0) ? size : 0;
+            }, nullptr);
+        }
+
+        iCmdQ.emplace_back("PASV", "", "", nullptr, nullptr);
+
+        iCmdQ.emplace_back("RETR", fRemote, fLocal, rcbk, cbk);
+      }
+
+      ProcessNextCmd();
+    }
+
+    /*
+     * Retrieves "length" bytes of fRemote starting at "offset" (REST) and 
+     * writes them at the same offset into an existing local file. The 
+     * data channel is reset once the range is complete. cbk receives the 
+     * range data followed by a null "b" once the range is done.
+     */
+    virtual void DownloadRange(TTransferCbk cbk, const std::string& fRemote, const std::string& fLocal, uint64_t offset, uint64_t length, DCProt P = DCProt::Clear, TResponseCbk rcbk = nullptr)
+    {
+      {
+        std::lock_guard<std::mutex> lg(iLock);
+
+        if (!fRemote.size() || !fLocal.size() || !length) assert(false);
+
+        SetDCProtLevel(P);
+
+        iCmdQ.emplace_back("TYPE", "I", "", nullptr, nullptr);
+
         iCmdQ.emplace_back("PASV", "", "", nullptr, nullptr);
 
-        iCmdQ.emplace_back("RETR", fRemote, fLocal, nullptr, cbk);
+        iCmdQ.emplace_back("REST", std::to_string(offset), "",
+          [this, offset, length](const std::string& res) {
+            iRange = { offset, length, 0, false, !(res[0] == '3') };
+          }, nullptr);
+
+        iCmdQ.emplace_back("RETR", fRemote, fLocal, rcbk, cbk);
+      }
+
+      ProcessNextCmd();
+    }
+
+    /*
+     * Segmented download over "segments" parallel sessions. The file size 
+     * is queried with SIZE on this session, the local file is created at 
+     * its final size and each session retrieves one byte range into it. 
+     * cbk is invoked once, with true if every range received all of its
+     * bytes and false as soon as all ranges ended with any one of them
+     * short, refused or lost with its session.
+     */
+    virtual void DownloadSegmented(TCompletionCbk cbk, const std::string& fRemote, const std::string& fLocal, int segments = 4, DCProt P = DCProt::Clear)
+    {
+      {
+        std::lock_guard<std::mutex> lg(iLock);
+
+        if (!fRemote.size() || !fLocal.size() || segments < 1) assert(false);
+
+        iCmdQ.emplace_back("TYPE", "I", "", nullptr, nullptr);
+
+        iCmdQ.emplace_back("SIZE", fRemote, "",
+          [=](const std::string& res) {
+            int64_t size = ParseSizeReply(res);
+            if (size < 0)
+            {
+              if (cbk) cbk(false);
+              return;
+            }
+            StartSegments(cbk, fRemote, fLocal, size, segments, P);
+          }, nullptr);
       }
 
       ProcessNextCmd();
     }
 
+    /*
+     * Download that continues a partial local file. The local size is 
+     * sent as REST and the data is written from that offset on. If the 
+     * data or control connection drops before the local file reaches 
+     * the remote SIZE, the transfer is resumed again, on a new session 
+     * if the control connection was lost, up to "retries" times. A local
+     * file longer than the remote one is downloaded again from the start.
+     * cbk gets a null "b" at the end either way, done (optional) whether
+     * the file is complete.
+     */
+    virtual void ResumeDownload(TTransferCbk cbk, const std::string& fRemote, const std::string& fLocal, int retries = 3, DCProt P = DCProt::Clear, TCompletionCbk done = nullptr)
+    {
+      if (!fRemote.size() || !fLocal.size()) assert(false);
+
+      std::error_code ec;
+
+      auto job = std::make_shared<ResumeJob>();
+
+      job->iUpload = false;
+      job->iRemote = fRemote;
+      job->iLocal = fLocal;
+      job->iCbk = cbk;
+      job->iDone = done;
+      job->iProt = P;
+      job->iRetries = retries;
+      job->iOffset = std::filesystem::exists(fLocal, ec) ? 
+                       std::filesystem::file_size(fLocal, ec) : 0;
+
+      QueueResumeAttempt(job);
+    }
+
+    /*
+     * Upload that continues a partial remote file. The remote SIZE is 
+     * sent as REST and the local file is read from that offset on. 
+     * Completion is verified with a SIZE after the transfer; a short 
+     * remote file is resumed again, up to "retries" times, one longer
+     * than the local file is uploaded again from the start. cbk and
+     * done as for ResumeDownload.
+     */
+    virtual void ResumeUpload(TTransferCbk cbk, const std::string& fRemote, const std::string& fLocal, int retries = 3, DCProt P = DCProt::Clear, TCompletionCbk done = nullptr)
+    {
+      if (!fRemote.size() || !fLocal.size()) assert(false);
+
+      auto job = std::make_shared<ResumeJob>();
+
+      job->iUpload = true;
+      job->iRemote = fRemote;
+      job->iLocal = fLocal;
+      job->iCbk = cbk;
+      job->iDone = done;
+      job->iProt = P;
+      job->iRetries = retries;
+
+      QueueResumeAttempt(job);
+    }
+
     virtual void ListDirectory(TTransferCbk cbk, const std::string& fRemote = "", DCProt P = DCProt::Clear)
     {
       {
@@ -95,6 +577,28 @@ namespace NPL
       ProcessNextCmd();        
     }
 
+    /*
+     * Structured listing. MLSD is tried first and LIST is used when 
+     * the server does not implement it; entries are parsed as the 
+     * data arrives and handed to cbk in batches of up to "batch".
+     */
+    virtual void ListEntries(TListCbk cbk, const std::string& fRemote = "", size_t batch = 1024, DCProt P = DCProt::Clear)
+    {
+      {
+        std::lock_guard<std::mutex> lg(iLock);
+
+        if (!cbk) assert(false);
+
+        SetDCProtLevel(P);
+
+        iCmdQ.emplace_back("TYPE", "I", "", nullptr, nullptr);
+
+        QueueListing(std::make_shared<CFTPListParser>(true, cbk, batch), fRemote, true);
+      }
+
+      ProcessNextCmd();
+    }
+
     virtual void GetCurrentDir(TResponseCbk cbk = nullptr)
     {
       {
@@ -150,140 +654,467 @@ namespace NPL
       ProcessNextCmd();       
     }
 
-    virtual void Stop(void) override
+    /*
+     * Number of non-transfer commands (CWD, MKD, PWD, TYPE ...) that 
+     * may be sent back to back without waiting for each reply. 
+     * Replies are matched in FIFO order against iCmdQ. 1 disables 
+     * pipelining. It is switched off automatically for the rest of 
+     * the session if the server answers a pipelined command with a 
+     * preliminary or 500/502/503 reply, which indicates it does not 
+     * handle queued input; the rejected command is sent again on its
+     * own. It is also switched off when a batch is not answered within
+     * "timeoutMs", but that batch is never sent again : a late reply
+     * would be matched to the wrong command and a command would run
+     * twice, so its replies are still waited for.
+     */
+    virtual void SetPipelineDepth(size_t depth, uint32_t timeoutMs = FTP_PIPELINE_REPLY_TIMEOUT_MS)
     {
-      std::lock_guard<std::mutex> lg(iLock);
-      
-      if (iDataChannel)
-      {
-        std::dynamic_pointer_cast<CDeviceSocket>(iDataChannel)->StopSocket();
-        iDataChannel.reset();
-      }
-
-      CProtocol::Stop();
+      iPipelineDepth = depth ? depth : 1;
+      iPipelineTimeoutMs = timeoutMs;
     }
 
-    protected:
-
-    DCProt iDCProt = DCProt::Clear;
-
-    bool iContinueTransfer = false;
+    /*
+     * Linux only. Clear (unprotected) data channels move file data with 
+     * sendfile() for STOR and splice() for RETR, without copying it into 
+     * user space. Transfer callbacks then can not see the data; they get 
+     * progress as (nullptr, n) with n > 0, and (nullptr, 0) at the end as 
+     * usual. Protected data channels always use the buffered path.
+     */
+    virtual void SetZeroCopy(bool enable)
+    {
+      iZeroCopy = enable;
+    }
 
-    uint64_t iCurrentFileOffset = 0;
+    /*
+     * Downloaded files are written with direct I/O (CDevice::SetDirectIO) 
+     * so bulk data does not evict the page cache. Download() then asks 
+     * for the SIZE first and preallocates the local file to it.
+     */
+    virtual void SetDirectIO(bool enable)
+    {
+      iDirectIO = enable;
+    }
 
-    SPCSubject iFileDevice = nullptr;
+    /*
+     * Uploads that do not go out with sendfile() read the local file 
+     * through a memory mapped device (CDeviceMapped); the data channel, 
+     * or TLS and MODE Z, consume the file straight from the mapping.
+     */
+    virtual void SetMappedUploads(bool enable)
+    {
+      iMappedUploads = enable;
+    }
 
-    SPCSubject iDataChannel = nullptr;
+    /*
+     * Block size of the write-behind stage that gathers downloaded 
+     * data into large writes to the local file; 0 writes every 
+     * received chunk as it arrives.
+     */
+    virtual void SetWriteBehind(size_t block)
+    {
+      iWriteBehindBlock = block;
+    }
 
-    std::atomic_flag iCmdInProgress = ATOMIC_FLAG_INIT;
+    /*
+     * Checksums the file data of every RETR and STOR as it streams 
+     * (after MODE Z inflate, before deflate). cbk gets the hex digest 
+     * when the data channel closes. Zero copy transfers are not used 
+     * while checksumming, the data has to pass through user space.
+     */
+    virtual void SetChecksum(ChecksumType type, TChecksumCbk cbk = nullptr)
+    {
+      iChecksumType = type;
 
-    std::list<
-      std::tuple<
-       std::string,      // command
-       std::string,      // fRemote
-       std::string,      // fLocal
-       TResponseCbk,     // rcbk
-       TTransferCbk      // ucbk
-    >> iCmdQ;
+      iChecksumCbk = cbk;
 
-    using TStateFn = std::function<void (void)>;
+      iChecksum = (type != ChecksumType::None) ? std::make_unique<CChecksum>(type) : nullptr;
+    }
 
-    struct Transition
+    virtual std::string GetLastChecksum(void)
     {
-      std::string  iTransitionState;
-      char         iResponseCode;
-      std::string  iNextState;
-      TStateFn     iTransitionFn;
-    };
-
-    Transition FSM[32] =
-    {
-      // Connection states
-      { "CONNECTED" , '1', "CONNECTED" , nullptr                                        },
-      { "CONNECTED" , '2', "CHECK"     , [this](){ CheckExplicitFTPS(); }               },
-      { "CONNECTED" , '4', "CONNECTED" , nullptr                                        },
-      { "AUTH"      , '2', "TLS"       , [this](){ DoCCHandshake();     }               },
-      { "AUTH"      , '3', "ADAT"      , nullptr                                        },
-      { "AUTH"      , '4', "USER"      , [this](){ SendCommand("USER", iUserName); }    },
-      { "AUTH"      , '5', "USER"      , [this](){ SendCommand("USER", iUserName); }    },
-      // USER states
-      { "USER"      , '1', "USER"      , [this](){ }                                    },
-      { "USER"      , '2', "READY"     , [this](){ }                                    },
-      { "USER"      , '3', "PASS"      , [this](){ SendCommand("PASS", iPassword); }    },
-      { "USER"      , '4', "USER"      , [this](){ }                                    },
-      { "USER"      , '5', "USER"      , [this](){ }                                    },
-      // PASS states
-      { "PASS"      , '1', "USER"      , [this]() { ProcessLoginEvent(false); }         },
-      { "PASS"      , '2', "READY"     , [this]() { ProcessLoginEvent(true); }          },
-      { "PASS"      , '3', "ACCT"      , [this]() { SendCommand("ACCT");}               },
-      { "PASS"      , '4', "USER"      , [this]() { ProcessLoginEvent(false); }         },
-      { "PASS"      , '5', "USER"      , [this]() { ProcessLoginEvent(false); }         },
-      // PASV states
-      { "PASV"      , '1', "DATA"      , [this]() { SkipCommand(2);        }            },
-      { "PASV"      , '2', "DATA"      , [this]() { ProcessPasvResponse(); }            },
-      { "PASV"      , '4', "READY"     , [this]() { SkipCommand(2);        }            },
-      { "PASV"      , '5', "READY"     , [this]() { SkipCommand(2);        }            },
-      // DATA command (LIST, RETR, STOR) states
-      { "DATA"      , '1', "1yz"       , [this] () { ProcessDataCmdResponse('1'); }     },
-      { "1yz"       , '2', "xyz"       , [this] () { ProcessDataCmdResponse('2'); }     },
-      { "1yz"       , '4', "xyz"       , [this] () { ProcessDataCmdResponse('4'); }     },      
-      { "DATA"      , '4', "xyz"       , [this] () { ProcessDataCmdResponse('4'); }     },
-      { "DATA"      , '5', "xyz"       , [this] () { ProcessDataCmdResponse('5'); }     },
-      { "GEN"       , '1', "READY"     , [this] () { ProcessGenCmdEvent();  }           },
-      { "GEN"       , '2', "READY"     , [this] () { ProcessGenCmdEvent();  }           },
-      { "GEN"       , '3', "READY"     , [this] () { ProcessGenCmdEvent();  }           },
-      { "GEN"       , '4', "READY"     , [this] () { ProcessGenCmdEvent();  }           },
-      { "GEN"       , '5', "READY"     , [this] () { ProcessGenCmdEvent();  }           }
-    };
+      return iLastDigest;
+    }
 
-    virtual void StateMachine(SPCMessage msg) override
+    /*
+     * Compares the CRC32 of the last transfer of fRemote against the 
+     * server's, asked for with HASH (after OPTS HASH CRC32) or XCRC if 
+     * HASH is not implemented. Queue it after the transfer. match is 
+     * false if there is nothing to compare, e.g. when the session 
+     * checksums with CRC32C or XXH64.
+     */
+    virtual void VerifyChecksum(const std::string& fRemote, TVerifyCbk cbk)
     {
-      auto l = msg->GetPayloadLength();
-      auto b = msg->GetPayloadBuffer();
+      {
+        std::lock_guard<std::mutex> lg(iLock);
 
-      LOG << std::string(b, l);
+        iCmdQ.emplace_back("OPTS", "HASH CRC32", "", nullptr, nullptr);
 
-      for (int i = 0; i < sizeof(FSM) / sizeof(FSM[0]); i++)
-      {
-        Transition t = FSM[i];
+        iCmdQ.emplace_back("HASH", fRemote, "",
+          [this, fRemote, cbk] (const std::string& r) {
+            if (!r.compare(0, 3, "500") || !r.compare(0, 3, "502") || !r.compare(0, 3, "504"))
+            {
+              std::lock_guard<std::mutex> lg(iLock);
 
-        if ((iProtocolState == t.iTransitionState) && (t.iResponseCode ==  b[0]))
-        {
-          iProtocolState = t.iNextState;
+              iCmdQ.emplace(std::next(iCmdQ.begin()), "XCRC", fRemote, "",
+                [this, fRemote, cbk] (const std::string& r) {
+                  CompareChecksum(fRemote, r, false, cbk);
+                }, nullptr);
 
-          if (t.iTransitionFn)
-          {
-            t.iTransitionFn();
-          }
+              return;
+            }
 
-          break;
-        }
-      }      
+            CompareChecksum(fRemote, r, true, cbk);
+          }, nullptr);
+      }
+
+      ProcessNextCmd();
     }
 
-    virtual SPCMessage IsMessageComplete(const std::vector<uint8_t>& b) override
+    /*
+     * Shapes the data channels of this session; the control channel 
+     * is left alone so commands are not delayed behind bulk data. The 
+     * buckets are shared by all data channels the session opens, pass 
+     * buckets with a common parent to several sessions for a global 
+     * limit.
+     */
+    virtual void SetDataRateLimit(SPCTokenBucket rx, SPCTokenBucket tx)
     {
-      size_t l = b.size();
+      iDataRxBucket = rx;
+      iDataTxBucket = tx;
+    }
 
-      if (l >= 4)
+    /*
+     * Negotiates MODE Z (deflate compressed transfers). Data is 
+     * deflated on STOR and inflated on RETR/LIST/MLSD; the session 
+     * stays in stream mode if the server refuses. Transfer callbacks 
+     * and REST offsets always see uncompressed data. Zero copy 
+     * transfers are not used while MODE Z is on.
+     */
+    virtual void SetModeZ(bool enable, int level = Z_DEFAULT_COMPRESSION)
+    {
       {
-        if ((b[l-2] == '\r') && (b[l-1] == '\n'))
-        {
-          uint8_t code[4] = { 0, 0, 0, ' '};
+        std::lock_guard<std::mutex> lg(iLock);
 
-          memmove(code, b.data(), 3);
+        iModeZRequested = enable;
 
-          for (size_t i = 0; i < l; i++)
-          {
-            if (0 == memcmp(b.data() + i, code, 4))
-            {
-              return std::make_shared<CFTPMessage>(b);
-            }
-          }
-        }
+        iZLevel = level;
+
+        iCmdQ.emplace_back("MODE", enable ? "Z" : "S", "", 
+          [this, enable] (const std::string& r) {
+            iModeZ = enable && (r[0] == '2');
+          }, nullptr);
       }
 
-      return nullptr;
+      ProcessNextCmd();
+    }
+
+    /*
+     * raw vs on-the-wire bytes of all MODE Z transfers so far
+     */
+    virtual ZStats GetCompressionStats(void)
+    {
+      ZStats s;
+
+      for (auto z : { iDeflater.get(), iInflater.get() })
+      {
+        if (z)
+        {
+          s.iRaw += z->GetStats().iRaw;
+          s.iWire += z->GetStats().iWire;
+        }
+      }
+
+      return s;
+    }
+
+    /*
+     * A new logged in session to the same server, 
+     * on the same dispatcher and with the same TLS mode
+     */
+    virtual std::shared_ptr<CProtocolFTP> CloneSession(void)
+    {
+      auto sock = GetTargetSocketDevice();
+
+      auto D = GetDispatcher();
+
+      if (!sock || !D) return nullptr;
+
+      auto cc = std::make_shared<CDeviceSocket>();
+      auto ftp = std::make_shared<CProtocolFTP>();
+
+      cc->SetHostAndPort(sock->GetHost(), sock->GetPort());
+
+      cc->SetTLS(sock->GetTLS());
+
+      cc->SetProperty("name", "ftp-socket");
+
+      ftp->SetProperty("name", "ftp-protocol");
+
+      ftp->SetCredentials(iUserName, iPassword);
+
+      ftp->SetPipelineDepth(iPipelineDepth, iPipelineTimeoutMs);
+
+      ftp->SetDirectIO(iDirectIO);
+
+      ftp->SetMappedUploads(iMappedUploads);
+
+      ftp->SetWriteBehind(iWriteBehindBlock);
+
+      ftp->SetChecksum(iChecksumType, iChecksumCbk);
+
+      if (iModeZRequested)
+      {
+        ftp->SetModeZ(true, iZLevel);
+      }
+
+      D->AddEventListener(cc)->AddEventListener(ftp);
+
+      ftp->StartClient();
+
+      return ftp;
+    }
+
+    /*
+     * control connection has gone away; the session can not be 
+     * used any more, CloneSession() gives a fresh one
+     */
+    virtual bool IsDisconnected(void)
+    {
+      return iFTPState == FTPState::Disconnected;
+    }
+
+    virtual void Stop(void) override
+    {
+      std::lock_guard<std::mutex> lg(iLock);
+      
+      if (iDataChannel)
+      {
+        std::dynamic_pointer_cast<CDeviceSocket>(iDataChannel)->StopSocket();
+        iDataChannel.reset();
+      }
+
+      CProtocol::Stop();
+    }
+
+    protected:
+
+    DCProt iDCProt = DCProt::Clear;
+
+    bool iContinueTransfer = false;
+
+    uint64_t iCurrentFileOffset = 0;
+
+    SPCSubject iFileDevice = nullptr;
+
+    SPCSubject iDataChannel = nullptr;
+
+    std::atomic_flag iCmdInProgress = ATOMIC_FLAG_INIT;
+
+    size_t iPipelineDepth = 1;
+
+    size_t iPipelineBatch = 0;
+
+    uint32_t iPipelineTimeoutMs = FTP_PIPELINE_REPLY_TIMEOUT_MS;
+
+    uint64_t iPipelineGen = 0;
+
+    bool iZeroCopy = false;
+
+    bool iDirectIO = false;
+
+    bool iMappedUploads = false;
+
+    size_t iWriteBehindBlock = WRITE_BEHIND_BLOCK_SIZE;
+
+    std::unique_ptr<CWriteBehind> iWriteBehind;
+
+    /*
+     * steps of the transfer end that found file writes still out,
+     * run again in order from the write completions
+     */
+    std::vector<std::function<void()>> iAfterFlush;
+
+    uint64_t iExpectedSize = 0;
+
+    bool iModeZ = false;
+
+    bool iModeZRequested = false;
+
+    int iZLevel = Z_DEFAULT_COMPRESSION;
+
+    std::unique_ptr<CZStream> iDeflater;
+
+    std::unique_ptr<CZStream> iInflater;
+
+    std::string iZBuffer;
+
+    ChecksumType iChecksumType = ChecksumType::None;
+
+    std::unique_ptr<CChecksum> iChecksum;
+
+    TChecksumCbk iChecksumCbk = nullptr;
+
+    std::string iLastDigest;
+
+    std::string iLastDigestFile;
+
+    SPCTokenBucket iDataRxBucket = nullptr;
+
+    SPCTokenBucket iDataTxBucket = nullptr;
+
+    bool iSendFileActive = false;
+
+    /*
+     * upload data the data channel has not taken yet, sent from
+     * OnDataChannelWrite before the next file read; iTxTail holds a
+     * copy when the buffer it came in does not outlive OnFileRead
+     */
+    const uint8_t *iTxPtr = nullptr;
+
+    size_t iTxLeft = 0;
+
+    std::string iTxTail;
+
+    /*
+     * the file has been read to its end, the data channel
+     * is closed once the tail has been sent
+     */
+    bool iTxEnd = false;
+
+    /*
+     * the local end of the current transfer failed, its final
+     * reply is reported as a 451 whatever the server says
+     */
+    bool iLocalIOFailed = false;
+
+    uint64_t iSendFileSize = 0;
+
+    size_t iPipelined = 0;
+
+    std::list<
+      std::tuple<
+       std::string,      // command
+       std::string,      // fRemote
+       std::string,      // fLocal
+       TResponseCbk,     // rcbk
+       TTransferCbk      // ucbk
+    >> iCmdQ;
+
+    /*
+     * Byte range of the current transfer command, armed by a successful 
+     * REST reply. A zero length means "to the end of the file".
+     */
+    struct TransferRange
+    {
+      uint64_t iOffset = 0;
+      uint64_t iLength = 0;
+      uint64_t iReceived = 0;
+      bool     iDone = false;
+      bool     iFailed = false;
+    };
+
+    TransferRange iRange;
+
+    struct ResumeJob
+    {
+      bool           iUpload = false;
+      std::string    iRemote;
+      std::string    iLocal;
+      TTransferCbk   iCbk;
+      TCompletionCbk iDone;
+      DCProt         iProt;
+      int            iRetries = 0;
+      int            iAttempt = 0;
+      bool           iNoRest = false;
+      uint64_t       iOffset = 0;
+      int64_t        iSize = -1;
+    };
+
+    using SPResumeJob = std::shared_ptr<ResumeJob>;
+
+    std::list<SPResumeJob> iResumeJobs;
+
+    bool iResumeSession = false;
+
+    FTPState iFTPState = FTPState::Connecting;
+
+    CFTPReplyParser iReplyParser;
+
+    virtual void StateMachine(SPCMessage msg) override
+    {
+      auto l = msg->GetPayloadLength();
+      auto b = msg->GetPayloadBuffer();
+
+      LOG << std::string(b, l);
+
+      const FTPTransition& t = FTPStateTable
+        [static_cast<size_t>(iFTPState)][FTPReplyClass(l ? b[0] : 0)];
+
+      iFTPState = t.iNextState;
+
+      RunAction(t.iAction, b[0]);
+    }
+
+    virtual void RunAction(FTPAction a, char code)
+    {
+      switch (a)
+      {
+        case FTPAction::None: break;
+        case FTPAction::CheckExplicitFTPS: CheckExplicitFTPS(); break;
+        case FTPAction::CCHandshake: DoCCHandshake(); break;
+        case FTPAction::SendUser: SendCommand("USER", iUserName); break;
+        case FTPAction::SendPass: SendCommand("PASS", iPassword); break;
+        case FTPAction::SendAcct: SendCommand("ACCT"); break;
+        case FTPAction::LoginFailed: ProcessLoginEvent(false); break;
+        case FTPAction::LoginDone: ProcessLoginEvent(true); break;
+        case FTPAction::SkipTransfer: SkipTransfer(); break;
+        case FTPAction::PasvResponse: ProcessPasvResponse(); break;
+        case FTPAction::DataCmdResponse: ProcessDataCmdResponse(code); break;
+        case FTPAction::GenCmdResponse: ProcessGenCmdEvent(); break;
+      }
+    }
+
+    /*
+     * control channel bytes go through the incremental reply parser 
+     * instead of the per byte IsMessageComplete loop of CProtocol
+     */
+    virtual void OnRead(const uint8_t *b, size_t n) override
+    {
+      iReplyParser.Feed(b, n, [this] (SPCFTPMessage m) {
+        if (iAfterFlush.size())
+        {
+          /*
+           * the end of a transfer waits for its file writes, the
+           * replies behind it are taken in order after it
+           */
+          iAfterFlush.push_back([this, m] () { ProcessReply(m); });
+          return;
+        }
+
+        ProcessReply(m);
+      });
+    }
+
+    virtual void ProcessReply(SPCFTPMessage m)
+    {
+      iMessages.push_back(m);
+      StateMachine(m);
+      CSubject<uint8_t, uint8_t>::OnRead(
+        (const uint8_t *) m->GetPayloadBuffer(),
+        m->GetPayloadLength());
+    }
+
+    virtual SPCMessage IsMessageComplete(const std::vector<uint8_t>& b) override
+    {
+      CFTPReplyParser p;
+
+      SPCMessage m = nullptr;
+
+      p.Feed(b.data(), b.size(), [&m] (SPCFTPMessage r) {
+        if (!m) m = r;
+      });
+
+      return m;
     }
 
     virtual void SendCommand(const std::string& c, const std::string& arg = "")
@@ -295,7 +1126,7 @@ namespace NPL
 
     virtual void SetDCProtLevel(DCProt P)
     {
-      TLS tls = GetChannelTLS(iTarget.lock());
+      TLS tls = GetTargetTLS();
 
       if (tls == TLS::Yes || tls == TLS::Implicit)
       {
@@ -317,6 +1148,12 @@ namespace NPL
     {
       for (int i = 0; i < count; i++)
       {
+        if (IsTransferCommand(std::get<0>(iCmdQ.front())))
+        {
+          iRange = {};
+          iLocalIOFailed = false;
+        }
+
         iCmdQ.pop_front();
       }
 
@@ -325,6 +1162,38 @@ namespace NPL
       ProcessNextCmd();
     }
 
+    /*
+     * Drops PASV and the commands up to and including the transfer 
+     * command it was issued for; the transfer callback is told that 
+     * there is no (more) data
+     */
+    virtual void SkipTransfer(void)
+    {
+      int count = 0;
+
+      for (auto& [cmd, fRemote, fLocal, rcbk, tcbk] : iCmdQ)
+      {
+        count++;
+
+        if (IsTransferCommand(cmd))
+        {
+          if (tcbk)
+          {
+            tcbk(nullptr, 0);
+          }
+
+          if (rcbk && iMessages.size())
+          {
+            rcbk(iMessages.back()->GetPayloadString());
+          }
+
+          break;
+        }
+      }
+
+      SkipCommand(count);
+    }
+
     virtual void ProcessNextCmd(void)
     {
       if (iCmdInProgress.test_and_set() == false)
@@ -339,33 +1208,103 @@ namespace NPL
 
         if (IsTransferCommand(cmd))
         {       
-          iProtocolState = "DATA";
+          iFTPState = FTPState::Data;
         }
         else if (cmd == "PASV")
         {
-          iProtocolState = "PASV";
+          iFTPState = FTPState::Pasv;
+        }
+        else
+        {
+          iFTPState = FTPState::Gen;
+        }
+
+        if (iPipelineDepth > 1 && IsPipelinableCommand(cmd))
+        {
+          SendPipelinedCommands();
         }
         else
         {
-          iProtocolState = "GEN";
+          SendCommand(cmd, fRemote);
+        }
+      }
+    }
+
+    virtual void SendPipelinedCommands(void)
+    {
+      std::string batch;
+
+      {
+        std::lock_guard<std::mutex> lg(iLock);
+
+        iPipelined = 0;
+
+        for (auto& [cmd, fRemote, fLocal, rcbk, tcbk] : iCmdQ)
+        {
+          if (iPipelined == iPipelineDepth || !IsPipelinableCommand(cmd))
+          {
+            break;
+          }
+
+          batch += cmd + " " + fRemote + "\r\n";
+
+          iPipelined++;
+        }
+
+        iPipelineBatch = iPipelined;
+      }
+
+      LOG << batch;
+
+      Write((uint8_t *)batch.c_str(), batch.size(), 0);
+
+      ArmPipelineTimer();
+    }
+
+    /*
+     * restarted by every reply to a batch, it only fires when the
+     * server went quiet with commands of the batch unanswered
+     */
+    virtual void ArmPipelineTimer(void)
+    {
+      uint64_t gen = ++iPipelineGen;
+
+      ScheduleTimer(iPipelineTimeoutMs, [w = weak_from_this(), gen] () {
+        auto sp = std::static_pointer_cast<CProtocolFTP>(w.lock());
+        if (sp && sp->iPipelineGen == gen && sp->iPipelined)
+        {
+          sp->OnPipelineTimeout();
         }
+      });
+    }
+
+    /*
+     * the unanswered commands stay on the wire and their replies are
+     * still matched in order; only the batches after this one are cut
+     * down to one command
+     */
+    virtual void OnPipelineTimeout(void)
+    {
+      if (iPipelineDepth > 1)
+      {
+        LOG << "FTP pipelined replies are late, pipelining disabled for this session";
 
-        SendCommand(cmd, fRemote);
+        iPipelineDepth = 1;
       }
     }
 
     virtual void CheckExplicitFTPS(void)
     {
-      TLS tls = GetChannelTLS(iTarget.lock());
+      TLS tls = GetTargetTLS();
 
       if (tls == TLS::Yes)
       {
-        iProtocolState = "AUTH";
+        iFTPState = FTPState::Auth;
         SendCommand("AUTH", "TLS");
       }
       else
       {
-        iProtocolState = "USER";
+        iFTPState = FTPState::User;
         SendCommand("USER", iUserName);
       }
     }
@@ -374,13 +1313,60 @@ namespace NPL
     {
       auto& [cmd, fRemote, fLocal, rcbk, tcbk] = iCmdQ.front();
 
-      if (rcbk)
+      auto& r = iMessages.back()->GetPayloadString();
+
+      bool batch = iPipelined && iPipelineBatch > 1;
+
+      bool rejected = batch &&
+        (!r.compare(0, 3, "500") || !r.compare(0, 3, "502") || !r.compare(0, 3, "503"));
+
+      if (batch && (IsPositivePreliminaryReply(r[0]) || rejected) && iPipelineDepth > 1)
       {
-        auto& m = iMessages.back();
-        rcbk(m->GetPayloadString());
+        LOG << "FTP pipelining disabled for this session";
+
+        iPipelineDepth = 1;
       }
 
-      SkipCommand(1);
+      if (batch && IsPositivePreliminaryReply(r[0]))
+      {
+        iFTPState = FTPState::Gen;
+        ArmPipelineTimer();
+        return;
+      }
+
+      if (rejected)
+      {
+        /*
+         * possibly refused for arriving queued; sent again on its
+         * own, behind the commands of the batch still on the wire
+         */
+        auto c = std::move(iCmdQ.front());
+        iCmdQ.pop_front();
+        iCmdQ.insert(std::next(iCmdQ.begin(), iPipelined - 1), std::move(c));
+      }
+      else
+      {
+        if (rcbk)
+        {
+          rcbk(r);
+        }
+
+        iCmdQ.pop_front();
+      }
+
+      if (iPipelined && --iPipelined)
+      {
+        /*
+         * more replies outstanding for commands already on the wire
+         */
+        iFTPState = FTPState::Gen;
+        ArmPipelineTimer();
+        return;
+      }
+
+      iPipelineGen++;
+
+      SkipCommand(0);
     }
 
     virtual void ProcessPasvResponse(void)
@@ -440,6 +1426,8 @@ namespace NPL
 
       auto dc = std::dynamic_pointer_cast<CDeviceSocket>(iDataChannel);
 
+      dc->SetRateLimit(iDataRxBucket, iDataTxBucket);
+
       dc->SetHostAndPort(host, port);
 
       dc->StartSocketClient();
@@ -468,6 +1456,13 @@ namespace NPL
       {
         if (!iDataChannel)
         {
+          auto& [cmd, fRemote, fLocal, rcbk, tcbk] = iCmdQ.front();
+
+          if (rcbk)
+          {
+            rcbk(GetTransferReply());
+          }
+
           SkipCommand();
         }
       }
@@ -480,16 +1475,42 @@ namespace NPL
 
         if (iFileDevice)
         {
+          if (!FlushFileDevice([this, code] () { ProcessDataCmdResponse(code); }))
+          {
+            return;
+          }
+
           ResetSubject(iFileDevice);
         }
 
-        if (iProtocolState == "xyz")
+        auto& [cmd, fRemote, fLocal, rcbk, tcbk] = iCmdQ.front();
+
+        /*
+         * the data channel may close before the final reply is in,
+         * rcbk gets that reply and nothing else
+         */
+        if (iFTPState == FTPState::Final)
         {
+          if (rcbk && iMessages.size())
+          {
+            rcbk(GetTransferReply());
+          }
+
           SkipCommand();
         }
       }
     }
 
+    virtual std::string GetTransferReply(void)
+    {
+      if (iLocalIOFailed)
+      {
+        return "451 Local file I/O failed";
+      }
+
+      return iMessages.back()->GetPayloadString();
+    }
+
     virtual void InitializeFileDevice(void)
     {
       auto& [cmd, fRemote, fLocal, rcbk, tcbk] = iCmdQ.front();      
@@ -500,16 +1521,46 @@ namespace NPL
 
         if (cmd == "LIST") assert(!fLocal.size());
 
-        iFileDevice = std::make_shared<CDevice>(
-          fLocal.c_str(),
-          cmd == "RETR" ? true : false);
+        bool ranged = iRange.iOffset || iRange.iLength;
+
+        if (cmd == "STOR" && iMappedUploads && !ZeroCopyEnabled())
+        {
+          iFileDevice = std::make_shared<CDeviceMapped>(fLocal);
+        }
+        else
+        {
+          iFileDevice = std::make_shared<CDevice>(
+            fLocal.c_str(),
+            (cmd == "RETR" && !ranged) ? true : false,
+            cmd == "STOR");
+        }
 
         iFileDevice->SetProperty("name", "fl");
 
-        iCurrentFileOffset = 0;
+        iCurrentFileOffset = iRange.iOffset;
 
-        auto observer = std::make_shared<CListener>(
-          nullptr,
+        if (cmd == "RETR" && iDirectIO)
+        {
+          auto device = std::dynamic_pointer_cast<CDevice>(iFileDevice);
+
+          device->SetDirectIO(true);
+
+          if (iExpectedSize > iCurrentFileOffset)
+          {
+            device->Preallocate(iExpectedSize);
+          }
+
+          iExpectedSize = 0;
+        }
+
+        if (cmd == "RETR" && iWriteBehindBlock)
+        {
+          iWriteBehind = std::make_unique<CWriteBehind>(
+            std::dynamic_pointer_cast<CDevice>(iFileDevice), iWriteBehindBlock);
+        }
+
+        auto observer = std::make_shared<CListener>(
+          nullptr,
           [this] (const uint8_t *b, size_t n) {
             OnFileRead(b, n);
           },
@@ -521,60 +1572,794 @@ namespace NPL
           }
         );
 
-        observer->SetProperty("name", "fl-ob");
+        observer->SetProperty("name", "fl-ob");
+
+        auto D = GetDispatcher();
+
+        D->AddEventListener(iFileDevice)->AddEventListener(observer);
+      }
+
+      iContinueTransfer = true;
+    }
+
+    virtual void OnDataChannelConnect(void)
+    {
+      auto& [cmd, fRemote, fLocal, rcbk, tcbk] = iCmdQ.front();
+    }
+
+    virtual void OnDataChannelRead(const uint8_t *b, size_t n)
+    {
+      auto& [cmd, fRemote, fLocal, rcbk, tcbk] = iCmdQ.front();
+
+      if (iRange.iDone)
+      {
+        return;
+      }
+
+      if (iRange.iFailed)
+      {
+        /*
+         * REST was refused, the server is sending from offset 0
+         */
+        AbortRangedTransfer();
+        return;
+      }
+
+      if (iModeZ && b)
+      {
+        iZBuffer.clear();
+
+        if (!iInflater->Process(b, n, iZBuffer))
+        {
+          LOG << "FTP download aborted, corrupt MODE Z stream";
+          iLocalIOFailed = true;
+          std::dynamic_pointer_cast<CDeviceSocket>(iDataChannel)->StopSocket();
+          return;
+        }
+
+        if (iZBuffer.empty())
+        {
+          return;
+        }
+
+        b = (const uint8_t *) iZBuffer.data();
+        n = iZBuffer.size();
+      }
+
+      if (iRange.iLength)
+      {
+        n = static_cast<size_t>(std::min<uint64_t>(n, iRange.iLength - iRange.iReceived));
+        iRange.iReceived += n;
+      }
+
+      if (iChecksum && b && n && cmd == "RETR")
+      {
+        iChecksum->Update(b, n);
+      }
+
+      if (tcbk && n)
+      {
+        if (iContinueTransfer)
+        {
+          iContinueTransfer = tcbk((const char *)b, n);
+        }
+        else
+        {
+          std::dynamic_pointer_cast<CDeviceSocket>(iDataChannel)->StopSocket();
+          return;
+        }
+      }
+
+      if (!b)
+      {
+        /*
+         * spliced, already in the file
+         */
+        iCurrentFileOffset += n;
+      }
+      else if (iWriteBehind)
+      {
+        iWriteBehind->Write(b, n, iCurrentFileOffset);
+        iCurrentFileOffset += n;
+
+        if (iWriteBehind->IsBlocked())
+        {
+          /*
+           * both blocks are on their way to the disk, OnFileWrite()
+           * lets the data in again
+           */
+          std::dynamic_pointer_cast<CDeviceSocket>(iDataChannel)->HoldRead(true);
+        }
+      }
+      else if (iFileDevice)
+      {
+        /*
+         * on the I/O engine too, FlushFileDevice() holds the end of
+         * data back until these writes complete
+         */
+        iFileDevice->Write(b, n, iCurrentFileOffset);
+        iCurrentFileOffset += n;
+      }
+
+      if (iRange.iLength && iRange.iReceived == iRange.iLength)
+      {
+        AbortRangedTransfer();
+      }
+    }
+
+    /*
+     * Ends a ranged RETR early. The data socket is closed with a zero 
+     * linger so the server sees a reset, stops sending and answers the 
+     * RETR with a 4yz/5yz reply which then completes the command.
+     */
+    virtual void AbortRangedTransfer(void)
+    {
+      auto& [cmd, fRemote, fLocal, rcbk, tcbk] = iCmdQ.front();
+
+      iRange.iDone = true;
+
+      if (!FlushFileDevice([this] () { AbortRangedTransfer(); }))
+      {
+        return;
+      }
+
+      FinishChecksum(cmd, fRemote);
+
+      if (tcbk)
+      {
+        tcbk(nullptr, 0);
+      }
+
+      if (iDataChannel)
+      {
+        std::dynamic_pointer_cast<CDeviceSocket>(iDataChannel)->SetAbortiveClose();
+        ResetSubject(iDataChannel);
+      }
+
+      if (iFileDevice)
+      {
+        ResetSubject(iFileDevice);
+      }
+
+      if (iFTPState == FTPState::Final)
+      {
+        SkipCommand();
+      }
+    }
+
+    virtual void StartSegments(TCompletionCbk cbk, const std::string& fRemote, const std::string& fLocal, uint64_t size, int segments, DCProt P)
+    {
+      std::error_code ec;
+
+      {
+        std::ofstream f(fLocal, std::ios::binary | std::ios::trunc);
+      }
+
+      std::filesystem::resize_file(fLocal, size, ec);
+
+      if (ec || !size)
+      {
+        if (cbk) cbk(!ec && !size);
+        return;
+      }
+
+      if ((uint64_t) segments > size)
+      {
+        segments = static_cast<int>(size);
+      }
+
+      struct SegmentState
+      {
+        std::atomic<int> iPending;
+        std::atomic<bool> iFailed;
+      };
+
+      /*
+       * one per range, touched by its own session only; a range ends
+       * once, either at the end of its data or on a refused RETR
+       */
+      struct Segment
+      {
+        uint64_t iReceived = 0;
+        bool     iEnded = false;
+      };
+
+      auto state = std::make_shared<SegmentState>();
+
+      state->iPending = segments;
+      state->iFailed = false;
+
+      auto end = [state, cbk] (bool ok) {
+        if (!ok)
+        {
+          state->iFailed = true;
+        }
+
+        if (--state->iPending == 0 && cbk)
+        {
+          cbk(!state->iFailed);
+        }
+      };
+
+      uint64_t chunk = size / segments;
+
+      for (int i = 0; i < segments; i++)
+      {
+        uint64_t offset = i * chunk;
+        uint64_t length = (i == segments - 1) ? (size - offset) : chunk;
+
+        auto session = (i == 0) ? 
+          std::dynamic_pointer_cast<CProtocolFTP>(shared_from_this()) : 
+          CloneSession();
+
+        if (!session)
+        {
+          LOG << "FTP segment " + std::to_string(i) + " : no session";
+          end(false);
+          continue;
+        }
+
+        auto segment = std::make_shared<Segment>();
+
+        session->DownloadRange(
+          [=] (const char *b, size_t n) {
+            if (b || n)
+            {
+              segment->iReceived += n;
+              return true;
+            }
+
+            if (!segment->iEnded)
+            {
+              segment->iEnded = true;
+
+              if (segment->iReceived != length)
+              {
+                LOG << "FTP segment " + std::to_string(i) + " : " + 
+                  std::to_string(segment->iReceived) + " of " + std::to_string(length) + " bytes";
+              }
+
+              end(segment->iReceived == length);
+            }
+
+            return true;
+          },
+          fRemote, fLocal, offset, length, P,
+          [=] (const std::string& r) {
+            /*
+             * a ranged RETR that got its bytes is answered 4yz/5yz as
+             * well, only a refusal before the data ended counts here
+             */
+            if ((r[0] == '4' || r[0] == '5') && !segment->iEnded)
+            {
+              segment->iEnded = true;
+
+              LOG << "FTP segment " + std::to_string(i) + " : " + r;
+
+              end(false);
+            }
+          });
+
+        if (i)
+        {
+          session->Quit();
+        }
+      }
+    }
+
+    /*
+     * "213 <size>", -1 for a refusal or anything that is not a size;
+     * replies come from the server, so this must not throw
+     */
+    static int64_t ParseSizeReply(const std::string& res)
+    {
+      if (res.size() <= 4 || res[0] != '2')
+      {
+        return -1;
+      }
+
+      const char *b = res.data() + 4;
+      const char *e = res.data() + res.size();
+
+      while (b < e && *b == ' ') b++;
+
+      int64_t size = -1;
+
+      auto [p, ec] = std::from_chars(b, e, size);
+
+      if (ec != std::errc() || p == b || size < 0 || (p < e && !isspace((unsigned char) *p)))
+      {
+        return -1;
+      }
+
+      return size;
+    }
+
+    /*
+     * One attempt of a resumable transfer: TYPE I and SIZE, then once 
+     * the offset is known PASV, REST and the transfer command. Callbacks 
+     * of an attempt that has been superseded (after a reconnect) are 
+     * ignored through iAttempt.
+     */
+    virtual void QueueResumeAttempt(SPResumeJob job)
+    {
+      int attempt = ++job->iAttempt;
+
+      {
+        std::lock_guard<std::mutex> lg(iLock);
+
+        if (std::find(iResumeJobs.begin(), iResumeJobs.end(), job) == iResumeJobs.end())
+        {
+          iResumeJobs.push_back(job);
+        }
+
+        iCmdQ.emplace_back("TYPE", "I", "", nullptr, nullptr);
+
+        iCmdQ.emplace_back("SIZE", job->iRemote, "",
+          [this, job, attempt](const std::string& res) {
+            if (attempt != job->iAttempt) return;
+
+            int64_t size = ParseSizeReply(res);
+
+            if (job->iUpload)
+            {
+              std::error_code ec;
+              job->iOffset = (size > 0 && !job->iNoRest) ? size : 0;
+              job->iSize = std::filesystem::file_size(job->iLocal, ec);
+            }
+            else
+            {
+              job->iSize = size;
+              if (job->iNoRest) job->iOffset = 0;
+            }
+
+            /*
+             * a target longer than the source is not a partial copy
+             * of it, REST would point past the end of the source; it
+             * is transferred again from the start (and truncated)
+             */
+            if (job->iSize >= 0 && (int64_t) job->iOffset > job->iSize)
+            {
+              job->iOffset = 0;
+            }
+            else if (job->iSize >= 0 && (int64_t) job->iOffset == job->iSize && !job->iUpload)
+            {
+              OnResumeAttemptDone(job, true);
+              return;
+            }
+
+            QueueResumeTransfer(job, attempt);
+          }, nullptr);
+      }
+
+      ProcessNextCmd();
+    }
+
+    virtual void QueueResumeTransfer(SPResumeJob job, int attempt)
+    {
+      std::lock_guard<std::mutex> lg(iLock);
+
+      SetDCProtLevel(job->iProt);
+
+      iCmdQ.emplace_back("PASV", "", "", nullptr, nullptr);
+
+      if (job->iOffset)
+      {
+        uint64_t offset = job->iOffset;
+
+        iCmdQ.emplace_back("REST", std::to_string(offset), "",
+          [this, job, offset](const std::string& res) {
+            iRange = { offset, 0, 0, false, !(res[0] == '3') };
+            if (iRange.iFailed) job->iNoRest = true;
+          }, nullptr);
+      }
+
+      iCmdQ.emplace_back(
+        job->iUpload ? "STOR" : "RETR", 
+        job->iRemote, 
+        job->iLocal, 
+        [this, job, attempt](const std::string& res) {
+          /*
+           * refused (or dropped, 421) without an end of data
+           */
+          if (attempt == job->iAttempt && (res[0] == '4' || res[0] == '5'))
+          {
+            OnResumeAttemptDone(job, false);
+          }
+        },
+        [this, job, attempt](const char *b, size_t n) {
+          if (attempt != job->iAttempt) return false;
+
+          if (b || n)
+          {
+            job->iOffset += n;
+            return job->iCbk ? job->iCbk(b, n) : true;
+          }
+
+          if (job->iUpload)
+          {
+            std::lock_guard<std::mutex> lg(iLock);
+
+            iCmdQ.emplace_back("SIZE", job->iRemote, "",
+              [this, job, attempt](const std::string& res) {
+                if (attempt != job->iAttempt) return;
+                int64_t size = ParseSizeReply(res);
+                OnResumeAttemptDone(job, size >= 0 && size == job->iSize);
+              }, nullptr);
+          }
+          else
+          {
+            /*
+             * without a SIZE reply completion can not be verified
+             */
+            OnResumeAttemptDone(job, job->iSize < 0 || (int64_t) job->iOffset == job->iSize);
+          }
+
+          return true;
+        });
+    }
+
+    virtual void OnResumeAttemptDone(SPResumeJob job, bool complete)
+    {
+      if (!complete && job->iRetries > 0)
+      {
+        if (iFTPState == FTPState::Disconnected)
+        {
+          return; // resumed from OnDisconnect
+        }
+
+        job->iRetries--;
+
+        QueueResumeAttempt(job);
+
+        return;
+      }
+
+      {
+        std::lock_guard<std::mutex> lg(iLock);
+        iResumeJobs.remove(job);
+      }
+
+      FinishResumeJob(job, complete);
+
+      if (iResumeSession && iResumeJobs.empty())
+      {
+        Quit();
+      }
+    }
+
+    /*
+     * end of a resumable transfer : cbk gets the end of data, done
+     * the outcome; later callbacks of its attempts are ignored
+     */
+    virtual void FinishResumeJob(SPResumeJob job, bool complete)
+    {
+      job->iAttempt++;
+
+      if (job->iCbk)
+      {
+        job->iCbk(nullptr, 0);
+      }
+
+      if (job->iDone)
+      {
+        job->iDone(complete);
+      }
+    }
+
+    /*
+     * The control connection is gone; unfinished resumable 
+     * transfers continue on a fresh session
+     */
+    virtual void ResumeOnNewSession(void)
+    {
+      std::list<SPResumeJob> jobs;
+
+      {
+        std::lock_guard<std::mutex> lg(iLock);
+        jobs.swap(iResumeJobs);
+      }
+
+      std::shared_ptr<CProtocolFTP> session;
+
+      bool cloned = false;
+
+      for (auto& job : jobs)
+      {
+        if (job->iRetries > 0 && !cloned)
+        {
+          cloned = true;
+
+          session = CloneSession();
+
+          if (session) session->iResumeSession = true;
+        }
+
+        if (job->iRetries <= 0 || !session)
+        {
+          FinishResumeJob(job, false);
+          continue;
+        }
+
+        job->iRetries--;
+
+        if (!job->iUpload)
+        {
+          std::error_code ec;
+          job->iOffset = std::filesystem::file_size(job->iLocal, ec);
+        }
+
+        session->QueueResumeAttempt(job);
+      }
+    }
+
+    virtual void OnDataChannelWrite(const uint8_t *b, size_t n)
+    {
+      auto& [cmd, fRemote, fLocal, rcbk, tcbk] = iCmdQ.front();
+
+      if (iSendFileActive)
+      {
+        SendFileChunks();
+      }
+      else if (iTxLeft)
+      {
+        SendUploadTail();
+      }
+    }
+
+    /*
+     * one deflate and one inflate context per session, 
+     * reset for every transfer
+     */
+    virtual void ResetZStreams(void)
+    {
+      if (!iDeflater)
+      {
+        iDeflater = std::make_unique<CZStream>(ZMode::Deflate, iZLevel);
+      }
+
+      if (!iInflater)
+      {
+        iInflater = std::make_unique<CZStream>(ZMode::Inflate);
+      }
+
+      iDeflater->Reset();
+
+      iInflater->Reset();
+    }
+
+    virtual bool UseZeroCopy(void)
+    {
+      return iFileDevice && ZeroCopyEnabled();
+    }
+
+    virtual bool ZeroCopyEnabled(void)
+    {
+      #ifdef linux
+      return iZeroCopy && !iModeZ && !iChecksum && (iDCProt == DCProt::Clear);
+      #else
+      return false;
+      #endif
+    }
+
+    /*
+     * sendfile() until the socket would block; the dispatcher resumes 
+     * through OnDataChannelWrite once the data channel is writable
+     */
+    virtual void SendFileChunks(void)
+    {
+      #ifdef linux
+
+      constexpr size_t SendFileChunk = 1024 * 1024;
+
+      auto& [cmd, fRemote, fLocal, rcbk, tcbk] = iCmdQ.front();
+
+      auto dc = std::dynamic_pointer_cast<CDeviceSocket>(iDataChannel);
+
+      auto file = std::dynamic_pointer_cast<CDevice>(iFileDevice);
+
+      while (dc && file && iCurrentFileOffset < iSendFileSize)
+      {
+        size_t count = static_cast<size_t>(
+          std::min<uint64_t>(SendFileChunk, iSendFileSize - iCurrentFileOffset));
+
+        int64_t rc = dc->SendFile(file->iFD, iCurrentFileOffset, count);
+
+        if (rc == 0)
+        {
+          return;
+        }
+
+        if (rc < 0)
+        {
+          break;
+        }
+
+        if (tcbk)
+        {
+          if (iContinueTransfer)
+          {
+            iContinueTransfer = tcbk(nullptr, static_cast<size_t>(rc));
+          }
+
+          if (!iContinueTransfer)
+          {
+            break;
+          }
+        }
+      }
+
+      iSendFileActive = false;
+
+      if (dc)
+      {
+        dc->StopSocket();
+      }
+
+      #endif
+    }
+
+    virtual void OnDataChannelDisconnect(void)
+    {
+      auto& [cmd, fRemote, fLocal, rcbk, tcbk] = iCmdQ.front();
 
-        auto D = GetDispatcher();
+      iSendFileActive = false;
 
-        D->AddEventListener(iFileDevice)->AddEventListener(observer);
+      if (iRange.iDone)
+      {
+        return;
       }
 
-      iContinueTransfer = true;
+      auto dc = std::dynamic_pointer_cast<CDevice>(iDataChannel);
+
+      if (dc && dc->GetIOError())
+      {
+        LOG << std::string("FTP download aborted, local write failed : ") + strerror(dc->GetIOError());
+        iLocalIOFailed = true;
+      }
+
+      if (!FlushFileDevice([this] () { OnDataChannelDisconnect(); }))
+      {
+        return;
+      }
+
+      FinishChecksum(cmd, fRemote);
+
+      if (tcbk)
+      {
+        tcbk(nullptr, 0);
+
+        tcbk = nullptr;
+      }
+
+      ProcessDataCmdResponse('0');
     }
 
-    virtual void OnDataChannelConnect(void)
+    virtual void FinishChecksum(const std::string& cmd, const std::string& fRemote)
     {
-      auto& [cmd, fRemote, fLocal, rcbk, tcbk] = iCmdQ.front();
+      if (!iChecksum || (cmd != "RETR" && cmd != "STOR"))
+      {
+        return;
+      }
+
+      iLastDigest = iChecksum->GetDigest();
+
+      iLastDigestFile = fRemote;
+
+      if (iChecksumCbk)
+      {
+        iChecksumCbk(fRemote, iLastDigest);
+      }
     }
 
-    virtual void OnDataChannelRead(const uint8_t *b, size_t n)
+    /*
+     * "213 CRC32 0-1234 1a2b3c4d name" for HASH, "250 1A2B3C4D" 
+     * (or 0x1A2B3C4D) for XCRC
+     */
+    virtual void CompareChecksum(const std::string& fRemote, const std::string& r, bool hash, TVerifyCbk cbk)
     {
-      auto& [cmd, fRemote, fLocal, rcbk, tcbk] = iCmdQ.front();
+      std::string remote;
 
-      if (tcbk)
+      if (r.size() > 4 && r[0] == '2')
       {
-        if (iContinueTransfer)
+        std::istringstream is(r.substr(4));
+
+        std::vector<std::string> t;
+
+        for (std::string w; is >> w; )
         {
-          iContinueTransfer = tcbk((const char *)b, n);
+          t.push_back(w);
         }
-        else
+
+        if (hash && t.size() >= 3 && (t[0] == "CRC32" || t[0] == "crc32"))
         {
-          std::dynamic_pointer_cast<CDeviceSocket>(iDataChannel)->StopSocket();
-          return;
+          remote = t[2];
+        }
+        else if (!hash && t.size())
+        {
+          remote = t.back();
+        }
+
+        if (!remote.compare(0, 2, "0x") || !remote.compare(0, 2, "0X"))
+        {
+          remote.erase(0, 2);
+        }
+
+        std::transform(remote.begin(), remote.end(), remote.begin(), 
+          [] (unsigned char c) { return static_cast<char>(std::tolower(c)); });
+
+        if (remote.size() && remote.size() < 8)
+        {
+          remote.insert(0, 8 - remote.size(), '0');
         }
       }
 
-      if (iFileDevice)
+      bool match = (iChecksumType == ChecksumType::CRC32) &&
+                   (iLastDigestFile == fRemote) &&
+                   remote.size() && (remote == iLastDigest);
+
+      if (cbk)
       {
-        iFileDevice->Write(b, n, iCurrentFileOffset);
-        iCurrentFileOffset += n;
+        cbk(match, iLastDigest, remote);
       }
     }
 
-    virtual void OnDataChannelWrite(const uint8_t *b, size_t n)
+    /*
+     * data held by the write-behind stage or staged for direct I/O 
+     * is in the file before the end of the transfer is reported.
+     * Does not wait: false while blocks or writes are still out,
+     * retry is then queued and runs from OnFileWrite(), whichever
+     * completion comes last
+     */
+    virtual bool FlushFileDevice(std::function<void()> retry)
     {
-      auto& [cmd, fRemote, fLocal, rcbk, tcbk] = iCmdQ.front();
+      auto device = std::dynamic_pointer_cast<CDevice>(iFileDevice);
+
+      if (iWriteBehind)
+      {
+        iWriteBehind->Flush();
+      }
+
+      if ((iWriteBehind && !iWriteBehind->IsIdle()) ||
+          (device && (device->GetWritesInFlight() || (iDirectIO && device->FlushAsync()))))
+      {
+        iAfterFlush.push_back(retry);
+        return false;
+      }
+
+      bool ok = !(iWriteBehind && iWriteBehind->Failed()) && !(device && device->GetIOError());
+
+      iWriteBehind.reset();
+
+      if (!ok)
+      {
+        LOG << "FTP local file I/O failed";
+        iLocalIOFailed = true;
+      }
+
+      return true;
     }
 
-    virtual void OnDataChannelDisconnect(void)
+    /*
+     * a step may find writes still out and queue itself again,
+     * the ones after it wait behind it
+     */
+    virtual void RunAfterFlush(void)
     {
-      auto& [cmd, fRemote, fLocal, rcbk, tcbk] = iCmdQ.front();
+      auto steps = std::move(iAfterFlush);
 
-      if (tcbk)
+      iAfterFlush.clear();
+
+      for (size_t i = 0; i < steps.size(); i++)
       {
-        tcbk(nullptr, 0);
-      }
+        if (iAfterFlush.size())
+        {
+          iAfterFlush.insert(iAfterFlush.end(), steps.begin() + i, steps.end());
+          break;
+        }
 
-      ProcessDataCmdResponse('0');
+        steps[i]();
+      }
     }
 
     virtual void OnFileRead(const uint8_t *b, size_t n)
@@ -594,23 +2379,216 @@ namespace NPL
         }
       }
 
-      iDataChannel->Write(b, n);
+      if (iChecksum)
+      {
+        iChecksum->Update(b, n);
+      }
+
+      if (iModeZ)
+      {
+        iZBuffer.clear();
+
+        if (!iDeflater->Process(b, n, iZBuffer))
+        {
+          AbortUpload("FTP upload aborted, MODE Z compression failed");
+          return;
+        }
+
+        /*
+         * iZBuffer is kept until the next file read
+         */
+        if (!SendUploadData((const uint8_t *) iZBuffer.data(), iZBuffer.size(), false))
+        {
+          return;
+        }
+      }
+      else
+      {
+        /*
+         * a mapped slice stays valid until the next file read,
+         * a read buffer is freed once this returns
+         */
+        bool mapped = !!std::dynamic_pointer_cast<CDeviceMapped>(iFileDevice);
+
+        if (!SendUploadData(b, n, !mapped))
+        {
+          return;
+        }
+      }
 
       iCurrentFileOffset += n;
 
+      if (iTxLeft)
+      {
+        return;
+      }
+
+      ReadNextFileChunkPaced();
+    }
+
+    /*
+     * sends what the data channel takes without blocking, the rest
+     * is left in iTxPtr/iTxLeft for OnDataChannelWrite; false if the
+     * upload was aborted
+     */
+    virtual bool SendUploadData(const uint8_t *b, size_t n, bool bCopy)
+    {
+      auto dc = std::dynamic_pointer_cast<CDeviceSocket>(iDataChannel);
+
+      while (n)
+      {
+        int32_t rc = dc->TryWrite(b, n);
+
+        if (rc < 0)
+        {
+          AbortUpload("FTP upload aborted, data channel write failed");
+          return false;
+        }
+
+        if (rc == 0)
+        {
+          break;
+        }
+
+        b += rc;
+        n -= rc;
+      }
+
+      if (n && bCopy)
+      {
+        iTxTail.assign((const char *) b, n);
+        b = (const uint8_t *) iTxTail.data();
+      }
+
+      iTxPtr = n ? b : nullptr;
+      iTxLeft = n;
+
+      return true;
+    }
+
+    /*
+     * the data channel is writable again
+     */
+    virtual void SendUploadTail(void)
+    {
+      if (!SendUploadData(iTxPtr, iTxLeft, false) || iTxLeft)
+      {
+        return;
+      }
+
+      if (iTxEnd)
+      {
+        std::dynamic_pointer_cast<CDeviceSocket>(iDataChannel)->StopSocket();
+        return;
+      }
+
+      ReadNextFileChunkPaced();
+    }
+
+    virtual void ReadNextFileChunkPaced(void)
+    {
+      uint32_t ms = std::dynamic_pointer_cast<CDeviceSocket>(iDataChannel)->GetTxDelayMs();
+
+      if (ms)
+      {
+        /*
+         * over the tx rate, the next file read is deferred
+         */
+        ScheduleTimer(ms, [w = weak_from_this()] () {
+          auto sp = std::static_pointer_cast<CProtocolFTP>(w.lock());
+          if (sp)
+          {
+            sp->ReadNextFileChunk();
+          }
+        });
+
+        return;
+      }
+
+      ReadNextFileChunk();
+    }
+
+    virtual void ReadNextFileChunk(void)
+    {
+      if (!iFileDevice || !iDataChannel)
+      {
+        return;
+      }
+
       auto ctx = iFileDevice->Read(nullptr, 0, iCurrentFileOffset);
 
       #ifdef linux
-      QueuePendingContext(iFileDevice, ctx);
+      if (ctx)
+      {
+        QueuePendingContext(iFileDevice, ctx);
+      }
       #endif
     }
 
     virtual void OnFileWrite(const uint8_t *b, size_t n)
     {
+      if (iWriteBehind)
+      {
+        iWriteBehind->OnWritten(n);
+
+        if (iDataChannel && !iWriteBehind->IsBlocked())
+        {
+          std::dynamic_pointer_cast<CDeviceSocket>(iDataChannel)->HoldRead(false);
+        }
+      }
+
+      RunAfterFlush();
     }
 
     virtual void OnFileDisconnect(void)
     {
+      auto device = std::dynamic_pointer_cast<CDevice>(iFileDevice);
+
+      if (device && device->GetIOError() && iDataChannel)
+      {
+        AbortUpload(std::string("FTP upload aborted, local read failed : ") + strerror(device->GetIOError()));
+        return;
+      }
+
+      if (iModeZ && iDataChannel)
+      {
+        iZBuffer.clear();
+
+        if (!iDeflater->Process(nullptr, 0, iZBuffer, true))
+        {
+          AbortUpload("FTP upload aborted, MODE Z compression failed");
+          return;
+        }
+
+        if (!SendUploadData((const uint8_t *) iZBuffer.data(), iZBuffer.size(), false))
+        {
+          return;
+        }
+
+        if (iTxLeft)
+        {
+          iTxEnd = true;
+          return;
+        }
+      }
+
+      std::dynamic_pointer_cast<CDeviceSocket>(iDataChannel)->StopSocket();
+    }
+
+    /*
+     * the file could not be sent to the end, a reset instead of a
+     * FIN keeps the server from storing a truncated file as complete
+     */
+    virtual void AbortUpload(const std::string& why)
+    {
+      LOG << why;
+
+      iLocalIOFailed = true;
+
+      iTxPtr = nullptr;
+      iTxLeft = 0;
+
+      std::dynamic_pointer_cast<CDeviceSocket>(iDataChannel)->SetAbortiveClose();
       std::dynamic_pointer_cast<CDeviceSocket>(iDataChannel)->StopSocket();
     }
 
@@ -618,12 +2596,60 @@ namespace NPL
     {
       auto& [cmd, fRemote, fLocal, rcbk, tcbk] = iCmdQ.front();
 
-      if (cmd == "STOR")
+      if (iModeZ)
+      {
+        ResetZStreams();
+      }
+
+      if (iChecksum)
+      {
+        iChecksum->Reset();
+      }
+
+      iTxPtr = nullptr;
+      iTxLeft = 0;
+      iTxEnd = false;
+
+      if (cmd == "STOR" && iRange.iFailed)
+      {
+        /*
+         * REST was refused, an upload from the middle of 
+         * the local file would overwrite the remote file
+         */
+        std::dynamic_pointer_cast<CDeviceSocket>(iDataChannel)->StopSocket();
+      }
+      else if (cmd == "STOR" && UseZeroCopy())
+      {
+        #ifdef linux
+        struct stat st;
+
+        fstat(std::dynamic_pointer_cast<CDevice>(iFileDevice)->iFD, &st);
+
+        iSendFileSize = st.st_size;
+
+        iSendFileActive = true;
+
+        SendFileChunks();
+        #endif
+      }
+      else if (cmd == "STOR")
       {
         auto ctx = iFileDevice->Read(nullptr, 0, iCurrentFileOffset);
         #ifdef linux
-        QueuePendingContext(iFileDevice, ctx);
-        #endif        
+        if (ctx)
+        {
+          QueuePendingContext(iFileDevice, ctx);
+        }
+        #endif
+      }
+      else if (cmd == "RETR" && UseZeroCopy())
+      {
+        #ifdef linux
+        std::dynamic_pointer_cast<CDeviceSocket>(iDataChannel)->SetSpliceTarget(
+          std::dynamic_pointer_cast<CDevice>(iFileDevice)->iFD,
+          iCurrentFileOffset,
+          iRange.iLength ? (iRange.iLength - iRange.iReceived) : 0);
+        #endif
       }
     }
 
@@ -641,13 +2667,72 @@ namespace NPL
       }      
     }
 
+    /*
+     * PASV + MLSD|LIST feeding parser. A 500/502/504 to MLSD queues 
+     * the LIST fallback right behind it; the caller holds iLock. The
+     * listing is finished by the final reply, so a refused or broken
+     * listing (4xx/5xx, 421) ends with ok false.
+     */
+    virtual void QueueListing(SPCFTPListParser parser, const std::string& fRemote, bool mlsd, bool front = false)
+    {
+      auto done = std::make_shared<bool>(false);
+
+      TResponseCbk rcbk = [this, parser, fRemote, mlsd, done] (const std::string& r) {
+        if (*done || r.empty() || r[0] == '1' || r[0] == '3')
+        {
+          return;
+        }
+
+        *done = true;
+
+        if (mlsd && 
+            (!r.compare(0, 3, "500") || !r.compare(0, 3, "502") || !r.compare(0, 3, "504")))
+        {
+          parser->SetMLSD(false);
+          std::lock_guard<std::mutex> lg(iLock);
+          QueueListing(parser, fRemote, false, true);
+          return;
+        }
+
+        parser->Finish(r[0] == '2');
+      };
+
+      TTransferCbk tcbk = [parser, done] (const char *b, size_t n) {
+        if (*done)
+        {
+          return false;
+        }
+
+        return b ? parser->Feed(b, n) : true;
+      };
+
+      auto pos = front ? std::next(iCmdQ.begin()) : iCmdQ.end();
+
+      pos = iCmdQ.emplace(pos, "PASV", "", "", nullptr, nullptr);
+
+      iCmdQ.emplace(std::next(pos), mlsd ? "MLSD" : "LIST", fRemote, "", rcbk, tcbk);
+    }
+
     virtual bool IsTransferCommand(const std::string& cmd)
     {
       return (cmd == "RETR" || 
               cmd == "LIST" ||
+              cmd == "MLSD" ||
               cmd == "STOR");
     }
 
+    virtual bool IsPipelinableCommand(const std::string& cmd)
+    {
+      return (cmd == "CWD"  ||
+              cmd == "CDUP" ||
+              cmd == "MKD"  ||
+              cmd == "RMD"  ||
+              cmd == "PWD"  ||
+              cmd == "TYPE" ||
+              cmd == "DELE" ||
+              cmd == "NOOP");
+    }
+
     virtual bool IsPositiveCompletionReply(char c)
     {
       return (c == '2');
@@ -658,11 +2743,58 @@ namespace NPL
       return (c == '1');
     }
 
+    virtual void OnDisconnect(void) override
+    {
+      CProtocol::OnDisconnect();
+
+      iFTPState = FTPState::Disconnected;
+
+      ResumeOnNewSession();
+
+      FailQueuedCommands();
+    }
+
+    /*
+     * the commands still queued on a closed control connection get
+     * their terminal call, a 421 for rcbk and the end of data for a
+     * transfer's tcbk, so none of their callers waits forever
+     */
+    virtual void FailQueuedCommands(void)
+    {
+      decltype(iCmdQ) q;
+
+      {
+        std::lock_guard<std::mutex> lg(iLock);
+        q.swap(iCmdQ);
+      }
+
+      /*
+       * a transfer end still waiting for its file writes belongs
+       * to the command failed here
+       */
+      iAfterFlush.clear();
+
+      for (auto& [cmd, fRemote, fLocal, rcbk, tcbk] : q)
+      {
+        if (IsTransferCommand(cmd) && tcbk)
+        {
+          tcbk(nullptr, 0);
+        }
+
+        if (rcbk)
+        {
+          rcbk("421 Control connection closed");
+        }
+      }
+    }
+
     virtual void OnConnect(void) override
     {
       CProtocol::OnConnect();
 
-      TLS tls = GetChannelTLS(iTarget.lock());
+      iFTPState = FTPState::Connected;
+
+      TLS tls = GetTargetTLS();
 
       if (tls == TLS::Implicit)
       {
@@ -677,10 +2809,10 @@ namespace NPL
       if (sock)
       {
         sock->InitializeSSL([this] () {
-          TLS tls = GetChannelTLS(iTarget.lock()); 
+          TLS tls = GetTargetTLS(); 
           if (tls == TLS::Yes)
           {
-            iProtocolState = "USER";
+            iFTPState = FTPState::User;
             SendCommand("USER", iUserName);
           }
         });
@@ -3,15 +3,29 @@
 
 #include <CProtocol.hpp>
 
+#include <cctype>
+
 namespace NPL 
 {
+  struct CaseInsensitiveLess
+  {
+    bool operator() (const std::string& a, const std::string& b) const
+    {
+      return std::lexicographical_compare(
+        a.begin(), a.end(), b.begin(), b.end(),
+        [](unsigned char x, unsigned char y) {
+          return std::tolower(x) < std::tolower(y);
+        });
+    }
+  };
+
   class CHTTPMessage : public CMessage
   {
     protected:
 
     std::string iPayload;
 
-    std::map<std::string, std::string> iHeaders;
+    std::map<std::string, std::string, CaseInsensitiveLess> iHeaders;
 
     virtual void ParseMessage() override
     {
@@ -96,6 +110,53 @@ namespace NPL
       return iHeaders[key];
     }
 
+    /*
+     * true if the comma separated header value lists token,
+     * compared without case ("Connection: keep-alive, Upgrade")
+     */
+    virtual bool HeaderHasToken(const std::string& key, const std::string& token)
+    {
+      std::string v = GetHeader(key);
+
+      size_t b = 0;
+
+      while (b <= v.size())
+      {
+        size_t e = v.find(',', b);
+
+        if (e == std::string::npos)
+        {
+          e = v.size();
+        }
+
+        size_t s = b;
+
+        while (s < e && (v[s] == ' ' || v[s] == '\t')) s++;
+
+        size_t t = e;
+
+        while (t > s && (v[t - 1] == ' ' || v[t - 1] == '\t')) t--;
+
+        if (t - s == token.size() &&
+            std::equal(v.begin() + s, v.begin() + t, token.begin(),
+              [](unsigned char x, unsigned char y) {
+                return std::tolower(x) == std::tolower(y);
+              }))
+        {
+          return true;
+        }
+
+        b = e + 1;
+      }
+
+      return false;
+    }
+
+    virtual std::string GetStartLine(void)
+    {
+      return iMessage.substr(0, iMessage.find("\r\n"));
+    }
+
     virtual size_t HeaderCount(void)
     {
       return iHeaders.size();
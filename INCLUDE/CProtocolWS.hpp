@@ -3,17 +3,66 @@
 
 #include <CProtocolHTTP.hpp>
 
+#include <CUTF8Validator.hpp>
+
 #include <Util.hpp>
 #include <Encryption.hpp>
 
+#include <list>
+#include <random>
+#include <string_view>
+#include <unordered_map>
+
 namespace NPL 
 { 
+  /*
+   * what CWSMessage::GetFrameLength returns for a frame whose length
+   * is invalid or can not be buffered; the connection is failed
+   */
+  constexpr size_t WS_FRAME_INVALID = SIZE_MAX;
+
+  /*
+   * xorshift128+ generator used for the client frame masking 
+   * keys and the handshake nonce. One instance per connection, 
+   * seeded from std::random_device, so no locking is needed.
+   */
+  class CMaskPRNG
+  {
+    uint64_t s[2];
+
+    public:
+
+    CMaskPRNG()
+    {
+      std::random_device rd;
+
+      s[0] = ((uint64_t) rd() << 32) | rd();
+      s[1] = ((uint64_t) rd() << 32) | rd();
+
+      if (!s[0] && !s[1]) s[1] = 0x9E3779B97F4A7C15ULL;
+    }
+
+    uint64_t Next(void)
+    {
+      uint64_t x = s[0];
+      uint64_t const y = s[1];
+      s[0] = y;
+      x ^= x << 23;
+      s[1] = x ^ y ^ (x >> 17) ^ (y >> 26);
+      return s[1] + y;
+    }
+  };
+
   class CWSMessage : public CMessage
   {
     protected:
 
     std::string iPayload;
 
+    bool iValid = true;
+
+    CUTF8Validator *iValidator = nullptr;
+
     virtual void ParseMessage() override
     {
       size_t l = iMessage.size();
@@ -55,7 +104,7 @@ namespace NPL
         return;
       }
 
-      unsigned char maskingKey[4];
+      unsigned char maskingKey[4] = { 0, 0, 0, 0 };
 
       if (IsMasked() && (l >= (maskingKeyIndex + 4)))
       {
@@ -69,20 +118,83 @@ namespace NPL
 
       if ((payloadIndex + payloadLength) == l)
       {
-        for (int i = 0; i < payloadLength; i++)
+        iPayload.resize(payloadLength);
+
+        iValid = UnmaskAndValidate(
+          (uint8_t *) iPayload.data(),
+          b + payloadIndex,
+          payloadLength,
+          IsMasked() ? maskingKey : nullptr,
+          iValidator);
+
+        if (iValidator && IsFinal())
         {
-          iPayload += b[payloadIndex + i] ^ maskingKey[(i % 4)];
+          iValid = iValidator->IsComplete();
         }
       }
     }
 
     public:
 
-    CWSMessage(const uint8_t *b, size_t l) : CMessage(b, l)
+    /*
+     * v, if set, is the connection's validator for the text message 
+     * this frame belongs to; the payload is checked while unmasking
+     */
+    CWSMessage(const uint8_t *b, size_t l, CUTF8Validator *v = nullptr) : CMessage(b, l)
     {
+      iValidator = v;
       ParseMessage();
     }
 
+    /*
+     * Total frame length as given by the header, 0 if 
+     * the header itself has not been fully received,
+     * WS_FRAME_INVALID if the length is not valid
+     */
+    static size_t GetFrameLength(const uint8_t *b, size_t l)
+    {
+      if (l < 2) return 0;
+
+      size_t indicator = b[1] & 0x7F;
+
+      size_t header = 2 + ((b[1] & 0x80) ? 4 : 0);
+
+      if (indicator == 126)
+      {
+        if (l < 4) return 0;
+        return header + 2 + BTOL(b + 2, 2);
+      }
+      else if (indicator == 127)
+      {
+        if (l < 10) return 0;
+
+        uint64_t length = BTOL(b + 2, 8);
+
+        /*
+         * rfc 6455 5.2, the most significant bit must be 0; nor 
+         * may the total wrap around
+         */
+        if ((length >> 63) || length >= (SIZE_MAX - header - 8))
+        {
+          return WS_FRAME_INVALID;
+        }
+
+        return header + 8 + (size_t) length;
+      }
+
+      return header + indicator;
+    }
+
+    bool IsFinal(void)
+    {
+      return (iMessage[0] & 0x80);
+    }
+
+    bool IsValid(void)
+    {
+      return iValid;
+    }
+
     uint8_t GetOpCode(void)
     {
       return (iMessage[0] & 0x0F);
@@ -111,17 +223,170 @@ namespace NPL
 
   using SPCWSMessage = std::shared_ptr<CWSMessage>;
 
+  /*
+   * What to do with a connection whose outbound queue 
+   * grows past its limit because the peer is not reading
+   */
+  enum class WSSendPolicy : uint8_t
+  {
+    DropOldest = 0,
+    CoalesceLatest,
+    Disconnect
+  };
+
+  struct WSSendStats
+  {
+    size_t   iQueueDepth = 0;
+    size_t   iQueuedBytes = 0;
+    uint64_t iSent = 0;
+    uint64_t iDropped = 0;
+    uint64_t iCoalesced = 0;
+  };
+
+  using SPCFrame = std::shared_ptr<const std::string>;
+
+  class CProtocolWS;
+
+  /*
+   * topic -> subscriber index shared by a websocket server and all 
+   * of its accepted connections. A topic ending in '*' subscribes to 
+   * every topic that starts with the text before the '*'. Publish 
+   * cost is a lookup per distinct prefix length plus one queued 
+   * frame per subscriber; the frame itself is encoded only once.
+   */
+  class CWSTopicRouter
+  {
+    public:
+
+    void Subscribe(const std::string& topic, const std::shared_ptr<CProtocolWS>& c);
+
+    void Unsubscribe(const std::string& topic, CProtocolWS *c);
+
+    void UnsubscribeAll(CProtocolWS *c);
+
+    size_t Publish(const std::string& topic, const SPCFrame& frame);
+
+    protected:
+
+    using TSubscribers = std::unordered_map<CProtocolWS *, std::weak_ptr<CProtocolWS>>;
+
+    using TTopicMap = std::map<std::string, TSubscribers, std::less<>>;
+
+    std::mutex iLock;
+
+    uint64_t iEpoch = 0;
+
+    TTopicMap iExact;
+
+    TTopicMap iPrefix;
+
+    std::map<size_t, size_t> iPrefixLengths;
+
+    std::unordered_map<CProtocolWS *, std::vector<std::string>> iTopicsOf;
+
+    bool IsPrefix(const std::string& topic)
+    {
+      return (topic.size() && topic.back() == '*');
+    }
+
+    void Remove(const std::string& topic, CProtocolWS *c);
+  };
+
+  using SPCWSTopicRouter = std::shared_ptr<CWSTopicRouter>;
+
   class CProtocolWS : public CProtocolHTTP
   {
+    friend class CWSTopicRouter;
+
+    friend class CWSFramer;
+
     public:
 
+    CProtocolWS(SPCWSTopicRouter router = nullptr)
+    {
+      iTopicRouter = router ? router : std::make_shared<CWSTopicRouter>();
+    }
+
+    virtual ~CProtocolWS()
+    {
+      MarkDestroying();
+
+      iTopicRouter->UnsubscribeAll(this);
+    }
+
+    virtual void Subscribe(const std::string& topic)
+    {
+      iTopicRouter->Subscribe(topic,
+        std::dynamic_pointer_cast<CProtocolWS>(shared_from_this()));
+    }
+
+    virtual void Unsubscribe(const std::string& topic)
+    {
+      iTopicRouter->Unsubscribe(topic, this);
+    }
+
+    /*
+     * Sends to every connection of this server subscribed to the topic 
+     * and returns the number of subscribers reached. Under the 
+     * CoalesceLatest policy the topic is the coalescing key.
+     */
+    virtual size_t Publish(const std::string& topic, const uint8_t *data, size_t len)
+    {
+      auto frame = std::make_shared<const std::string>(EncodeFrame(data, len));
+
+      return iTopicRouter->Publish(topic, frame);
+    }
+
+    virtual void SetHostAndPath(const std::string& host, const std::string& path = "/")
+    {
+      iHost = host;
+      iPath = path;
+    }
+
+    /*
+     * Limits the frames queued for a peer that is not reading. Linux
+     * only : elsewhere TryWrite() is a blocking write that takes each
+     * frame whole, the queue never builds up and the policy is never
+     * applied.
+     */
+    virtual void SetSendQueuePolicy(WSSendPolicy policy, size_t maxMessages = 1024, size_t maxBytes = 4 * 1024 * 1024)
+    {
+      std::lock_guard<std::mutex> lg(iSendQLock);
+      iSendPolicy = policy;
+      iMaxQueued = maxMessages;
+      iMaxQueuedBytes = maxBytes;
+    }
+
+    virtual WSSendStats GetSendStats(void)
+    {
+      std::lock_guard<std::mutex> lg(iSendQLock);
+      iSendStats.iQueueDepth = iSendQ.size();
+      return iSendStats;
+    }
+
     virtual void SendProtocolMessage(const uint8_t *data, size_t len) override
     {
-      unsigned char frame[10];
+      QueueFrame(std::make_shared<const std::string>(EncodeFrame(data, len)));
+    }
+
+    /*
+     * With WSSendPolicy::CoalesceLatest a message still waiting in the 
+     * queue is replaced in place by a newer one carrying the same key
+     */
+    virtual void SendProtocolMessage(const std::string& key, const uint8_t *data, size_t len)
+    {
+      QueueFrame(std::make_shared<const std::string>(EncodeFrame(data, len)), key);
+    }
+
+    protected:
+
+    virtual std::string EncodeFrame(const uint8_t *data, size_t len, uint8_t opcode = 0x01)
+    {
+      unsigned char frame[14];
       int frameLength = 0;
 
-      /* 1000001 */
-      frame[0] = 0x81;
+      /* 1000 + opcode, final frame */
+      frame[0] = 0x80 | opcode;
       frameLength++;
 
       if (len <= 125)
@@ -149,16 +414,273 @@ namespace NPL
 
       std::string message;
 
-      message.insert(0, (char *) frame, frameLength);
-      message.insert(frameLength, (char *) data, len);
+      if (iIsClient)
+      {
+        /*
+         * client to server frames must be masked (rfc 6455 5.3)
+         */
+        frame[1] |= 0x80;
+
+        uint32_t key = (uint32_t) iPRNG.Next();
+
+        memmove(frame + frameLength, &key, 4);
+
+        frameLength += 4;
+
+        message.resize(frameLength + len);
+
+        memmove(message.data(), frame, frameLength);
 
-      Write((uint8_t *) message.data(), message.size(), 0);
+        MaskPayload((uint8_t *) message.data() + frameLength, data, len, key);
+      }
+      else
+      {
+        message.insert(0, (char *) frame, frameLength);
+        message.insert(frameLength, (char *) data, len);
+      }
+
+      return message;
     }
 
-    protected:
+    struct SendItem
+    {
+      SPCFrame    iFrame;
+      std::string iKey;
+      size_t      iOffset;
+    };
+
+    std::mutex iSendQLock;
+
+    std::list<SendItem> iSendQ;
+
+    std::map<std::string, std::list<SendItem>::iterator> iSendQKeys;
+
+    WSSendPolicy iSendPolicy = WSSendPolicy::DropOldest;
+
+    size_t iMaxQueued = 1024;
+
+    size_t iMaxQueuedBytes = 4 * 1024 * 1024;
+
+    WSSendStats iSendStats;
+
+    virtual void QueueFrame(SPCFrame frame, const std::string& key = "")
+    {
+      std::lock_guard<std::mutex> lg(iSendQLock);
+
+      if (key.size() && iSendPolicy == WSSendPolicy::CoalesceLatest)
+      {
+        auto it = iSendQKeys.find(key);
+
+        if (it != iSendQKeys.end() && it->second->iOffset == 0)
+        {
+          iSendStats.iQueuedBytes -= it->second->iFrame->size();
+          iSendStats.iQueuedBytes += frame->size();
+          it->second->iFrame = std::move(frame);
+          iSendStats.iCoalesced++;
+          FlushSendQueue();
+          return;
+        }
+      }
+
+      iSendStats.iQueuedBytes += frame->size();
+
+      iSendQ.push_back({frame, key, 0});
+
+      if (key.size() && iSendPolicy == WSSendPolicy::CoalesceLatest)
+      {
+        iSendQKeys[key] = std::prev(iSendQ.end());
+      }
+
+      FlushSendQueue();
+
+      EnforceSendQueueLimit();
+    }
+
+    virtual void FlushSendQueue(void)
+    {
+      SPCDeviceSocket pin;
+
+      auto sock = this->IsLoopThread() ? GetTargetSocket() : nullptr;
+
+      if (!sock)
+      {
+        pin = GetTargetSocketDevice();
+        sock = pin.get();
+      }
+
+      if (!sock) return;
+
+      while (iSendQ.size())
+      {
+        auto& f = iSendQ.front();
+
+        int32_t rc = sock->TryWrite(
+          (uint8_t *) f.iFrame->data() + f.iOffset,
+          f.iFrame->size() - f.iOffset);
+
+        if (rc <= 0)
+        {
+          break;
+        }
+
+        f.iOffset += rc;
+
+        iSendStats.iQueuedBytes -= rc;
+
+        /*
+         * a short count is not always a full socket, TLS takes a
+         * record at a time
+         */
+        if (f.iOffset < f.iFrame->size())
+        {
+          if (sock->IsWriteBlocked())
+          {
+            break;
+          }
+
+          continue;
+        }
+
+        EraseSendItem(iSendQ.begin());
+
+        iSendStats.iSent++;
+      }
+    }
+
+    virtual void EnforceSendQueueLimit(void)
+    {
+      auto IsOverLimit = [this] () {
+        return (iSendQ.size() > iMaxQueued) || 
+               (iSendStats.iQueuedBytes > iMaxQueuedBytes);
+      };
+
+      if (!IsOverLimit()) return;
+
+      if (iSendPolicy == WSSendPolicy::Disconnect)
+      {
+        std::cout << GetProperty("name") << " slow consumer, disconnecting\n";
+
+        iSendStats.iDropped += iSendQ.size();
+        iSendStats.iQueuedBytes = 0;
+        iSendQ.clear();
+        iSendQKeys.clear();
+
+        Stop();
+
+        return;
+      }
+
+      /*
+       * a partially sent frame at the head can not be 
+       * dropped without corrupting the stream
+       */
+      while (IsOverLimit() && iSendQ.size() > 1)
+      {
+        auto it = iSendQ.begin();
+
+        if (it->iOffset)
+        {
+          it++;
+        }
+
+        iSendStats.iQueuedBytes -= it->iFrame->size();
+
+        EraseSendItem(it);
+
+        iSendStats.iDropped++;
+      }
+    }
+
+    void EraseSendItem(std::list<SendItem>::iterator item)
+    {
+      if (item->iKey.size())
+      {
+        auto it = iSendQKeys.find(item->iKey);
+
+        if (it != iSendQKeys.end() && it->second == item)
+        {
+          iSendQKeys.erase(it);
+        }
+      }
+
+      iSendQ.erase(item);
+    }
 
     bool iWsHandshakeDone = false;
 
+    bool iIsClient = false;
+
+    /*
+     * set once the close frame of FailConnection is queued, nothing
+     * more is parsed
+     */
+    bool iFailed = false;
+
+    std::string iHost = "";
+
+    std::string iPath = "/";
+
+    std::string iExpectedAccept;
+
+    SPCWSTopicRouter iTopicRouter;
+
+    uint64_t iPublishEpoch = 0;
+
+    CUTF8Validator iUTF8;
+
+    uint8_t iFragmentOpCode = 0;
+
+    std::string iFragments;
+
+    CMaskPRNG iPRNG;
+
+    /*
+     * dst = src ^ key, 8 bytes at a time. The key is in wire 
+     * byte order so the replicated 64 bit word lines up with 
+     * the payload regardless of host endianness
+     */
+    static void MaskPayload(uint8_t *dst, const uint8_t *src, size_t len, uint32_t key)
+    {
+      uint64_t key64 = ((uint64_t) key << 32) | key;
+
+      size_t i = 0;
+
+      for (; i + 8 <= len; i += 8)
+      {
+        uint64_t w;
+        memmove(&w, src + i, 8);
+        w ^= key64;
+        memmove(dst + i, &w, 8);
+      }
+
+      const uint8_t *k = (const uint8_t *) &key;
+
+      for (; i < len; i++)
+      {
+        dst[i] = src[i] ^ k[i & 3];
+      }
+    }
+
+    static std::string ComputeAccept(const std::string& key)
+    {
+      auto s = key + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+      unsigned char hash[20] = { '\0' };
+      unsigned int hashlen;
+
+      MessageDigest(
+        (const unsigned char *) s.c_str(), 
+        s.size(),
+        hash,
+        &hashlen);
+
+      unsigned char base64[128] = { '\0' };
+
+      Base64Encode(base64, hash, hashlen);
+
+      return std::string((char *) base64);
+    }
+
     virtual void StateMachine(SPCMessage m) override
     {
       if (!iWsHandshakeDone)
@@ -184,22 +706,85 @@ namespace NPL
         if (fRet)
         {
           iWsHandshakeDone = true;
+
+          if (iIsClient)
+          {
+            CProtocol::OnConnect();
+          }
+        }
+        else if (iIsClient)
+        {
+          Stop();
         }
       }
       else
       {
+        auto ws = std::dynamic_pointer_cast<CWSMessage>(m);
+
+        if (!ws->IsValid())
+        {
+          FailConnection(1007);
+          return;
+        }
+
+        const std::string *payload = &(ws->GetPayloadString());
+
+        if (!ws->IsControlFrame() && (!ws->IsFinal() || ws->GetOpCode() == 0))
+        {
+          /*
+           * fragmented message, deliver once the final frame arrives
+           */
+          if (ws->GetOpCode())
+          {
+            iFragmentOpCode = ws->GetOpCode();
+            iFragments = *payload;
+          }
+          else
+          {
+            iFragments += *payload;
+          }
+
+          if (!ws->IsFinal())
+          {
+            return;
+          }
+
+          iFragmentOpCode = 0;
+          payload = &iFragments;
+        }
+
         if (iClientMessageCallback)
         {
           iClientMessageCallback(
             std::dynamic_pointer_cast<CProtocol>(
               shared_from_this()
             ),
-            m->GetPayloadString()
+            *payload
           );
         }
       }
     }
 
+    /*
+     * rfc 6455 7.1.7, send a close frame with the status code and 
+     * drop the connection. 1007 is used for invalid utf-8 payloads,
+     * 1002 for a frame length that is not valid
+     */
+    virtual void FailConnection(uint16_t code)
+    {
+      if (iFailed) return;
+
+      iFailed = true;
+
+      uint8_t status[2];
+
+      LTOB(code, status, 2);
+
+      QueueFrame(std::make_shared<const std::string>(EncodeFrame(status, 2, 0x08)));
+
+      Stop();
+    }
+
     virtual SPCMessage IsMessageComplete(const std::vector<uint8_t>& b) override
     {
       if (iWsHandshakeDone)
@@ -214,16 +799,39 @@ namespace NPL
 
     virtual SPCMessage IsMessageComplete(const uint8_t *b, size_t l)
     {
-      if (l < 2) return nullptr;
+      if (iFailed)
+      {
+        return nullptr;
+      }
+
+      size_t frameLength = CWSMessage::GetFrameLength(b, l);
+
+      if (frameLength == WS_FRAME_INVALID)
+      {
+        FailConnection(1002);
+        return nullptr;
+      }
+
+      if (!frameLength || l != frameLength)
+      {
+        return nullptr;
+      }
 
-      auto m = std::make_shared<CWSMessage>(b, l);
+      uint8_t opcode = b[0] & 0x0F;
 
-      if (m->GetPayloadLength())
+      CUTF8Validator *v = nullptr;
+
+      if (opcode == 0x01)
+      {
+        iUTF8.Reset();
+        v = &iUTF8;
+      }
+      else if (opcode == 0x00 && iFragmentOpCode == 0x01)
       {
-        return m;
+        v = &iUTF8;
       }
 
-      return nullptr;
+      return std::make_shared<CWSMessage>(b, l, v);
     }
 
     virtual bool ValidateClientHello(SPCMessage m)
@@ -233,12 +841,61 @@ namespace NPL
 
     virtual bool ValidateServerHello(SPCMessage m)
     {
-      return true; //todo
+      auto sHello = std::dynamic_pointer_cast<CHTTPMessage>(m);
+
+      if (sHello->GetStartLine().find(" 101") == std::string::npos)
+      {
+        std::cout << GetProperty("name") << " upgrade rejected : " << sHello->GetStartLine() << "\n";
+        return false;
+      }
+
+      /*
+       * rfc 6455 4.1, the client fails the connection unless the
+       * upgrade is to websocket and the accept key matches
+       */
+      if (!sHello->HeaderHasToken("Upgrade", "websocket") ||
+          !sHello->HeaderHasToken("Connection", "Upgrade"))
+      {
+        std::cout << GetProperty("name") << " upgrade headers missing\n";
+        return false;
+      }
+
+      if (sHello->GetHeader("Sec-WebSocket-Accept") != iExpectedAccept)
+      {
+        std::cout << GetProperty("name") << " Sec-WebSocket-Accept mismatch\n";
+        return false;
+      }
+
+      return true;
     }
 
     virtual bool SendClientHello(void)
     {
-      return false; //todo
+      uint8_t nonce[16];
+
+      uint64_t r[2] = { iPRNG.Next(), iPRNG.Next() };
+
+      memmove(nonce, r, sizeof(nonce));
+
+      unsigned char key[32] = { '\0' };
+
+      Base64Encode(key, nonce, sizeof(nonce));
+
+      iExpectedAccept = ComputeAccept((char *) key);
+
+      std::stringstream cHello;
+
+      cHello << "GET " << iPath << " HTTP/1.1\r\n";
+      cHello << "Host: " << iHost << "\r\n";
+      cHello << "Upgrade: websocket\r\n";
+      cHello << "Connection: Upgrade\r\n";
+      cHello << "Sec-WebSocket-Key: " << key << "\r\n";
+      cHello << "Sec-WebSocket-Version: 13\r\n";
+      cHello << "\r\n";
+
+      Write((uint8_t *) cHello.str().c_str(), cHello.str().size(), 0);
+
+      return true;
     }
 
     virtual bool SendServerHello(SPCMessage m)
@@ -249,27 +906,14 @@ namespace NPL
 
       assert(key.size());
 
-      key += "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
-
-      unsigned char hash[20] = { '\0' };
-      unsigned int hashlen;
-
-      MessageDigest(
-        (const unsigned char *) key.c_str(), 
-        key.size(),
-        hash,
-        &hashlen);
-
-      unsigned char base64[128] = { '\0' };
-
-      Base64Encode(base64, hash, hashlen);
+      auto accept = ComputeAccept(key);
 
       std::stringstream sHello;
 
       sHello << "HTTP/1.1 101 Switching Protocols\r\n";
       sHello << "Upgrade: websocket\r\n";
       sHello << "Connection: Upgrade\r\n";
-      sHello << "Sec-WebSocket-Accept: " << base64 << "\r\n";      
+      sHello << "Sec-WebSocket-Accept: " << accept << "\r\n";      
       sHello << "\r\n";
 
       Write((uint8_t *) sHello.str().c_str(), sHello.str().size(), 0);
@@ -283,19 +927,212 @@ namespace NPL
 
       if (sock)
       {
-        auto aso = std::make_shared<CProtocolWS>();
+        auto aso = std::make_shared<CProtocolWS>(iTopicRouter);
 
         aso->SetClientCallback(iClientMessageCallback);
 
+        aso->SetSendQueuePolicy(iSendPolicy, iMaxQueued, iMaxQueuedBytes);
+
         sock->iConnectedClient->AddEventListener(aso);
       }
     }
 
+    virtual void OnWrite(const uint8_t *b, size_t n) override
+    {
+      {
+        std::lock_guard<std::mutex> lg(iSendQLock);
+        FlushSendQueue();
+      }
+
+      CProtocolHTTP::OnWrite(b, n);
+    }
+
+    virtual void OnDisconnect(void) override
+    {
+      iTopicRouter->UnsubscribeAll(this);
+
+      CProtocolHTTP::OnDisconnect();
+    }
+
     virtual void OnConnect(void) override
     {
-      SendClientHello();
+      iIsClient = true;
+
+      auto sock = GetTargetSocketDevice();
+
+      if (sock && sock->GetTLS() == TLS::Yes)
+      {
+        sock->InitializeSSL([this] () {
+          SendClientHello();
+        });
+      }
+      else
+      {
+        SendClientHello();
+      }
     }
   };
+
+  using SPCProtocolWS = std::shared_ptr<CProtocolWS>;
+
+  inline void CWSTopicRouter::Subscribe(const std::string& topic, const std::shared_ptr<CProtocolWS>& c)
+  {
+    std::lock_guard<std::mutex> lg(iLock);
+
+    auto& topics = iTopicsOf[c.get()];
+
+    if (std::find(topics.begin(), topics.end(), topic) != topics.end())
+    {
+      return;
+    }
+
+    topics.push_back(topic);
+
+    if (IsPrefix(topic))
+    {
+      auto prefix = topic.substr(0, topic.size() - 1);
+
+      auto& subscribers = iPrefix[prefix];
+
+      if (subscribers.empty())
+      {
+        iPrefixLengths[prefix.size()]++;
+      }
+
+      subscribers[c.get()] = c;
+    }
+    else
+    {
+      iExact[topic][c.get()] = c;
+    }
+  }
+
+  inline void CWSTopicRouter::Unsubscribe(const std::string& topic, CProtocolWS *c)
+  {
+    std::lock_guard<std::mutex> lg(iLock);
+
+    auto it = iTopicsOf.find(c);
+
+    if (it == iTopicsOf.end()) return;
+
+    auto& topics = it->second;
+
+    auto t = std::find(topics.begin(), topics.end(), topic);
+
+    if (t == topics.end()) return;
+
+    topics.erase(t);
+
+    if (topics.empty())
+    {
+      iTopicsOf.erase(it);
+    }
+
+    Remove(topic, c);
+  }
+
+  inline void CWSTopicRouter::UnsubscribeAll(CProtocolWS *c)
+  {
+    std::lock_guard<std::mutex> lg(iLock);
+
+    auto it = iTopicsOf.find(c);
+
+    if (it == iTopicsOf.end()) return;
+
+    for (auto& topic : it->second)
+    {
+      Remove(topic, c);
+    }
+
+    iTopicsOf.erase(it);
+  }
+
+  inline void CWSTopicRouter::Remove(const std::string& topic, CProtocolWS *c)
+  {
+    if (IsPrefix(topic))
+    {
+      auto prefix = topic.substr(0, topic.size() - 1);
+
+      auto it = iPrefix.find(prefix);
+
+      if (it == iPrefix.end()) return;
+
+      it->second.erase(c);
+
+      if (it->second.empty())
+      {
+        iPrefix.erase(it);
+
+        if (--iPrefixLengths[prefix.size()] == 0)
+        {
+          iPrefixLengths.erase(prefix.size());
+        }
+      }
+    }
+    else
+    {
+      auto it = iExact.find(topic);
+
+      if (it == iExact.end()) return;
+
+      it->second.erase(c);
+
+      if (it->second.empty())
+      {
+        iExact.erase(it);
+      }
+    }
+  }
+
+  inline size_t CWSTopicRouter::Publish(const std::string& topic, const SPCFrame& frame)
+  {
+    std::vector<SPCProtocolWS> targets;
+
+    {
+      std::lock_guard<std::mutex> lg(iLock);
+
+      iEpoch++;
+
+      auto Collect = [this, &targets] (TSubscribers& subscribers) {
+        for (auto& [k, w] : subscribers)
+        {
+          auto c = w.lock();
+
+          if (c && c->iPublishEpoch != iEpoch)
+          {
+            c->iPublishEpoch = iEpoch;
+            targets.push_back(c);
+          }
+        }
+      };
+
+      auto it = iExact.find(topic);
+
+      if (it != iExact.end())
+      {
+        Collect(it->second);
+      }
+
+      for (auto& [len, count] : iPrefixLengths)
+      {
+        if (len > topic.size()) break;
+
+        auto p = iPrefix.find(std::string_view(topic).substr(0, len));
+
+        if (p != iPrefix.end())
+        {
+          Collect(p->second);
+        }
+      }
+    }
+
+    for (auto& c : targets)
+    {
+      c->QueueFrame(frame, topic);
+    }
+
+    return targets.size();
+  }
 }
 
 #endif //PROTOCOLWS_HPP
\ No newline at end of file
@@ -8,6 +8,7 @@
 #include <vector>
 #include <memory>
 #include <string>
+#include <cassert>
 #include <utility>
 #include <iostream>
 #include <algorithm>
@@ -15,6 +16,17 @@
 
 namespace NPL 
 {
+  using TTimerCbk = std::function<void (void)>;
+
+  using TFileIOJob = std::function<void (void)>;
+
+  /*
+   * Base of every device, protocol and listener. Each class that
+   * derives from it calls MarkDestroying() first thing in its own
+   * destructor : until then the loop may follow a bare pointer into
+   * it, and ~CSubject only gets there once the derived members are
+   * gone. A second call, from a base destructor, does nothing.
+   */
   template <typename T1, typename T2>
   class CSubject : public std::enable_shared_from_this<CSubject<T1, T2>>
   {
@@ -23,17 +35,153 @@ namespace NPL
     using SPCSubject = std::shared_ptr<CSubject<T1, T2>>;
     using WPCSubject = std::weak_ptr<CSubject<T1, T2>>;
 
+    using TObserverList = std::vector<SPCSubject>;
+    using SPCObserverList = std::shared_ptr<const TObserverList>;
+
+    /*
+     * serializes changes to the observer list and the property map,
+     * the event and I/O paths do not take it
+     */
     std::mutex iLock;
 
+    /*
+     * set when the subject is attached, before it is published to
+     * its source's observer list, and not changed afterwards
+     */
     WPCSubject iTarget;
 
-    bool iConnected = false;
+    /*
+     * cleared first thing when the subject is destroyed
+     */
+    using TAliveFlag = std::shared_ptr<std::atomic<bool>>;
+
+    TAliveFlag iAlive = std::make_shared<std::atomic<bool>>(true);
+
+    /*
+     * never reused, unlike the address; queued completions carry
+     * it to tell a new subject from a destroyed one at its place
+     */
+    const uint64_t iSerial = NextSerial();
+
+    static uint64_t NextSerial(void)
+    {
+      static std::atomic<uint64_t> serial{0};
+      return ++serial;
+    }
+
+    /*
+     * the target and the dispatcher at the root of the chain, bound
+     * in SetTarget along with their alive flags, so the per message
+     * paths neither lock a weak_ptr nor walk the chain
+     */
+    struct TBinding
+    {
+      CSubject   *iTarget = nullptr;
+      TAliveFlag  iTargetAlive;
+      WPCSubject  iTargetRef;
+      CSubject   *iDispatcher = nullptr;
+      TAliveFlag  iDispatcherAlive;
+      WPCSubject  iDispatcherRef;
+    };
+
+    /*
+     * published as a whole, like iObservers, but through a plain
+     * atomic pointer so reading it costs no refcount. Only the loop
+     * of the dispatcher it names reads it unlocked, so the bindings
+     * it replaced are freed on that loop between events; a subject
+     * moved to another dispatcher keeps them until it goes away
+     */
+    std::atomic<const TBinding *> iBinding{nullptr};
+
+    std::vector<std::unique_ptr<const TBinding>> iBindings;
+
+    /*
+     * guards the bindings everywhere else; not iLock, which the
+     * subclasses hold across calls that read them. Never held
+     * across a call out
+     */
+    std::mutex iBindingLock;
+
+    /*
+     * the dispatcher of the current binding, checked before the
+     * binding itself so no other thread ever dereferences it
+     */
+    std::atomic<const CSubject *> iBoundLoop{nullptr};
+
+    /*
+     * the one loop that may have read a binding unlocked, and its
+     * alive flag. When the subject moves to another loop, what the
+     * old one may still be reading is handed to it to free
+     */
+    CSubject *iReaderLoop = nullptr;
+
+    TAliveFlag iReaderLoopAlive;
+
+    WPCSubject iReaderLoopRef;
+
+    bool iReclaimQueued = false;
+
+    /*
+     * the dispatcher whose event loop runs on this thread, if any
+     */
+    static inline thread_local const CSubject *iLoopDispatcher = nullptr;
+
+    /*
+     * what GetTargetPtr/GetDispatcherPtr return : on the dispatcher's
+     * own thread the bare pointer, anywhere else (file I/O workers,
+     * user threads) a locked weak_ptr holds it for the call
+     */
+    struct TRef
+    {
+      CSubject   *iPtr = nullptr;
+      SPCSubject  iPin;
+
+      CSubject * operator->() const { return iPtr; }
+
+      explicit operator bool() const { return iPtr != nullptr; }
+    };
+
+    std::atomic<bool> iConnected{false};
+
+    std::atomic<bool> iMarkRemoveAllListeners{false};
+
+    std::atomic<bool> iMarkRemoveSelfAsListener{false};
+
+    /*
+     * immutable snapshot, replaced as a whole on every change. A
+     * notification walks the snapshot it loaded, so observers added
+     * or removed meanwhile take effect from the next event on and a
+     * removed observer lives until the walk is over.
+     */
+    SPCObserverList iObservers = std::make_shared<const TObserverList>();
+
+    /*
+     * The same snapshot for the loop, which walks it through the bare
+     * pointer : std::atomic_load of a shared_ptr takes a lock from a
+     * shared pool (libstdc++, MSVC) and two refcount updates on every
+     * notification. Replaced snapshots are retired and freed on the
+     * loop between events along with the bindings; any other thread
+     * pins the snapshot with std::atomic_load.
+     */
+    std::atomic<const TObserverList *> iObserverList{iObservers.get()};
 
-    bool iMarkRemoveAllListeners = false;
+    std::vector<SPCObserverList> iRetiredObservers;
 
-    bool iMarkRemoveSelfAsListener = false;
+    struct TRetired
+    {
+      std::vector<std::unique_ptr<const TBinding>> iBindings;
+      std::vector<SPCObserverList>                 iObservers;
+    };
+
+    struct TObservers
+    {
+      const TObserverList *iPtr = nullptr;
+      SPCObserverList      iPin;
 
-    std::vector<SPCSubject> iObservers;
+      const TObserverList& operator*() const { return *iPtr; }
+
+      const TObserverList * operator->() const { return iPtr; }
+    };
 
     std::map<std::string, std::string> iPropertyMap;
 
@@ -41,11 +189,14 @@ namespace NPL
 
     CSubject()
     {
+      PublishBinding(std::make_unique<TBinding>());
       SetProperty("name", "unknown");
     }
 
     virtual ~CSubject()
     {
+      MarkDestroying();
+
       std::lock_guard<std::mutex> lg(iLock);
       RemoveAllEventListenersInternal();
       std::cout << "~CSubject : " + iPropertyMap.at("name") << std::endl;
@@ -53,25 +204,73 @@ namespace NPL
 
     virtual void SetTarget(const WPCSubject& target)
     {
-      std::lock_guard<std::mutex> lg(iLock);
-      iTarget = target;
+      {
+        std::lock_guard<std::mutex> lg(iLock);
+        iTarget = target;
+      }
+
+      Bind();
     }
 
+    /*
+     * the calls below end at the dispatcher, they go to it directly
+     */
     virtual void QueuePendingContext(SPCSubject s, void *c)
     {
-      auto target = iTarget.lock();
+      auto D = GetDispatcherPtr();
 
-      if (target)
+      if (D)
       {
-        return target->QueuePendingContext(s, c);
+        return D->QueuePendingContext(s, c);
       }      
     }
 
-    virtual void * Read(const uint8_t *b = nullptr, size_t l = 0, uint64_t o = 0)
+    /*
+     * runs cbk on the dispatcher thread after ms milliseconds
+     */
+    virtual void ScheduleTimer(uint32_t ms, TTimerCbk cbk)
     {
-      std::lock_guard<std::mutex> lg(iLock);
+      auto D = GetDispatcherPtr();
 
-      auto target = iTarget.lock();
+      if (D)
+      {
+        return D->ScheduleTimer(ms, cbk);
+      }
+    }
+
+    /*
+     * enables or disables readiness notifications for device s
+     */
+    virtual void SetEventInterest(SPCSubject s, bool read, bool write)
+    {
+      auto D = GetDispatcherPtr();
+
+      if (D)
+      {
+        return D->SetEventInterest(s, read, write);
+      }
+    }
+
+    /*
+     * runs a blocking file I/O job off the dispatcher thread; false
+     * if there is no I/O engine or it is full, the caller then does
+     * the I/O itself
+     */
+    virtual bool SubmitFileIO(TFileIOJob job)
+    {
+      auto D = GetDispatcherPtr();
+
+      if (D)
+      {
+        return D->SubmitFileIO(job);
+      }
+
+      return false;
+    }
+
+    virtual void * Read(const uint8_t *b = nullptr, size_t l = 0, uint64_t o = 0)
+    {
+      auto target = GetTargetPtr();
 
       if (target)
       {
@@ -83,9 +282,7 @@ namespace NPL
 
     virtual void Write(const uint8_t *b = nullptr, size_t l = 0, uint64_t o = 0)
     {
-      std::lock_guard<std::mutex> lg(iLock);
-
-      auto target = iTarget.lock();
+      auto target = GetTargetPtr();
 
       if (target)
       {
@@ -95,9 +292,7 @@ namespace NPL
 
     virtual int32_t ReadSync(const uint8_t *b = nullptr, size_t l = 0, uint64_t o = 0)
     {
-      std::lock_guard<std::mutex> lg(iLock);
-
-      auto target = iTarget.lock();
+      auto target = GetTargetPtr();
 
       if (target)
       {
@@ -109,9 +304,7 @@ namespace NPL
 
     virtual int32_t WriteSync(const uint8_t *b = nullptr, size_t l = 0, uint64_t o = 0)
     {
-      std::lock_guard<std::mutex> lg(iLock);
-
-      auto target = iTarget.lock();
+      auto target = GetTargetPtr();
 
       if (target)
       {
@@ -123,32 +316,27 @@ namespace NPL
 
     virtual void OnAccept(void)
     {
-      std::lock_guard<std::mutex> lg(iLock);
       NotifyAccept();
     }
 
     virtual void OnConnect(void)
     {
-      std::lock_guard<std::mutex> lg(iLock);
       iConnected = true;
       NotifyConnect();
     }
 
     virtual void OnRead(const T1 *b, size_t n)
     {
-      std::lock_guard<std::mutex> lg(iLock);
       NotifyRead((const T2 *)b, n);
     }
 
     virtual void OnWrite(const T1 *b, size_t n)
     {
-      std::lock_guard<std::mutex> lg(iLock);
       NotifyWrite(b, n);
     }
 
     virtual void OnDisconnect(void)
     {
-      std::lock_guard<std::mutex> lg(iLock);
       iConnected = false;
       NotifyDisconnect();
       MarkRemoveAllListeners();
@@ -157,15 +345,17 @@ namespace NPL
 
     virtual void OnEvent(std::any e)
     {
-      std::lock_guard<std::mutex> lg(iLock);
       NotifyEvent(e);
     }
 
     virtual const SPCSubject& AddEventListener(const SPCSubject& observer)
     {
-      std::lock_guard<std::mutex> lg(iLock);
-      iObservers.push_back(observer);
       observer->SetTarget(this->weak_from_this());
+
+      std::lock_guard<std::mutex> lg(iLock);
+      auto observers = std::make_shared<TObserverList>(*GetObservers());
+      observers->push_back(observer);
+      PublishObservers(observers);
       return observer;
     }
 
@@ -206,30 +396,15 @@ namespace NPL
       return false;
     }
 
+    uint64_t GetSerial(void) const
+    {
+      return iSerial;
+    }
+
     SPCSubject GetDispatcher(void)
     {
-       auto target = iTarget;
-
-       while (true)
-       {
-         auto sp = target.lock();
-
-         if (sp)
-         {
-           if (sp->IsDispatcher())
-           {
-             return sp;
-           }
-           else
-           {
-             target = sp->iTarget;
-           }
-         }
-         else
-         {
-           return nullptr;
-         }
-       } 
+      std::lock_guard<std::mutex> lg(iBindingLock);
+      return GetBinding()->iDispatcherRef.lock();
     }
 
     virtual void SetProperty(const std::string& key, const std::string& value)
@@ -270,6 +445,427 @@ namespace NPL
 
     protected:
 
+    TObservers GetObservers(void) const
+    {
+      if (IsObserverLoop())
+      {
+        return { iObserverList.load(std::memory_order_acquire), nullptr };
+      }
+
+      auto observers = std::atomic_load(&iObservers);
+
+      return { observers.get(), observers };
+    }
+
+    /*
+     * the dispatcher walks its own list on its loop, any other
+     * subject on the loop it is bound to
+     */
+    bool IsObserverLoop(void) const
+    {
+      return iLoopDispatcher && (iLoopDispatcher == this || IsLoopThread());
+    }
+
+    /*
+     * the cached target and dispatcher, empty once they are gone. The
+     * bare pointers are only used on the dispatcher thread and only
+     * while attached and alive; any other thread, or a detached
+     * subject, goes through the weak_ptr. The alive flag is checked
+     * before the call, not held across it, so a subject with
+     * observers is torn down on the dispatcher thread or once the
+     * dispatcher is gone (see MarkDestroying)
+     */
+    TRef GetTargetPtr(void)
+    {
+      if (IsLoopThread())
+      {
+        auto b = GetBinding();
+
+        if (b->iTarget && b->iDispatcher == iLoopDispatcher && *b->iTargetAlive)
+        {
+          return { b->iTarget, nullptr };
+        }
+      }
+
+      auto target = GetTargetRef();
+
+      return { target.get(), target };
+    }
+
+    TRef GetDispatcherPtr(void)
+    {
+      if (IsLoopThread())
+      {
+        auto b = GetBinding();
+
+        if (b->iDispatcher == iLoopDispatcher && *b->iDispatcherAlive)
+        {
+          return { b->iDispatcher, nullptr };
+        }
+      }
+
+      auto D = GetDispatcher();
+
+      return { D.get(), D };
+    }
+
+    SPCSubject GetTargetRef(void)
+    {
+      std::lock_guard<std::mutex> lg(iBindingLock);
+      return GetBinding()->iTargetRef.lock();
+    }
+
+    bool IsLoopThread(void) const
+    {
+      return iLoopDispatcher && iLoopDispatcher == iBoundLoop.load(std::memory_order_acquire);
+    }
+
+    /*
+     * called by the event loop thread before it runs
+     */
+    void EnterLoop(void)
+    {
+      iLoopDispatcher = this;
+    }
+
+    /*
+     * first thing in the destructor of every subject class, so the
+     * bare pointers are not followed into a half destroyed object
+     * while the derived parts are torn down. Its observers may be
+     * past that check on the loop, so a subject that has any is
+     * destroyed there, or after the dispatcher
+     */
+    void MarkDestroying(void)
+    {
+      if (!iAlive->exchange(false))
+      {
+        return;
+      }
+
+      {
+        std::lock_guard<std::mutex> lg(iBindingLock);
+
+        assert(!iReaderLoop || iReaderLoop == iLoopDispatcher ||
+               !*iReaderLoopAlive || GetObservers()->empty());
+      }
+
+      Detach(nullptr);
+    }
+
+    /*
+     * drops the bare pointers of a subject removed from "from" (any
+     * source when nullptr); it keeps the weak_ptrs, so a detached
+     * subject still reaches its former target the slow way
+     */
+    void Detach(const CSubject *from)
+    {
+      bool reclaim = false;
+
+      {
+        std::lock_guard<std::mutex> lg(iBindingLock);
+
+        auto b = GetBinding();
+
+        if (!b->iTarget || (from && b->iTarget != from))
+        {
+          return;
+        }
+
+        auto d = std::make_unique<TBinding>(*b);
+
+        d->iTarget = nullptr;
+        d->iDispatcher = nullptr;
+
+        reclaim = PublishBindingInternal(std::move(d));
+      }
+
+      ScheduleReclaim(reclaim);
+
+      OnTargetChanged();
+    }
+
+    const TBinding * GetBinding(void) const
+    {
+      return iBinding.load(std::memory_order_acquire);
+    }
+
+    void PublishBinding(std::unique_ptr<TBinding> b)
+    {
+      bool reclaim = false;
+
+      std::shared_ptr<TRetired> retired;
+
+      CSubject *from = nullptr;
+
+      SPCSubject fromRef;
+
+      {
+        std::lock_guard<std::mutex> lg(iBindingLock);
+
+        if (b->iDispatcher && iReaderLoop && iReaderLoop != b->iDispatcher && *iReaderLoopAlive)
+        {
+          /*
+           * the old loop may be in an event that reads the current
+           * binding or walks the current snapshot
+           */
+          retired = std::make_shared<TRetired>();
+
+          retired->iBindings.swap(iBindings);
+          retired->iObservers.swap(iRetiredObservers);
+          retired->iObservers.push_back(std::atomic_load(&iObservers));
+
+          from = iReaderLoop;
+
+          if (iLoopDispatcher != from)
+          {
+            fromRef = iReaderLoopRef.lock();
+          }
+        }
+
+        reclaim = PublishBindingInternal(std::move(b));
+      }
+
+      HandOver(from, fromRef, retired);
+
+      ScheduleReclaim(reclaim);
+    }
+
+    /*
+     * frees what a loop the subject left may still read once that
+     * loop is between events; on the loop itself through the bare
+     * pointer, as ScheduleReclaim does
+     */
+    void HandOver(CSubject *from, SPCSubject& fromRef, std::shared_ptr<TRetired>& retired)
+    {
+      if (!retired)
+      {
+        return;
+      }
+
+      if (iLoopDispatcher == from)
+      {
+        from->ScheduleTimer(0, [retired] () {});
+      }
+      else if (fromRef)
+      {
+        fromRef->ScheduleTimer(0, [retired] () {});
+      }
+    }
+
+    /*
+     * callers hold iBindingLock; returns whether the loop is to be
+     * asked to free the replaced bindings
+     */
+    bool PublishBindingInternal(std::unique_ptr<TBinding> b)
+    {
+      if (b->iDispatcher)
+      {
+        iReaderLoop = b->iDispatcher;
+        iReaderLoopAlive = b->iDispatcherAlive;
+        iReaderLoopRef = b->iDispatcherRef;
+      }
+
+      iBinding.store(b.get(), std::memory_order_release);
+      iBoundLoop.store(b->iDispatcher, std::memory_order_release);
+      iBindings.push_back(std::move(b));
+
+      if (!iReaderLoop || !*iReaderLoopAlive)
+      {
+        /*
+         * never read without iBindingLock, or only by a loop that
+         * has stopped : the replaced bindings go at once
+         */
+        iBindings.erase(iBindings.begin(), std::prev(iBindings.end()));
+        return false;
+      }
+
+      if (iBindings.size() == 1)
+      {
+        return false;
+      }
+
+      return QueueReclaim();
+    }
+
+    /*
+     * callers hold iBindingLock; true if the loop is to be asked for
+     * a reclaim, none being on its way yet
+     */
+    bool QueueReclaim(void)
+    {
+      if (iReclaimQueued)
+      {
+        return false;
+      }
+
+      iReclaimQueued = IsDispatcher() || !iReaderLoopRef.expired();
+
+      return iReclaimQueued;
+    }
+
+    void ScheduleReclaim(bool reclaim)
+    {
+      if (!reclaim)
+      {
+        return;
+      }
+
+      /*
+       * the loop never pins its own dispatcher : the last reference
+       * dropped there would have the dispatcher join itself. It
+       * outlives its loop anyway, the destructor joins it first, so
+       * on the loop the bare pointers do
+       */
+      if (IsDispatcher())
+      {
+        ScheduleTimer(0, [this] () { ReclaimSnapshots(); });
+        return;
+      }
+
+      CSubject *loop = nullptr;
+
+      SPCSubject D;
+
+      {
+        std::lock_guard<std::mutex> lg(iBindingLock);
+
+        if (iLoopDispatcher && iReaderLoop == iLoopDispatcher)
+        {
+          loop = iReaderLoop;
+        }
+        else
+        {
+          D = iReaderLoopRef.lock();
+          loop = D.get();
+        }
+
+        iReclaimQueued = (loop != nullptr);
+      }
+
+      if (loop)
+      {
+        loop->ScheduleTimer(0, [w = this->weak_from_this()] () {
+          auto sp = w.lock();
+          if (sp)
+          {
+            sp->ReclaimSnapshots();
+          }
+        });
+      }
+    }
+
+    /*
+     * run by the loop between events, when it holds no binding and
+     * walks no snapshot
+     */
+    void ReclaimSnapshots(void)
+    {
+      std::vector<SPCObserverList> retired;
+
+      {
+        std::lock_guard<std::mutex> lg(iBindingLock);
+
+        iReclaimQueued = false;
+
+        if (iReaderLoop != iLoopDispatcher && this != iLoopDispatcher)
+        {
+          return;
+        }
+
+        iBindings.erase(iBindings.begin(), std::prev(iBindings.end()));
+
+        retired.swap(iRetiredObservers);
+      }
+    }
+
+    /*
+     * resolves the cached pointers from the target, then rebinds the
+     * observers, which may have been attached before this subject was
+     */
+    virtual void Bind(void)
+    {
+      SPCSubject target, D;
+
+      {
+        std::lock_guard<std::mutex> lg(iLock);
+        target = iTarget.lock();
+      }
+
+      if (target)
+      {
+        D = target->IsDispatcher() ? target : target->GetDispatcher();
+      }
+
+      auto b = std::make_unique<TBinding>();
+
+      if (target)
+      {
+        b->iTarget = target.get();
+        b->iTargetAlive = target->iAlive;
+        b->iTargetRef = target;
+      }
+
+      if (D)
+      {
+        b->iDispatcher = D.get();
+        b->iDispatcherAlive = D->iAlive;
+        b->iDispatcherRef = D;
+      }
+
+      PublishBinding(std::move(b));
+
+      OnTargetChanged();
+
+      auto self = this->weak_from_this();
+
+      auto observers = GetObservers();
+
+      for (auto& observer : *observers)
+      {
+        observer->SetTarget(self);
+      }
+    }
+
+    /*
+     * lets a subclass cache what it derives from the target
+     */
+    virtual void OnTargetChanged(void)
+    {
+    }
+
+    /*
+     * callers hold iLock
+     */
+    void PublishObservers(SPCObserverList observers)
+    {
+      auto old = std::atomic_load(&iObservers);
+
+      std::atomic_store(&iObservers, observers);
+
+      iObserverList.store(observers.get(), std::memory_order_release);
+
+      bool reclaim = false;
+
+      {
+        std::lock_guard<std::mutex> lg(iBindingLock);
+
+        if (!IsDispatcher() && (!iReaderLoop || !*iReaderLoopAlive))
+        {
+          /*
+           * never walked through the bare pointer, or by a loop
+           * that has stopped
+           */
+          return;
+        }
+
+        iRetiredObservers.push_back(std::move(old));
+
+        reclaim = QueueReclaim();
+      }
+
+      ScheduleReclaim(reclaim);
+    }
+
     virtual void ResetSubject(SPCSubject& subject)
     {
       subject->MarkRemoveAllListeners();
@@ -277,44 +873,94 @@ namespace NPL
       subject.reset();
     }
 
+    /*
+     * applies the removals marked during a notification once it is
+     * over; the common case, nothing marked, takes no lock
+     */
     virtual void ProcessMarkRemoveAllListeners(void)
     {
+      auto observers = GetObservers();
+
+      bool marked = this->iMarkRemoveAllListeners;
+
+      for (size_t i = 0; !marked && i < observers->size(); i++)
+      {
+        marked = (*observers)[i]->IsMarkRemoveSelfAsListener();
+      }
+
+      if (!marked)
+      {
+        return;
+      }
+
+      std::lock_guard<std::mutex> lg(iLock);
+
       if (this->iMarkRemoveAllListeners)
       {
-        this->RemoveAllEventListenersInternal();        
+        this->RemoveAllEventListenersInternal();
       }
 
-      for (auto it = iObservers.begin(); it != iObservers.end(); )
+      auto current = GetObservers();
+
+      auto kept = std::make_shared<TObserverList>();
+
+      for (auto& o : *current)
       {
-        if ((*it)->IsMarkRemoveSelfAsListener())
+        if (!o->IsMarkRemoveSelfAsListener())
         {
-          it = this->RemoveEventListenerInternal(*it);
+          kept->push_back(o);
         }
-        else
+      }
+
+      if (kept->size() != current->size())
+      {
+        PublishObservers(kept);
+
+        for (auto& o : *current)
         {
-          it++;
+          if (o->IsMarkRemoveSelfAsListener())
+          {
+            o->Detach(this);
+          }
         }
       }
     }
 
+    /*
+     * callers hold iLock
+     */
     virtual void RemoveAllEventListenersInternal()
     {
-      iObservers.clear();
-      iMarkRemoveAllListeners = false;      
+      auto observers = GetObservers();
+
+      PublishObservers(std::make_shared<const TObserverList>());
+      iMarkRemoveAllListeners = false;
+
+      for (auto& o : *observers)
+      {
+        o->Detach(this);
+      }
     }
 
-    auto RemoveEventListenerInternal(const SPCSubject& consumer)
+    void RemoveEventListenerInternal(const SPCSubject& consumer)
     {
-      return iObservers.erase(
+      auto observers = std::make_shared<TObserverList>(*GetObservers());
+
+      observers->erase(
         std::remove(
-          iObservers.begin(), iObservers.end(), consumer),
-        iObservers.end()
+          observers->begin(), observers->end(), consumer),
+        observers->end()
       );
+
+      PublishObservers(observers);
+
+      consumer->Detach(this);
     }
 
     virtual void NotifyConnect()
     {
-      for (auto& observer : iObservers)
+      auto observers = GetObservers();
+      for (auto& observer : *observers)
       {
         observer->OnConnect();
       }
@@ -323,7 +969,8 @@ namespace NPL
 
     virtual void NotifyRead(const T2 *b, size_t n)
     {
-      for (auto& observer : iObservers)
+      auto observers = GetObservers();
+      for (auto& observer : *observers)
       {
         observer->OnRead(b, n);
       }
@@ -332,7 +979,8 @@ namespace NPL
 
     virtual void NotifyWrite(const T2 *b, size_t n)
     {
-      for (auto& observer : iObservers)
+      auto observers = GetObservers();
+      for (auto& observer : *observers)
       {
         observer->OnWrite(b, n);
       }
@@ -341,7 +989,8 @@ namespace NPL
 
     virtual void NotifyDisconnect()
     {
-      for (auto& observer : iObservers)
+      auto observers = GetObservers();
+      for (auto& observer : *observers)
       {
         observer->OnDisconnect();
       }
@@ -350,7 +999,8 @@ namespace NPL
 
     virtual void NotifyAccept(void)
     {
-      for (auto& observer : iObservers)
+      auto observers = GetObservers();
+      for (auto& observer : *observers)
       {
         observer->OnAccept();
       }
@@ -359,7 +1009,8 @@ namespace NPL
 
     virtual void NotifyEvent(std::any e)
     {
-      for (auto& observer : iObservers)
+      auto observers = GetObservers();
+      for (auto& observer : *observers)
       {
         observer->OnEvent(e);
       }
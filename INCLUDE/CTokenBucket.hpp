@@ -0,0 +1,164 @@
+#ifndef TOKENBUCKET_HPP
+#define TOKENBUCKET_HPP
+
+#include <mutex>
+#include <chrono>
+#include <memory>
+#include <cstdint>
+#include <algorithm>
+
+namespace NPL
+{
+  class CTokenBucket;
+
+  using SPCTokenBucket = std::shared_ptr<CTokenBucket>;
+
+  /*
+   * Byte rate limiter. "rate" bytes per second refill the bucket up
+   * to "burst" bytes. Buckets form a hierarchy: a child only has what
+   * every bucket up to the root has, and consuming from the child
+   * consumes from all of them, so e.g. per device buckets can share a
+   * per protocol or a global parent. Consume() may overdraw; the
+   * debt is paid back before anything is available again.
+   */
+  class CTokenBucket
+  {
+    public:
+
+    using TClock = std::chrono::steady_clock;
+
+    CTokenBucket(uint64_t rate, uint64_t burst = 0, SPCTokenBucket parent = nullptr)
+    {
+      SetRate(rate, burst);
+
+      iTokens = static_cast<double>(iBurst);
+
+      iParent = parent;
+
+      iLast = TClock::now();
+    }
+
+    virtual ~CTokenBucket() {}
+
+    /*
+     * 0 means unlimited; burst defaults to 1/10 s worth of rate
+     */
+    virtual void SetRate(uint64_t rate, uint64_t burst = 0)
+    {
+      std::lock_guard<std::mutex> lg(iLock);
+
+      iRate = rate;
+
+      iBurst = burst ? burst : std::max<uint64_t>(rate / 10, 1);
+    }
+
+    virtual uint64_t GetRate(void)
+    {
+      return iRate;
+    }
+
+    /*
+     * bytes that can be sent or received now
+     */
+    virtual size_t Available(void)
+    {
+      size_t n = SIZE_MAX;
+
+      {
+        std::lock_guard<std::mutex> lg(iLock);
+
+        if (iRate)
+        {
+          Refill();
+
+          n = (iTokens > 0) ? static_cast<size_t>(iTokens) : 0;
+        }
+      }
+
+      if (iParent)
+      {
+        n = std::min(n, iParent->Available());
+      }
+
+      return n;
+    }
+
+    virtual void Consume(size_t n)
+    {
+      {
+        std::lock_guard<std::mutex> lg(iLock);
+
+        if (iRate)
+        {
+          Refill();
+
+          iTokens -= static_cast<double>(n);
+        }
+      }
+
+      if (iParent)
+      {
+        iParent->Consume(n);
+      }
+    }
+
+    /*
+     * milliseconds until at least n bytes (capped at the burst) are
+     * available along the whole chain
+     */
+    virtual uint32_t DelayMs(size_t n = 1)
+    {
+      uint32_t ms = 0;
+
+      {
+        std::lock_guard<std::mutex> lg(iLock);
+
+        if (iRate)
+        {
+          Refill();
+
+          double need = std::min<double>(static_cast<double>(n), static_cast<double>(iBurst)) - iTokens;
+
+          if (need > 0)
+          {
+            ms = static_cast<uint32_t>(need * 1000 / iRate) + 1;
+          }
+        }
+      }
+
+      if (iParent)
+      {
+        ms = std::max(ms, iParent->DelayMs(n));
+      }
+
+      return ms;
+    }
+
+    protected:
+
+    std::mutex iLock;
+
+    uint64_t iRate = 0;
+
+    uint64_t iBurst = 0;
+
+    double iTokens = 0;
+
+    TClock::time_point iLast;
+
+    SPCTokenBucket iParent;
+
+    void Refill(void)
+    {
+      auto now = TClock::now();
+
+      double elapsed = std::chrono::duration<double>(now - iLast).count();
+
+      iLast = now;
+
+      iTokens = std::min(iTokens + elapsed * iRate, static_cast<double>(iBurst));
+    }
+  };
+}
+
+#endif //TOKENBUCKET_HPP
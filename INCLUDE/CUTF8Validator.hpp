@@ -0,0 +1,177 @@
+#ifndef UTF8VALIDATOR_HPP
+#define UTF8VALIDATOR_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+  #include <emmintrin.h>
+  #define NPL_UTF8_SSE2
+#endif
+
+namespace NPL
+{
+  /*
+   * Incremental UTF-8 validator (rfc 3629). State is carried across
+   * Update() calls so a code point may be split between websocket
+   * fragments. Rejects overlongs, surrogates and code points above
+   * U+10FFFF.
+   */
+  class CUTF8Validator
+  {
+    protected:
+
+    uint8_t iNeed = 0;
+
+    uint8_t iLo = 0x80;
+
+    uint8_t iHi = 0xBF;
+
+    bool iValid = true;
+
+    public:
+
+    void Reset(void)
+    {
+      iNeed = 0;
+      iLo = 0x80;
+      iHi = 0xBF;
+      iValid = true;
+    }
+
+    bool IsValid(void)
+    {
+      return iValid;
+    }
+
+    /*
+     * true if everything seen so far is valid and no
+     * multi byte sequence is left open
+     */
+    bool IsComplete(void)
+    {
+      return iValid && (iNeed == 0);
+    }
+
+    bool Update(const uint8_t *b, size_t n)
+    {
+      for (size_t i = 0; i < n && iValid; i++)
+      {
+        uint8_t c = b[i];
+
+        if (iNeed)
+        {
+          if (c < iLo || c > iHi)
+          {
+            iValid = false;
+            break;
+          }
+
+          iLo = 0x80, iHi = 0xBF;
+
+          iNeed--;
+        }
+        else if (c < 0x80)
+        {
+          continue;
+        }
+        else if (c >= 0xC2 && c <= 0xDF)
+        {
+          iNeed = 1;
+        }
+        else if (c >= 0xE0 && c <= 0xEF)
+        {
+          iNeed = 2;
+          if (c == 0xE0) iLo = 0xA0;
+          if (c == 0xED) iHi = 0x9F;
+        }
+        else if (c >= 0xF0 && c <= 0xF4)
+        {
+          iNeed = 3;
+          if (c == 0xF0) iLo = 0x90;
+          if (c == 0xF4) iHi = 0x8F;
+        }
+        else
+        {
+          iValid = false;
+        }
+      }
+
+      return iValid;
+    }
+  };
+
+  /*
+   * dst = src ^ key over n bytes, key phase starting at 0. If v is
+   * not null the unmasked bytes are validated in the same pass:
+   * blocks that are pure ASCII while no sequence is open are skipped
+   * with a single sign-bit test, only the rest goes through the
+   * scalar state machine. key may be null for unmasked frames.
+   */
+  inline bool UnmaskAndValidate(uint8_t *dst, const uint8_t *src, size_t n, const uint8_t *key, CUTF8Validator *v)
+  {
+    uint8_t k16[16];
+
+    for (int i = 0; i < 16; i++)
+    {
+      k16[i] = key ? key[i & 3] : 0;
+    }
+
+    size_t i = 0;
+
+    #ifdef NPL_UTF8_SSE2
+
+    __m128i k = _mm_loadu_si128((const __m128i *) k16);
+
+    for (; i + 16 <= n; i += 16)
+    {
+      __m128i x = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(src + i)), k);
+
+      _mm_storeu_si128((__m128i *)(dst + i), x);
+
+      if (v && (_mm_movemask_epi8(x) || !v->IsComplete()))
+      {
+        v->Update(dst + i, 16);
+      }
+    }
+
+    #else
+
+    uint64_t k8;
+
+    memmove(&k8, k16, 8);
+
+    for (; i + 8 <= n; i += 8)
+    {
+      uint64_t x;
+      memmove(&x, src + i, 8);
+      x ^= k8;
+      memmove(dst + i, &x, 8);
+
+      if (v && ((x & 0x8080808080808080ULL) || !v->IsComplete()))
+      {
+        v->Update(dst + i, 8);
+      }
+    }
+
+    #endif
+
+    size_t tail = i;
+
+    for (; i < n; i++)
+    {
+      dst[i] = src[i] ^ k16[i & 15];
+    }
+
+    if (v)
+    {
+      v->Update(dst + tail, n - tail);
+      return v->IsValid();
+    }
+
+    return true;
+  }
+}
+
+#endif //UTF8VALIDATOR_HPP
@@ -0,0 +1,399 @@
+#ifndef WSFRAMER_HPP
+#define WSFRAMER_HPP
+
+#include <CPipeline.hpp>
+#include <CProtocolWS.hpp>
+
+#include <string>
+#include <string_view>
+
+namespace NPL
+{
+  /*
+   * WebSocket stage for CPipeline : does the upgrade handshake (the
+   * client side sends it on connect, the server side answers it), then
+   * passes complete messages up and frames whatever comes down. Text
+   * payloads are UTF-8 checked while unmasking, fragments are joined,
+   * pings answered and a close frame closes the connection. The stage
+   * above sees Connected() once the handshake is done.
+   */
+  class CWSFramer : public CStage
+  {
+    public:
+
+    CWSFramer(const std::string& host = "", const std::string& path = "/")
+    {
+      iHost = host;
+      iPath = path;
+    }
+
+    /*
+     * opcode of the frames sent, 0x01 text (default) or 0x02 binary
+     */
+    void SetOpCode(uint8_t opcode)
+    {
+      iOpCode = opcode;
+    }
+
+    template <typename L>
+    void OnConnect(L& link)
+    {
+      if (link.IsClient())
+      {
+        SendClientHello(link);
+      }
+    }
+
+    template <typename L>
+    void OnRead(const uint8_t *b, size_t n, L& link)
+    {
+      if (iClosed)
+      {
+        return;
+      }
+
+      if (iRx.size())
+      {
+        iRx.append((const char *) b, n);
+        b = (const uint8_t *) iRx.data();
+        n = iRx.size();
+      }
+
+      size_t used = 0;
+
+      if (!iHandshakeDone)
+      {
+        used = Handshake(b, n, link);
+      }
+
+      while (iHandshakeDone && !iClosed && used < n)
+      {
+        size_t len = CWSMessage::GetFrameLength(b + used, n - used);
+
+        if (len == WS_FRAME_INVALID)
+        {
+          Fail(1002, link);
+          break;
+        }
+
+        if (!len || len > n - used)
+        {
+          break;
+        }
+
+        OnFrame(b + used, len, link);
+
+        used += len;
+      }
+
+      if (iClosed)
+      {
+        iRx.clear();
+      }
+      else if (iRx.size())
+      {
+        iRx.erase(0, used);
+      }
+      else
+      {
+        iRx.assign((const char *) b + used, n - used);
+      }
+    }
+
+    template <typename L>
+    void Write(const uint8_t *b, size_t n, L& link)
+    {
+      SendFrame(b, n, iOpCode, link);
+    }
+
+    protected:
+
+    std::string iHost;
+
+    std::string iPath;
+
+    uint8_t iOpCode = 0x01;
+
+    bool iHandshakeDone = false;
+
+    bool iClosed = false;
+
+    std::string iExpectedAccept;
+
+    std::string iRx;
+
+    std::string iTx;
+
+    std::string iPayload;
+
+    std::string iFragments;
+
+    uint8_t iFragmentOpCode = 0;
+
+    CUTF8Validator iUTF8;
+
+    CMaskPRNG iPRNG;
+
+    /*
+     * bytes used by the upgrade request or response, 0 until
+     * all of its headers are in
+     */
+    template <typename L>
+    size_t Handshake(const uint8_t *b, size_t n, L& link)
+    {
+      size_t end = std::string_view((const char *) b, n).find("\r\n\r\n");
+
+      if (end == std::string_view::npos)
+      {
+        return 0;
+      }
+
+      end += 4;
+
+      CHTTPMessage m(std::vector<uint8_t>(b, b + end));
+
+      if (link.IsClient())
+      {
+        if (m.GetStartLine().find(" 101") == std::string::npos ||
+            !m.HeaderHasToken("Upgrade", "websocket") ||
+            !m.HeaderHasToken("Connection", "Upgrade") ||
+            m.GetHeader("Sec-WebSocket-Accept") != iExpectedAccept)
+        {
+          std::cout << "CWSFramer upgrade rejected : " << m.GetStartLine() << "\n";
+          Close(link);
+          return end;
+        }
+      }
+      else
+      {
+        auto key = m.GetHeader("Sec-WebSocket-Key");
+
+        if (key.empty())
+        {
+          Close(link);
+          return end;
+        }
+
+        std::string sHello =
+          "HTTP/1.1 101 Switching Protocols\r\n"
+          "Upgrade: websocket\r\n"
+          "Connection: Upgrade\r\n"
+          "Sec-WebSocket-Accept: " + CProtocolWS::ComputeAccept(key) + "\r\n\r\n";
+
+        link.Down((const uint8_t *) sHello.data(), sHello.size());
+      }
+
+      iHandshakeDone = true;
+
+      link.Connected();
+
+      return end;
+    }
+
+    template <typename L>
+    void SendClientHello(L& link)
+    {
+      uint8_t nonce[16];
+
+      uint64_t r[2] = { iPRNG.Next(), iPRNG.Next() };
+
+      memmove(nonce, r, sizeof(nonce));
+
+      unsigned char key[32] = { '\0' };
+
+      Base64Encode(key, nonce, sizeof(nonce));
+
+      iExpectedAccept = CProtocolWS::ComputeAccept((char *) key);
+
+      std::string cHello =
+        "GET " + iPath + " HTTP/1.1\r\n"
+        "Host: " + iHost + "\r\n"
+        "Upgrade: websocket\r\n"
+        "Connection: Upgrade\r\n"
+        "Sec-WebSocket-Key: " + std::string((char *) key) + "\r\n"
+        "Sec-WebSocket-Version: 13\r\n\r\n";
+
+      link.Down((const uint8_t *) cHello.data(), cHello.size());
+    }
+
+    /*
+     * one complete frame of len bytes
+     */
+    template <typename L>
+    void OnFrame(const uint8_t *p, size_t len, L& link)
+    {
+      bool fin = (p[0] & 0x80);
+
+      uint8_t opcode = p[0] & 0x0F;
+
+      size_t indicator = p[1] & 0x7F;
+
+      size_t header = 2 + ((indicator == 126) ? 2 : (indicator == 127) ? 8 : 0);
+
+      const uint8_t *key = (p[1] & 0x80) ? p + header : nullptr;
+
+      if (key)
+      {
+        header += 4;
+      }
+
+      if (len < header)
+      {
+        Fail(1002, link);
+        return;
+      }
+
+      size_t l = len - header;
+
+      CUTF8Validator *v = nullptr;
+
+      if (opcode == 0x01)
+      {
+        iUTF8.Reset();
+        v = &iUTF8;
+      }
+      else if (opcode == 0x00 && iFragmentOpCode == 0x01)
+      {
+        v = &iUTF8;
+      }
+
+      iPayload.resize(l);
+
+      bool valid = UnmaskAndValidate((uint8_t *) iPayload.data(), p + header, l, key, v);
+
+      if (v && fin)
+      {
+        valid = v->IsComplete();
+      }
+
+      if (!valid)
+      {
+        Fail(1007, link);
+        return;
+      }
+
+      if (opcode & 0x08)
+      {
+        if (opcode == 0x08)
+        {
+          iClosed = true;
+          SendFrame((const uint8_t *) iPayload.data(), std::min<size_t>(l, 2), 0x08, link);
+          Close(link);
+        }
+        else if (opcode == 0x09)
+        {
+          SendFrame((const uint8_t *) iPayload.data(), l, 0x0A, link);
+        }
+
+        return;
+      }
+
+      if (!fin || opcode == 0x00)
+      {
+        if (opcode)
+        {
+          iFragmentOpCode = opcode;
+          iFragments = iPayload;
+        }
+        else
+        {
+          iFragments += iPayload;
+        }
+
+        if (fin)
+        {
+          iFragmentOpCode = 0;
+          link.Up((const uint8_t *) iFragments.data(), iFragments.size());
+        }
+
+        return;
+      }
+
+      link.Up((const uint8_t *) iPayload.data(), l);
+    }
+
+    /*
+     * client frames are masked (rfc 6455 5.3)
+     */
+    template <typename L>
+    void SendFrame(const uint8_t *b, size_t n, uint8_t opcode, L& link)
+    {
+      uint8_t frame[14];
+
+      size_t hl = 2;
+
+      frame[0] = 0x80 | opcode;
+
+      if (n <= 125)
+      {
+        frame[1] = (uint8_t) n;
+      }
+      else if (n <= 0xFFFF)
+      {
+        frame[1] = 126;
+        LTOB(n, frame + 2, 2);
+        hl += 2;
+      }
+      else
+      {
+        frame[1] = 127;
+        LTOB(n, frame + 2, 8);
+        hl += 8;
+      }
+
+      bool mask = link.IsClient();
+
+      uint32_t key = 0;
+
+      if (mask)
+      {
+        frame[1] |= 0x80;
+        key = (uint32_t) iPRNG.Next();
+        memmove(frame + hl, &key, 4);
+        hl += 4;
+      }
+
+      iTx.resize(hl + n);
+
+      memmove(iTx.data(), frame, hl);
+
+      if (mask)
+      {
+        CProtocolWS::MaskPayload((uint8_t *) iTx.data() + hl, b, n, key);
+      }
+      else
+      {
+        memmove(iTx.data() + hl, b, n);
+      }
+
+      link.Down((const uint8_t *) iTx.data(), iTx.size());
+    }
+
+    /*
+     * rfc 6455 7.1.7, 1007 for invalid utf-8, 1002 for a frame
+     * length that is not valid
+     */
+    template <typename L>
+    void Fail(uint16_t code, L& link)
+    {
+      uint8_t status[2];
+
+      LTOB(code, status, 2);
+
+      iClosed = true;
+
+      SendFrame(status, 2, 0x08, link);
+
+      Close(link);
+    }
+
+    template <typename L>
+    void Close(L& link)
+    {
+      iClosed = true;
+      link.Close();
+    }
+  };
+}
+
+#endif //WSFRAMER_HPP
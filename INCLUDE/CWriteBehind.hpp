@@ -0,0 +1,307 @@
+#ifndef WRITEBEHIND_HPP
+#define WRITEBEHIND_HPP
+
+#include <CDevice.hpp>
+#include <CBufferPool.hpp>
+
+#include <deque>
+#include <mutex>
+#include <string>
+#include <cstring>
+#include <algorithm>
+
+namespace NPL
+{
+  constexpr uint32_t WRITE_BEHIND_BLOCK_SIZE = (1 * 1024 * 1024);
+
+  /*
+   * Double buffered write-behind for a file device. Sequential writes
+   * are gathered into aligned blocks and a block is written on the
+   * dispatcher's file I/O engine while the other one fills. Nothing
+   * here waits: a write that finds both blocks busy is held in memory
+   * and IsBlocked() tells the caller to stop reading. Each block
+   * written is completed to the device as a WRITE context, whoever
+   * observes the device passes its length to OnWritten(), which
+   * moves the held data on and starts the next block. A write that
+   * does not continue the current block seals that block first.
+   */
+  class CWriteBehind
+  {
+    public:
+
+    CWriteBehind(SPCDevice device, size_t block = WRITE_BEHIND_BLOCK_SIZE) :
+      iDevice(device),
+      iPool(std::make_shared<CBufferPool>(2, block))
+    {
+      iBlockSize = block;
+    }
+
+    /*
+     * the block in flight completes on its own, the pool outlives
+     * it; data not yet handed to the engine is dropped, so Flush()
+     * and wait for IsIdle() first to keep it
+     */
+    virtual ~CWriteBehind()
+    {
+      for (auto& p : iReady)
+      {
+        iPool->Put(p.iBlock);
+      }
+
+      if (iBlock)
+      {
+        iPool->Put(iBlock);
+      }
+    }
+
+    CWriteBehind(const CWriteBehind&) = delete;
+
+    CWriteBehind& operator=(const CWriteBehind&) = delete;
+
+    virtual bool Write(const uint8_t *b, size_t n, uint64_t o)
+    {
+      std::lock_guard<std::mutex> lg(iLock);
+
+      iFlushing = false;
+
+      if (iHeld.empty())
+      {
+        size_t c = Fill(b, n, o);
+
+        b += c;
+        o += c;
+        n -= c;
+      }
+
+      if (n)
+      {
+        if (iHeld.size() && iHeld.back().first + iHeld.back().second.size() == o)
+        {
+          iHeld.back().second.append((const char *) b, n);
+        }
+        else
+        {
+          iHeld.emplace_back(o, std::string((const char *) b, n));
+        }
+      }
+
+      return !iFailed;
+    }
+
+    /*
+     * seals the partial block, the data is in the file once
+     * IsIdle() turns true
+     */
+    virtual bool Flush(void)
+    {
+      std::lock_guard<std::mutex> lg(iLock);
+
+      iFlushing = true;
+
+      if (iBlock)
+      {
+        Seal();
+      }
+
+      return !iFailed;
+    }
+
+    /*
+     * the WRITE completion of a block, n is what the engine wrote
+     */
+    virtual void OnWritten(size_t n)
+    {
+      std::lock_guard<std::mutex> lg(iLock);
+
+      if (!iInFlight)
+      {
+        return;
+      }
+
+      if (n != iInFlight)
+      {
+        iFailed = true;
+      }
+
+      iInFlight = 0;
+
+      while (iHeld.size())
+      {
+        auto& [o, data] = iHeld.front();
+
+        size_t c = Fill((const uint8_t *) data.data(), data.size(), o);
+
+        if (c < data.size())
+        {
+          data.erase(0, c);
+          o += c;
+          break;
+        }
+
+        iHeld.pop_front();
+      }
+
+      if (iFlushing && iBlock && iHeld.empty())
+      {
+        Seal();
+      }
+
+      Submit();
+    }
+
+    /*
+     * the caller should stop producing until a completion comes in
+     */
+    virtual bool IsBlocked(void)
+    {
+      std::lock_guard<std::mutex> lg(iLock);
+
+      return iHeld.size() || (!iBlock && iReady.size() + (iInFlight ? 1 : 0) == iPool->GetCount());
+    }
+
+    virtual bool IsIdle(void)
+    {
+      std::lock_guard<std::mutex> lg(iLock);
+
+      return !iBlock && !iInFlight && iReady.empty() && iHeld.empty();
+    }
+
+    virtual bool Failed(void)
+    {
+      std::lock_guard<std::mutex> lg(iLock);
+
+      return iFailed;
+    }
+
+    protected:
+
+    struct TBlock
+    {
+      uint8_t *iBlock;
+      uint64_t iOffset;
+      size_t   iLength;
+    };
+
+    SPCDevice iDevice;
+
+    std::shared_ptr<CBufferPool> iPool;
+
+    size_t iBlockSize;
+
+    uint8_t *iBlock = nullptr;
+
+    uint64_t iOffset = 0;
+
+    size_t iFill = 0;
+
+    std::deque<TBlock> iReady;
+
+    std::deque<std::pair<uint64_t, std::string>> iHeld;
+
+    std::mutex iLock;
+
+    size_t iInFlight = 0;
+
+    bool iFlushing = false;
+
+    bool iFailed = false;
+
+    /*
+     * copies into blocks while there are free ones, returns
+     * how much was taken
+     */
+    size_t Fill(const uint8_t *b, size_t n, uint64_t o)
+    {
+      size_t taken = 0;
+
+      if (iBlock && o != iOffset + iFill)
+      {
+        Seal();
+      }
+
+      while (n)
+      {
+        if (!iBlock)
+        {
+          iBlock = iPool->Get();
+
+          if (!iBlock)
+          {
+            break;
+          }
+
+          iOffset = o;
+          iFill = 0;
+        }
+
+        size_t c = std::min(n, iBlockSize - iFill);
+
+        memcpy(iBlock + iFill, b, c);
+
+        iFill += c;
+        b += c;
+        o += c;
+        n -= c;
+        taken += c;
+
+        if (iFill == iBlockSize)
+        {
+          Seal();
+        }
+      }
+
+      return taken;
+    }
+
+    void Seal(void)
+    {
+      iReady.push_back({iBlock, iOffset, iFill});
+
+      iBlock = nullptr;
+      iFill = 0;
+
+      Submit();
+    }
+
+    /*
+     * one block at most is in flight, the device never sees two
+     * writes at a time, which WriteSync on Windows, a seek and a
+     * write on one handle, depends on. The job holds the device
+     * and the pool, not this. A block the engine does not take is
+     * written inline and completed the same way.
+     */
+    void Submit(void)
+    {
+      if (iInFlight || iReady.empty())
+      {
+        return;
+      }
+
+      auto p = iReady.front();
+
+      iReady.pop_front();
+
+      iInFlight = p.iLength;
+
+      auto job = [device = iDevice, pool = iPool, p] () {
+        int32_t rc = device->WriteSync(p.iBlock, p.iLength, p.iOffset);
+
+        pool->Put(p.iBlock);
+
+        Context *ctx = (Context *) calloc(1, sizeof(Context));
+
+        ctx->type = EIOTYPE::WRITE;
+        ctx->n = rc > 0 ? rc : 0;
+
+        device->QueuePendingContext(device, ctx);
+      };
+
+      if (!iDevice->SubmitFileIO(job))
+      {
+        job();
+      }
+    }
+  };
+}
+
+#endif //WRITEBEHIND_HPP
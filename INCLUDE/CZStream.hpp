@@ -0,0 +1,153 @@
+#ifndef ZSTREAM_HPP
+#define ZSTREAM_HPP
+
+#include <string>
+#include <cstdint>
+#include <iostream>
+
+#include <zlib.h>
+
+namespace NPL
+{
+  enum class ZMode : uint8_t
+  {
+    Deflate = 0,
+    Inflate
+  };
+
+  struct ZStats
+  {
+    uint64_t iRaw = 0;      // uncompressed bytes
+    uint64_t iWire = 0;     // compressed bytes
+
+    double Ratio(void) const
+    {
+      return iWire ? static_cast<double>(iRaw) / iWire : 0.0;
+    }
+  };
+
+  /*
+   * Streaming zlib deflate or inflate. The z_stream is initialized
+   * once and only reset between transfers, so its window and state
+   * allocations are reused. Totals are kept across resets.
+   */
+  class CZStream
+  {
+    public:
+
+    CZStream(ZMode mode, int level = Z_DEFAULT_COMPRESSION) : iMode(mode)
+    {
+      int rc = (iMode == ZMode::Deflate) ?
+                 deflateInit(&iZ, level) :
+                 inflateInit(&iZ);
+
+      iOk = (rc == Z_OK);
+
+      if (!iOk)
+      {
+        std::cout << "CZStream init failed : " << rc << "\n";
+      }
+    }
+
+    ~CZStream()
+    {
+      if (iOk)
+      {
+        (iMode == ZMode::Deflate) ? deflateEnd(&iZ) : inflateEnd(&iZ);
+      }
+    }
+
+    CZStream(const CZStream&) = delete;
+
+    CZStream& operator=(const CZStream&) = delete;
+
+    void Reset(void)
+    {
+      if (iOk)
+      {
+        (iMode == ZMode::Deflate) ? deflateReset(&iZ) : inflateReset(&iZ);
+      }
+
+      iEnd = false;
+    }
+
+    /*
+     * compresses or decompresses n bytes of b, appending the output
+     * to out; finish flushes a deflate stream. Returns false on a
+     * corrupt inflate stream.
+     */
+    bool Process(const uint8_t *b, size_t n, std::string& out, bool finish = false)
+    {
+      if (!iOk) return false;
+
+      if (iEnd) return true;
+
+      iZ.next_in = const_cast<Bytef *>(b);
+      iZ.avail_in = static_cast<uInt>(n);
+
+      int flush = finish ? Z_FINISH : Z_NO_FLUSH;
+
+      do
+      {
+        uint8_t chunk[16 * 1024];
+
+        iZ.next_out = chunk;
+        iZ.avail_out = sizeof(chunk);
+
+        int rc = (iMode == ZMode::Deflate) ? deflate(&iZ, flush) : inflate(&iZ, Z_NO_FLUSH);
+
+        if (rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR)
+        {
+          std::cout << "CZStream error : " << rc << "\n";
+          return false;
+        }
+
+        size_t produced = sizeof(chunk) - iZ.avail_out;
+
+        out.append((const char *) chunk, produced);
+
+        if (iMode == ZMode::Deflate)
+        {
+          iStats.iWire += produced;
+        }
+        else
+        {
+          iStats.iRaw += produced;
+        }
+
+        if (rc == Z_STREAM_END)
+        {
+          iEnd = true;
+          break;
+        }
+
+      } while (iZ.avail_out == 0);
+
+      if (iMode == ZMode::Deflate)
+        iStats.iRaw += n;
+      else
+        iStats.iWire += n - iZ.avail_in;
+
+      return true;
+    }
+
+    const ZStats& GetStats(void)
+    {
+      return iStats;
+    }
+
+    protected:
+
+    ZMode iMode;
+
+    z_stream iZ = {};
+
+    bool iOk = false;
+
+    bool iEnd = false;
+
+    ZStats iStats;
+  };
+}
+
+#endif //ZSTREAM_HPP
@@ -12,7 +12,7 @@
   #include <arpa/inet.h>
   using FD = int;
   using SOCKET = int;
-  #define closesocket close;
+  #define closesocket close
 
 #else
 
@@ -1,51 +1,52 @@
-#include <npl.hpp>
+#include <CFileCopy.hpp>
 #include <osl.hpp>
 
 #include <memory>
+#include <string>
 #include <iostream>
 
-constexpr int BUFSIZE = (1 * 1024 * 1024);
-
+/*
+ * TestCopy <source> <target> [depth] [chunk KB]
+ */
 int main(int argc, char* argv[])
 {
   auto arguments = OSL::GetArgumentsVector(argc, argv);
 
-  auto rd = NPL::make_file(arguments[0]);
-  rd->SetProperty("name", "rd");
+  if (arguments.size() < 2)
+  {
+    std::cout << "usage : TestCopy <source> <target> [depth] [chunk KB]\n";
+    return 1;
+  }
+
+  size_t depth = (arguments.size() > 2) ? std::stoul(arguments[2]) : 8;
 
-  auto wd = NPL::make_file(arguments[1], true);
-  wd->SetProperty("name", "wd");
+  size_t chunk = (arguments.size() > 3) ? std::stoul(arguments[3]) * 1024 : (1 * 1024 * 1024);
 
-  uint8_t *buf = (uint8_t *) calloc(BUFSIZE, 1);
+  auto copy = std::make_shared<NPL::CFileCopy>(depth, chunk);
 
-  auto obv = std::make_shared<NPL::CListener>(
-    nullptr,
-    [wd, off = 0ULL](const uint8_t *b, size_t n) mutable
+  uint64_t reported = 0;
+
+  bool started = copy->Start(arguments[0], arguments[1],
+    [](bool ok, const NPL::CopyStats& stats)
     {
-      std::cout << "onread " << n << ", off " << off << "\n";
-      if (n)
-      {
-        wd->Write(b, n, off);
-      }
-      off += n;
+      std::cout << (ok ? "copied " : "failed after ") << stats.iBytes << " of " << stats.iTotal 
+                << " bytes in " << stats.iSeconds << " s, " << stats.MBps() << " MB/s"
+                << ", method " << static_cast<int>(stats.iMethod) << "\n";
     },
-    [rd, off = 0ULL](const uint8_t *b, size_t n) mutable
+    [&reported](const NPL::CopyStats& stats)
     {
-      std::cout << "onwrite " << n << ", off " << off << "\n";
-      if (n)
+      if (stats.iBytes - reported >= (256ULL << 20))
       {
-        rd->Read(b, BUFSIZE, off += n);
+        reported = stats.iBytes;
+        std::cout << stats.iBytes << " / " << stats.iTotal << ", " << stats.MBps() << " MB/s\n";
       }
     });
 
-  obv->SetProperty("name", "observer");
-
-  rd->AddEventListener(obv);
-  wd->AddEventListener(obv);
-
-  rd->Read(buf, BUFSIZE, 0);
-
-  getchar();
+  if (!started)
+  {
+    std::cout << "failed to open " << arguments[0] << " or " << arguments[1] << "\n";
+    return 1;
+  }
 
-  return 0;
-}
\ No newline at end of file
+  return copy->Wait() ? 0 : 1;
+}
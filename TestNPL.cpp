@@ -1,18 +1,49 @@
 #include <npl.hpp>
 #include <osl.hpp>
 
+#include <cstdio>
+#include <thread>
+#include <future>
+#include <fstream>
 #include <iostream>
 
 void test_ws_server(const std::string& host, int port);
+void test_ws_client(const std::string& host, int port);
 void test_ftp_client(const std::string& host, int port);
 void test_http_client(const std::string& host, int port);
+int test_utf8_validator(void);
+int test_ws_frame_length(void);
+int test_ftp_reply_parser(void);
+int test_ftp_list_parser(void);
+int test_ftp_mirror_names(void);
+int test_token_bucket(void);
+int test_zstream(void);
+int test_checksum(void);
+int test_ws_framer(void);
+int test_write_behind(void);
+int test_ftp_pipeline(void);
+int test_ws_send_queue(void);
+int test_subject_bindings(void);
+int test_ftp_resume(void);
+int test_ftp_segments(void);
+int test_ftp_pool(void);
+int test_file_copy(void);
+int test_ftp_upload_flow(void);
+int test_ftp_download_flow(void);
+int selftest(void);
 
 int main(int argc, char *argv[])
 {
+  if (argc == 2 && std::string(argv[1]) == "selftest")
+  {
+    return selftest();
+  }
+
   if (argc != 3)
   {
     LOG << "usage : Agent <host> <port>\n";
     LOG << "usage : Agent 0.0.0.0 8081\n";
+    LOG << "usage : Agent selftest\n";
     return 0;
   }
 
@@ -21,6 +52,7 @@ int main(int argc, char *argv[])
 
   //test_ftp_client(host, port);
   test_ws_server(host, port);
+  //test_ws_client(host, port);
   //test_http_client(host, port);
 
   getchar();
@@ -72,6 +104,36 @@ void test_ws_server(const std::string& host, int port)
   getchar();
 }
 
+void test_ws_client(const std::string& host, int port)
+{
+  for (int i = 0; i < 100; i++)
+  {
+    auto ws = NPL::make_ws_client(
+      host, port, NPL::TLS::No,
+      [] (NPL::SPCProtocol, const std::string& m)
+      {
+        std::cout << "server : " << m << "\n";
+      }
+    );
+
+    /**
+     * The connect callback is invoked once the websocket
+     * upgrade handshake has been validated
+     */
+    ws->StartClient(
+      [](auto p)
+      {
+        p->SendProtocolMessage(
+          (uint8_t *)"client : hello", 
+          strlen("client : hello")
+        );
+      }
+    );
+  }
+
+  getchar();
+}
+
 void test_ftp_client(const std::string& host, int port)
 {
   /**
@@ -174,3 +236,1418 @@ void test_ftp_client(const std::string& host, int port)
 
   getchar();  
 }
+
+/*
+ * the drivers below need no server; "Agent selftest" runs them
+ * all and exits non zero if any check failed
+ */
+int selftest(void)
+{
+  int failed = 0;
+
+  failed += test_utf8_validator();
+  failed += test_ws_frame_length();
+  failed += test_ftp_reply_parser();
+  failed += test_ftp_list_parser();
+  failed += test_ftp_mirror_names();
+  failed += test_token_bucket();
+  failed += test_zstream();
+  failed += test_checksum();
+  failed += test_ws_framer();
+  failed += test_write_behind();
+  failed += test_ftp_pipeline();
+  failed += test_ws_send_queue();
+  failed += test_subject_bindings();
+  failed += test_ftp_resume();
+  failed += test_ftp_segments();
+  failed += test_ftp_pool();
+  failed += test_file_copy();
+  failed += test_ftp_upload_flow();
+  failed += test_ftp_download_flow();
+
+  std::cout << "selftest : " << failed << " failed\n";
+
+  return failed ? 1 : 0;
+}
+
+static int check(const char *what, bool ok)
+{
+  std::cout << (ok ? "PASS " : "FAIL ") << what << "\n";
+  return ok ? 0 : 1;
+}
+
+static int report(const char *driver, int failed)
+{
+  std::cout << driver << " : " << failed << " failed\n";
+  return failed;
+}
+
+int test_utf8_validator(void)
+{
+  auto valid = [] (const std::string& s, size_t split) {
+    NPL::CUTF8Validator v;
+    v.Update((const uint8_t *) s.data(), split);
+    v.Update((const uint8_t *) s.data() + split, s.size() - split);
+    return v.IsComplete();
+  };
+
+  std::string euro = "price \xE2\x82\xAC 10, \xF0\x9F\x98\x80 ok";
+
+  int failed = 0;
+
+  /**
+   * a code point split between two updates, at every position
+   */
+  for (size_t i = 0; i <= euro.size(); i++)
+  {
+    failed += check("utf8 split sequence", valid(euro, i));
+  }
+
+  failed += check("utf8 overlong rejected", !valid("\xC0\xAF", 1));
+  failed += check("utf8 surrogate rejected", !valid("\xED\xA0\x80", 2));
+  failed += check("utf8 above U+10FFFF rejected", !valid("\xF4\x90\x80\x80", 2));
+  failed += check("utf8 open sequence incomplete", !valid("ab\xE2\x82", 3));
+
+  /**
+   * masked SIMD path against the plain xor, with a non ASCII tail
+   */
+  std::string text(64, 'a');
+  text += euro;
+
+  const uint8_t key[4] = { 0x12, 0x34, 0x56, 0x78 };
+
+  std::string masked(text.size(), '\0'), unmasked(text.size(), '\0');
+
+  for (size_t i = 0; i < text.size(); i++)
+  {
+    masked[i] = text[i] ^ key[i & 3];
+  }
+
+  NPL::CUTF8Validator v;
+
+  bool ok = NPL::UnmaskAndValidate((uint8_t *) unmasked.data(), (const uint8_t *) masked.data(), masked.size(), key, &v);
+
+  failed += check("utf8 unmask and validate", ok && v.IsComplete() && unmasked == text);
+
+  return report("test_utf8_validator", failed);
+}
+
+int test_ws_frame_length(void)
+{
+  auto length = [] (std::initializer_list<uint8_t> frame) {
+    std::vector<uint8_t> b(frame);
+    return NPL::CWSMessage::GetFrameLength(b.data(), b.size());
+  };
+
+  int failed = 0;
+
+  failed += check("ws 7 bit length", length({ 0x82, 0x05 }) == 7);
+  failed += check("ws masked 16 bit length", length({ 0x82, 0xFE, 0x01, 0x00 }) == 2 + 4 + 2 + 256);
+  failed += check("ws 64 bit length", length({ 0x82, 0x7F, 0, 0, 0, 0, 0, 1, 0, 0 }) == 10 + 65536);
+  failed += check("ws partial header", length({ 0x82, 0x7F, 0, 0 }) == 0);
+
+  /**
+   * a length that wraps the total, and one with the most
+   * significant bit set
+   */
+  failed += check("ws wrapping length", 
+    length({ 0x82, 0x7F, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFB }) == NPL::WS_FRAME_INVALID);
+  failed += check("ws length msb set", 
+    length({ 0x82, 0x7F, 0x80, 0, 0, 0, 0, 0, 0, 0 }) == NPL::WS_FRAME_INVALID);
+
+  return report("test_ws_frame_length", failed);
+}
+
+int test_ftp_reply_parser(void)
+{
+  std::vector<NPL::SPCFTPMessage> replies;
+
+  NPL::CFTPReplyParser parser;
+
+  std::string input =
+    "220-Welcome\r\n"
+    "230 is not the end of this one\r\n"
+    " 220 nor this\r\n"
+    "220 ready\r\n"
+    "331 password required\r\n"
+    "230 logged in\n";
+
+  /**
+   * fed a byte at a time, replies must come out the same as in
+   * one piece
+   */
+  for (auto& c : input)
+  {
+    parser.Feed((const uint8_t *) &c, 1, [&replies] (NPL::SPCFTPMessage m) {
+      replies.push_back(m);
+    });
+  }
+
+  int failed = 0;
+
+  failed += check("ftp reply count", replies.size() == 3);
+
+  if (replies.size() == 3)
+  {
+    failed += check("ftp multiline code", replies[0]->GetCode() == 220);
+    failed += check("ftp multiline lines", replies[0]->GetLineCount() == 4);
+    failed += check("ftp multiline last line", replies[0]->GetLine(3) == "220 ready");
+    failed += check("ftp single line", replies[1]->GetCode() == 331 && replies[1]->GetLine(0) == "331 password required");
+    failed += check("ftp bare LF", replies[2]->GetCode() == 230 && replies[2]->GetLine(0) == "230 logged in");
+  }
+
+  replies.clear();
+
+  std::string two = "200 TYPE set\r\n227 Entering Passive Mode (127,0,0,1,4,1)\r\n";
+
+  parser.Feed((const uint8_t *) two.data(), two.size(), [&replies] (NPL::SPCFTPMessage m) {
+    replies.push_back(m);
+  });
+
+  failed += check("ftp two replies in one read", replies.size() == 2 && replies[1]->GetCode() == 227);
+
+  return report("test_ftp_reply_parser", failed);
+}
+
+int test_ftp_list_parser(void)
+{
+  struct Entry
+  {
+    std::string name;
+    uint64_t size;
+    NPL::FTPEntryType type;
+  };
+
+  std::vector<Entry> entries;
+
+  int batches = 0;
+
+  bool last = false, outcome = false;
+
+  /**
+   * names are only valid during the callback, they are copied
+   */
+  auto cbk = [&] (const std::vector<NPL::FTPEntry>& batch, bool l, bool ok) {
+    for (auto& e : batch)
+    {
+      entries.push_back({ std::string(e.iName), e.iSize, e.iType });
+    }
+    batches++;
+    last = l;
+    outcome = ok;
+    return true;
+  };
+
+  int failed = 0;
+
+  {
+    NPL::CFTPListParser parser(true, cbk, 2);
+
+    std::string mlsd =
+      "type=cdir;modify=20240101000000; .\r\n"
+      "type=file;size=1234;modify=20240102030405; a file.txt\r\n"
+      "type=dir;modify=20240101000000; sub\r\n"
+      "type=file;size=7; last";
+
+    /**
+     * split in the middle of lines
+     */
+    for (size_t i = 0; i < mlsd.size(); i += 5)
+    {
+      parser.Feed(mlsd.data() + i, std::min<size_t>(5, mlsd.size() - i));
+    }
+
+    parser.Finish();
+
+    failed += check("mlsd entries", entries.size() == 3);
+
+    if (entries.size() == 3)
+    {
+      failed += check("mlsd name with space", entries[0].name == "a file.txt" && entries[0].size == 1234);
+      failed += check("mlsd dir", entries[1].name == "sub" && entries[1].type == NPL::FTPEntryType::Dir);
+      failed += check("mlsd unterminated last line", entries[2].name == "last" && entries[2].size == 7);
+    }
+
+    failed += check("mlsd batches", batches == 2 && last && outcome);
+  }
+
+  entries.clear();
+  batches = 0;
+
+  {
+    NPL::CFTPListParser parser(false, cbk);
+
+    std::string list =
+      "total 8\r\n"
+      "drwxr-xr-x    2 user     group        4096 Jan 01  2023 dir\r\n"
+      "-rw-r--r--    1 user     group       12345 Mar 15 10:30 name with spaces\r\n"
+      "lrwxrwxrwx    1 user     group           7 Feb 02  2022 link -> target\r\n"
+      "01-02-23  01:30PM       <DIR>          dosdir\r\n"
+      "01-02-23  09:15AM                  42 dos.txt\r\n";
+
+    parser.Feed(list.data(), list.size());
+
+    /**
+     * a listing that did not complete
+     */
+    parser.Finish(false);
+
+    failed += check("list entries", entries.size() == 5);
+
+    if (entries.size() == 5)
+    {
+      failed += check("list dir", entries[0].name == "dir" && entries[0].type == NPL::FTPEntryType::Dir);
+      failed += check("list file", entries[1].name == "name with spaces" && entries[1].size == 12345);
+      failed += check("list link", entries[2].name == "link" && entries[2].type == NPL::FTPEntryType::Link);
+      failed += check("list dos dir", entries[3].name == "dosdir" && entries[3].type == NPL::FTPEntryType::Dir);
+      failed += check("list dos file", entries[4].name == "dos.txt" && entries[4].size == 42);
+    }
+
+    failed += check("list failed outcome", last && !outcome);
+  }
+
+  return report("test_ftp_list_parser", failed);
+}
+
+/**
+ * the listing side of CFTPMirror, without a session
+ */
+struct TestMirror : public NPL::CFTPMirror
+{
+  using CFTPMirror::CFTPMirror;
+  using CFTPMirror::OnRemoteEntries;
+  using CFTPMirror::iScans;
+  using CFTPMirror::iTransfers;
+};
+
+int test_ftp_mirror_names(void)
+{
+  auto local = (std::filesystem::temp_directory_path() / "npl-mirror-names").string();
+
+  std::filesystem::create_directories(local);
+
+  auto mirror = std::make_shared<TestMirror>(nullptr);
+
+  std::vector<NPL::FTPEntry> entries = {
+    { "ok.txt", 1, -1, NPL::FTPEntryType::File },
+    { "../../.bashrc", 1, -1, NPL::FTPEntryType::File },
+    { "a/b", 1, -1, NPL::FTPEntryType::File },
+    { "/etc/passwd", 1, -1, NPL::FTPEntryType::File },
+    { "..", 0, -1, NPL::FTPEntryType::Dir },
+    { "sub", 0, -1, NPL::FTPEntryType::Dir }
+  };
+
+  mirror->OnRemoteEntries({ "/pub", local, false }, entries);
+
+  int failed = 0;
+
+  failed += check("mirror safe file queued", mirror->iTransfers.size() == 1 &&
+    mirror->iTransfers[0].iLocal == (std::filesystem::path(local) / "ok.txt").string());
+  failed += check("mirror safe dir queued", mirror->iScans.size() == 1 && mirror->iScans[0].iRemote == "/pub/sub");
+  failed += check("mirror unsafe names failed", mirror->GetStats().iFilesFailed == 4);
+
+  std::filesystem::remove_all(local);
+
+  return report("test_ftp_mirror_names", failed);
+}
+
+int test_token_bucket(void)
+{
+  int failed = 0;
+
+  auto b = std::make_shared<NPL::CTokenBucket>(1000, 100);
+
+  failed += check("bucket starts full", b->Available() == 100);
+
+  b->Consume(150);
+
+  failed += check("bucket overdrawn", b->Available() == 0);
+
+  uint32_t ms = b->DelayMs(100);
+
+  failed += check("bucket delay pays the debt", ms >= 140 && ms <= 151);
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(ms + 10));
+
+  failed += check("bucket refilled", b->Available() == 100);
+
+  /**
+   * an unlimited child has what its parent has and
+   * consumes from it
+   */
+  auto parent = std::make_shared<NPL::CTokenBucket>(1000, 100);
+  auto child = std::make_shared<NPL::CTokenBucket>(0, 0, parent);
+
+  failed += check("child limited by parent", child->Available() == 100);
+
+  child->Consume(60);
+
+  failed += check("parent charged by child", parent->Available() <= 41);
+
+  failed += check("unlimited", NPL::CTokenBucket(0).Available() == SIZE_MAX);
+
+  return report("test_token_bucket", failed);
+}
+
+int test_zstream(void)
+{
+  std::string data;
+
+  for (int i = 0; i < 20000; i++)
+  {
+    data += "line " + std::to_string(i % 97) + " of some compressible text\n";
+  }
+
+  NPL::CZStream deflater(NPL::ZMode::Deflate);
+  NPL::CZStream inflater(NPL::ZMode::Inflate);
+
+  std::string wire, out;
+
+  int failed = 0;
+
+  bool ok = true;
+
+  for (size_t i = 0; i < data.size(); i += 4096)
+  {
+    size_t n = std::min<size_t>(4096, data.size() - i);
+    ok = ok && deflater.Process((const uint8_t *) data.data() + i, n, wire, i + n == data.size());
+  }
+
+  failed += check("deflate", ok && wire.size() < data.size());
+
+  /**
+   * inflated in pieces that do not line up with the deflate blocks
+   */
+  for (size_t i = 0; ok && i < wire.size(); i += 1000)
+  {
+    ok = inflater.Process((const uint8_t *) wire.data() + i, std::min<size_t>(1000, wire.size() - i), out);
+  }
+
+  failed += check("inflate round trip", ok && out == data);
+
+  failed += check("stats", deflater.GetStats().iRaw == data.size() && deflater.GetStats().iWire == wire.size() &&
+                           inflater.GetStats().iRaw == data.size());
+
+  NPL::CZStream bad(NPL::ZMode::Inflate);
+
+  std::string garbage = "this is not a zlib stream", ignored;
+
+  failed += check("corrupt stream", !bad.Process((const uint8_t *) garbage.data(), garbage.size(), ignored));
+
+  return report("test_zstream", failed);
+}
+
+int test_checksum(void)
+{
+  auto digest = [] (NPL::ChecksumType type, const std::string& s, size_t split) {
+    NPL::CChecksum c(type);
+    c.Update((const uint8_t *) s.data(), split);
+    c.Update((const uint8_t *) s.data() + split, s.size() - split);
+    return c.GetDigest();
+  };
+
+  std::string check_str = "123456789";
+
+  int failed = 0;
+
+  /**
+   * the published check values, fed in two parts
+   */
+  failed += check("crc32", digest(NPL::ChecksumType::CRC32, check_str, 4) == "cbf43926");
+  failed += check("crc32c", digest(NPL::ChecksumType::CRC32C, check_str, 4) == "e3069283");
+  failed += check("xxh64 empty", digest(NPL::ChecksumType::XXH64, "", 0) == "ef46db3751d8e999");
+  failed += check("xxh64 abc", digest(NPL::ChecksumType::XXH64, "abc", 1) == "44bc2cf5ad770999");
+
+  /**
+   * the xxh64 stripes of 32 bytes and the buffered tail
+   */
+  std::string big(1000, '\0');
+
+  for (size_t i = 0; i < big.size(); i++)
+  {
+    big[i] = (char) (i * 7);
+  }
+
+  auto whole = digest(NPL::ChecksumType::XXH64, big, 0);
+
+  bool same = true;
+
+  for (size_t split : { 1, 31, 32, 33, 500, 999 })
+  {
+    same = same && (digest(NPL::ChecksumType::XXH64, big, split) == whole);
+  }
+
+  failed += check("xxh64 split", same);
+
+  return report("test_checksum", failed);
+}
+
+/**
+ * stands in for CPipeline::Link below and above a single stage
+ */
+struct TestLink
+{
+  bool iClient = false;
+  bool iConnected = false;
+  bool iClosed = false;
+  std::string iUp;
+  std::string iDown;
+
+  void Up(const uint8_t *b, size_t n) { iUp.append((const char *) b, n); }
+  void Down(const uint8_t *b, size_t n) { iDown.append((const char *) b, n); }
+  void Reply(const uint8_t *b, size_t n) { Down(b, n); }
+  void Connected(void) { iConnected = true; }
+  void Disconnected(void) { iConnected = false; }
+  void Close(void) { iClosed = true; }
+  bool IsClient(void) { return iClient; }
+};
+
+int test_ws_framer(void)
+{
+  auto feed = [] (NPL::CWSFramer& f, TestLink& link, const std::string& s) {
+    f.OnRead((const uint8_t *) s.data(), s.size(), link);
+  };
+
+  auto masked = [] (uint8_t opcode, const std::string& payload) {
+    const uint8_t key[4] = { 0x37, 0xFA, 0x21, 0x3D };
+    std::string frame;
+    frame += (char) (0x80 | opcode);
+    frame += (char) (0x80 | payload.size());
+    frame.append((const char *) key, 4);
+    for (size_t i = 0; i < payload.size(); i++)
+    {
+      frame += (char) (payload[i] ^ key[i & 3]);
+    }
+    return frame;
+  };
+
+  int failed = 0;
+
+  NPL::CWSFramer framer;
+
+  TestLink link;
+
+  /**
+   * the sample handshake of rfc 6455 1.3
+   */
+  feed(framer, link,
+    "GET /chat HTTP/1.1\r\n"
+    "Host: server.example.com\r\n"
+    "Upgrade: websocket\r\n"
+    "Connection: Upgrade\r\n"
+    "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+    "Sec-WebSocket-Version: 13\r\n\r\n");
+
+  failed += check("framer upgrade", link.iConnected &&
+    link.iDown.find("Sec-WebSocket-Accept: s3pPLMBiTxaQ9kYGzzhZRbK+xOo=\r\n") != std::string::npos);
+
+  /**
+   * a frame split across reads, then a text message in two fragments
+   */
+  auto hello = masked(0x01, "hello");
+
+  feed(framer, link, hello.substr(0, 3));
+  feed(framer, link, hello.substr(3));
+
+  auto first = masked(0x01, "frag");
+  first[0] &= 0x7F;
+
+  feed(framer, link, first + masked(0x00, "ments"));
+
+  failed += check("framer messages", link.iUp == "hellofragments");
+
+  /**
+   * a 64 bit length with the top bit set closes with 1002
+   */
+  link.iDown.clear();
+
+  feed(framer, link, std::string("\x82\x7F\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFB", 10));
+
+  failed += check("framer invalid length", link.iClosed && link.iDown == std::string("\x88\x02\x03\xEA", 4));
+
+  return report("test_ws_framer", failed);
+}
+
+/*
+ * a scratch file, removed when the driver returns
+ */
+struct TestFile
+{
+  std::string iName;
+
+  TestFile(const std::string& name) : iName(name) {}
+
+  ~TestFile()
+  {
+    std::remove(iName.c_str());
+  }
+
+  void Fill(size_t n)
+  {
+    std::ofstream f(iName, std::ios::binary | std::ios::trunc);
+    f << std::string(n, 'x');
+  }
+};
+
+int test_write_behind(void)
+{
+  TestFile file("npl_write_behind.tmp");
+
+  auto device = NPL::make_file(file.iName, true);
+
+  int failed = check("open", device != nullptr);
+
+  if (!device)
+  {
+    return failed;
+  }
+
+  std::string data;
+
+  for (int i = 0; i < 50000; i++)
+  {
+    data += (char) ('a' + (i * 7) % 26);
+  }
+
+  bool ok = true, idle = false;
+
+  {
+    NPL::CWriteBehind wb(device, 4096);
+
+    /**
+     * the block completions come in on the loop, as they do for
+     * the FTP download
+     */
+    auto observer = std::make_shared<NPL::CListener>(
+      nullptr, nullptr,
+      [&wb] (const uint8_t *, size_t n) {
+        wb.OnWritten(n);
+      });
+
+    device->AddEventListener(observer);
+
+    /**
+     * odd sized sequential writes fill and hand off whole blocks,
+     * what finds both blocks busy is held; then a write that goes
+     * back seals the partial one
+     */
+    for (size_t i = 0; i < data.size(); i += 1000)
+    {
+      size_t n = std::min<size_t>(1000, data.size() - i);
+      ok = ok && wb.Write((const uint8_t *) data.data() + i, n, i);
+    }
+
+    data.replace(100, 10, "0123456789");
+
+    ok = ok && wb.Write((const uint8_t *) data.data() + 100, 10, 100);
+
+    ok = ok && wb.Flush();
+
+    for (int i = 0; i < 400 && !(idle = wb.IsIdle()); i++)
+    {
+      std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+
+    ok = ok && !wb.Failed();
+
+    device->RemoveEventListener(observer);
+  }
+
+  NPL::D->RemoveEventListener(device);
+
+  failed += check("write behind", ok && idle);
+
+  std::ifstream in(file.iName, std::ios::binary);
+
+  std::string out((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+  failed += check("write behind content", out == data);
+
+  return report("test_write_behind", failed);
+}
+
+/**
+ * a control connection without a socket : commands are captured
+ * and replies are fed to OnRead
+ */
+struct TestFTP : public NPL::CProtocolFTP
+{
+  using CProtocolFTP::ProcessLoginEvent;
+  using CProtocolFTP::OnPipelineTimeout;
+  using CProtocolFTP::OnRead;
+  using CProtocolFTP::iCmdQ;
+  using CProtocolFTP::iDataChannel;
+  using CProtocolFTP::iTxLeft;
+  using CProtocolFTP::OnFileRead;
+  using CProtocolFTP::OnDataChannelWrite;
+
+  std::string iSent;
+
+  std::vector<std::shared_ptr<TestFTP>> iClones;
+
+  bool iDown = false;
+
+  virtual void Write(const uint8_t *b, size_t l, uint64_t) override
+  {
+    iSent.append((const char *) b, l);
+  }
+
+  /*
+   * a session past its login, where the drivers start
+   */
+  static std::shared_ptr<TestFTP> Create(void)
+  {
+    auto ftp = std::make_shared<TestFTP>();
+
+    ftp->ProcessLoginEvent(true);
+
+    return ftp;
+  }
+
+  virtual std::shared_ptr<CProtocolFTP> CloneSession(void) override
+  {
+    auto ftp = Create();
+
+    iClones.push_back(ftp);
+
+    return ftp;
+  }
+
+  virtual bool IsDisconnected(void) override
+  {
+    return iDown || CProtocolFTP::IsDisconnected();
+  }
+
+  void Reply(const std::string& r)
+  {
+    OnRead((const uint8_t *) r.data(), r.size());
+  }
+};
+
+int test_ftp_pipeline(void)
+{
+  auto ftp = std::make_shared<TestFTP>();
+
+  std::vector<std::string> replies;
+
+  auto rcbk = [&replies] (const std::string& r) { replies.push_back(r.substr(0, 5)); };
+
+  int failed = 0;
+
+  ftp->SetPipelineDepth(3);
+  ftp->ProcessLoginEvent(true);
+
+  ftp->SetCurrentDir("a", rcbk);
+  ftp->SetCurrentDir("b", rcbk);
+  ftp->SetCurrentDir("c", rcbk);
+  ftp->GetCurrentDir(rcbk);
+
+  failed += check("pipeline first", ftp->iSent == "CWD a\r\n");
+
+  ftp->iSent.clear();
+
+  ftp->Reply("250 a\r\n");
+
+  failed += check("pipeline batch", ftp->iSent == "CWD b\r\nCWD c\r\nPWD \r\n");
+
+  ftp->iSent.clear();
+
+  /**
+   * the batch is late : nothing is sent again and the late replies
+   * still reach their own commands
+   */
+  ftp->OnPipelineTimeout();
+
+  failed += check("pipeline timeout no resend", ftp->iSent.empty());
+
+  ftp->Reply("250 b\r\n");
+  ftp->Reply("250 c\r\n");
+  ftp->Reply("257 \"/\"\r\n");
+
+  failed += check("pipeline late replies", replies == std::vector<std::string>{ "250 a", "250 b", "250 c", "257 \"" });
+
+  ftp->SetCurrentDir("d", rcbk);
+  ftp->SetCurrentDir("e", rcbk);
+
+  failed += check("pipeline off after timeout", ftp->iSent == "CWD d\r\n");
+
+  return report("test_ftp_pipeline", failed);
+}
+
+int test_ws_send_queue(void)
+{
+  int failed = 0;
+
+  /**
+   * without a socket below nothing is ever sent, the queue only
+   * grows and the policy decides what stays in it
+   */
+  auto drop = std::make_shared<NPL::CProtocolWS>();
+
+  drop->SetSendQueuePolicy(NPL::WSSendPolicy::DropOldest, 4);
+
+  for (int i = 0; i < 10; i++)
+  {
+    drop->SendProtocolMessage((const uint8_t *) "m", 1);
+  }
+
+  auto s = drop->GetSendStats();
+
+  failed += check("send queue drop oldest", s.iQueueDepth == 4 && s.iDropped == 6 && s.iQueuedBytes == 4 * 3);
+
+  auto coalesce = std::make_shared<NPL::CProtocolWS>();
+
+  coalesce->SetSendQueuePolicy(NPL::WSSendPolicy::CoalesceLatest, 4);
+
+  for (int i = 0; i < 5; i++)
+  {
+    coalesce->SendProtocolMessage("a", (const uint8_t *) "aa", 2);
+  }
+
+  coalesce->SendProtocolMessage("b", (const uint8_t *) "b", 1);
+
+  s = coalesce->GetSendStats();
+
+  failed += check("send queue coalesce", s.iQueueDepth == 2 && s.iCoalesced == 4 && s.iDropped == 0);
+
+  auto slow = std::make_shared<NPL::CProtocolWS>();
+
+  slow->SetSendQueuePolicy(NPL::WSSendPolicy::Disconnect, 3);
+
+  for (int i = 0; i < 4; i++)
+  {
+    slow->SendProtocolMessage((const uint8_t *) "m", 1);
+  }
+
+  s = slow->GetSendStats();
+
+  failed += check("send queue disconnect", s.iQueueDepth == 0 && s.iDropped == 4 && s.iQueuedBytes == 0);
+
+  return report("test_ws_send_queue", failed);
+}
+
+struct TestSubject : public NPL::CSubject<uint8_t, uint8_t>
+{
+  using CSubject::GetTargetPtr;
+
+  ~TestSubject()
+  {
+    MarkDestroying();
+  }
+
+  size_t GetSnapshotCount(void)
+  {
+    std::lock_guard<std::mutex> lg(iBindingLock);
+    return iBindings.size() + iRetiredObservers.size();
+  }
+};
+
+/*
+ * stands in for a dispatcher : its timers run when the driver says,
+ * on a thread that is its loop for the time
+ */
+struct TestLoop : public TestSubject
+{
+  std::vector<NPL::TTimerCbk> iTimers;
+
+  virtual bool IsDispatcher(void) override
+  {
+    return true;
+  }
+
+  virtual void ScheduleTimer(uint32_t, NPL::TTimerCbk cbk) override
+  {
+    iTimers.push_back(cbk);
+  }
+
+  void RunTimers(void)
+  {
+    std::thread([this] () {
+      EnterLoop();
+      auto timers = std::move(iTimers);
+      iTimers.clear();
+      for (auto& t : timers) t();
+    }).join();
+  }
+};
+
+int test_subject_bindings(void)
+{
+  TestFile file("npl_bindings.tmp");
+
+  auto device = NPL::make_file(file.iName, true);
+
+  int failed = check("open", device != nullptr);
+
+  if (!device)
+  {
+    return failed;
+  }
+
+  auto a = std::make_shared<TestSubject>();
+  auto b = std::make_shared<TestSubject>();
+
+  NPL::SPCSubject<uint8_t, uint8_t> sa = a, sb = b;
+
+  /**
+   * every attach and detach publishes a binding and an observer
+   * list, the loop frees the replaced ones
+   */
+  for (int i = 0; i < 1000; i++)
+  {
+    device->AddEventListener(sa);
+    sa->AddEventListener(sb);
+    sa->RemoveEventListener(sb);
+    device->RemoveEventListener(sa);
+  }
+
+  device->AddEventListener(sa);
+  sa->AddEventListener(sb);
+
+  for (int i = 0; i < 200 && (a->GetSnapshotCount() > 1 || b->GetSnapshotCount() > 1); i++)
+  {
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  }
+
+  failed += check("snapshots reclaimed", a->GetSnapshotCount() == 1 && b->GetSnapshotCount() == 1);
+
+  /**
+   * off the loop the target is pinned for the call
+   */
+  auto target = b->GetTargetPtr();
+
+  failed += check("target pinned off loop", target.operator->() == a.get() && target.iPin != nullptr);
+
+  target = {};
+
+  sa->RemoveEventListener(sb);
+  device->RemoveEventListener(sa);
+  NPL::D->RemoveEventListener(device);
+
+  device.reset();
+
+  /**
+   * moved to another loop, a subject hands the old one what it may
+   * still be reading and goes on freeing its snapshots on the new one
+   */
+  auto la = std::make_shared<TestLoop>();
+  auto lb = std::make_shared<TestLoop>();
+
+  NPL::SPCSubject<uint8_t, uint8_t> sla = la, slb = lb;
+
+  sla->AddEventListener(sa);
+  sa->AddEventListener(sb);
+  sa->RemoveEventListener(sb);
+  sla->RemoveEventListener(sa);
+  slb->AddEventListener(sa);
+
+  size_t handed = la->iTimers.size();
+
+  for (int i = 0; i < 100; i++)
+  {
+    sa->AddEventListener(sb);
+    sa->RemoveEventListener(sb);
+    lb->RunTimers();
+  }
+
+  la->RunTimers();
+
+  failed += check("moved snapshots reclaimed", handed > 0 && a->GetSnapshotCount() == 1);
+
+  slb->RemoveEventListener(sa);
+
+  /**
+   * once the loop that read them is gone the replaced bindings
+   * and snapshots are freed at once, nobody else would
+   */
+  auto lc = std::make_shared<TestLoop>();
+  auto c = std::make_shared<TestSubject>();
+  auto d = std::make_shared<TestSubject>();
+
+  NPL::SPCSubject<uint8_t, uint8_t> slc = lc, sc = c, sd = d;
+
+  slc->AddEventListener(sc);
+  sc->AddEventListener(sd);
+
+  slc.reset();
+  lc.reset();
+
+  size_t kept = c->GetSnapshotCount();
+
+  for (int i = 0; i < 100; i++)
+  {
+    sc->RemoveEventListener(sd);
+    sc->AddEventListener(sd);
+  }
+
+  failed += check("stopped loop snapshots freed", c->GetSnapshotCount() == kept && d->GetSnapshotCount() == 1);
+
+  sc->RemoveEventListener(sd);
+
+  return report("test_subject_bindings", failed);
+}
+
+/*
+ * the REST argument queued behind the PASV in flight, empty if none
+ */
+std::string queued_rest(TestFTP& ftp)
+{
+  for (auto& c : ftp.iCmdQ)
+  {
+    if (std::get<0>(c) == "REST") return std::get<1>(c);
+  }
+
+  return "";
+}
+
+int test_ftp_resume(void)
+{
+  TestFile file("npl_resume.tmp");
+
+  int failed = 0;
+
+  file.Fill(100);
+
+  auto ftp = TestFTP::Create();
+
+  ftp->ResumeDownload(nullptr, "remote", file.iName);
+
+  failed += check("resume type", ftp->iSent == "TYPE I\r\n");
+
+  ftp->iSent.clear();
+
+  ftp->Reply("200 Type set to I\r\n");
+
+  failed += check("resume size", ftp->iSent == "SIZE remote\r\n");
+
+  ftp->iSent.clear();
+
+  ftp->Reply("213 1000\r\n");
+
+  failed += check("resume pasv", ftp->iSent == "PASV \r\n");
+  failed += check("resume rest offset", queued_rest(*ftp) == "100");
+
+  /**
+   * a local file longer than the remote one starts over from 0
+   */
+  file.Fill(2000);
+
+  auto longer = TestFTP::Create();
+
+  longer->ResumeDownload(nullptr, "remote", file.iName);
+  longer->Reply("200 Type set to I\r\n");
+  longer->Reply("213 1000\r\n");
+
+  failed += check("resume longer no rest", queued_rest(*longer).empty() && longer->iCmdQ.size() == 2);
+
+  /**
+   * a complete local file needs no transfer at all
+   */
+  file.Fill(1000);
+
+  auto complete = TestFTP::Create();
+
+  int done = -1;
+
+  complete->ResumeDownload(nullptr, "remote", file.iName, 3, NPL::DCProt::Clear, [&done] (bool ok) { done = ok; });
+  complete->Reply("200 Type set to I\r\n");
+  complete->iSent.clear();
+  complete->Reply("213 1000\r\n");
+
+  failed += check("resume complete", done == 1 && complete->iSent.empty());
+
+  return report("test_ftp_resume", failed);
+}
+
+int test_ftp_segments(void)
+{
+  TestFile file("npl_segments.tmp");
+
+  int failed = 0;
+
+  auto ftp = TestFTP::Create();
+
+  ftp->DownloadSegmented(nullptr, "remote", file.iName, 4);
+  ftp->Reply("200 Type set to I\r\n");
+
+  failed += check("segments size", ftp->iSent == "TYPE I\r\nSIZE remote\r\n");
+
+  ftp->Reply("213 1000\r\n");
+
+  std::error_code ec;
+
+  failed += check("segments local size", std::filesystem::file_size(file.iName, ec) == 1000);
+  failed += check("segments sessions", ftp->iClones.size() == 3);
+
+  /**
+   * one range per session, this one keeps the first
+   */
+  std::vector<std::string> offsets = { queued_rest(*ftp) };
+
+  for (auto& clone : ftp->iClones)
+  {
+    offsets.push_back(queued_rest(*clone));
+
+    failed += check("segments clone type", clone->iSent == "TYPE I\r\n");
+  }
+
+  failed += check("segments offsets", offsets == std::vector<std::string>{ "0", "250", "500", "750" });
+
+  /**
+   * no SIZE, no segments
+   */
+  auto refused = TestFTP::Create();
+
+  int done = -1;
+
+  refused->DownloadSegmented([&done] (bool ok) { done = ok; }, "missing", file.iName, 4);
+  refused->Reply("200 Type set to I\r\n");
+  refused->Reply("550 No such file\r\n");
+
+  failed += check("segments refused", done == 0 && refused->iClones.empty());
+
+  return report("test_ftp_segments", failed);
+}
+
+int test_ftp_pool(void)
+{
+  int failed = 0;
+
+  auto seed = TestFTP::Create();
+
+  auto pool = NPL::make_ftp_pool();
+
+  pool->AddServer("s", seed, 2, 1, 1);
+
+  std::vector<std::string> order;
+
+  std::map<std::string, NPL::TCompletionCbk> running;
+
+  std::map<std::string, std::shared_ptr<TestFTP>> sessions;
+
+  std::map<std::string, bool> results;
+
+  /**
+   * a job only records where it runs, the driver finishes it
+   */
+  auto submit = [&] (const std::string& name, int priority) {
+    pool->Submit("s",
+      [&, name] (NPL::SPCProtocolFTP session, NPL::TCompletionCbk done) {
+        order.push_back(name);
+        running[name] = done;
+        sessions[name] = std::static_pointer_cast<TestFTP>(session);
+      },
+      priority,
+      [&, name] (bool ok) { results[name] = ok; });
+  };
+
+  submit("a", 0);
+  submit("b", 0);
+  submit("c", 0);
+  submit("d", 5);
+  submit("e", 1);
+
+  failed += check("pool cap", order == std::vector<std::string>{ "a", "b" } && seed->iClones.size() == 1);
+  failed += check("pool queued", pool->GetQueuedJobs("s") == 3);
+
+  running["a"](true);
+  running["b"](true);
+
+  failed += check("pool priority", order == std::vector<std::string>{ "a", "b", "d", "e" });
+  failed += check("pool session reuse", sessions["d"] == seed && sessions["e"] == seed->iClones[0]);
+
+  /**
+   * a second done is ignored
+   */
+  running["a"](false);
+
+  /**
+   * a job failed by a lost session runs again on a fresh one, its
+   * caller only hears of the last attempt
+   */
+  auto lost = sessions["e"];
+
+  lost->iDown = true;
+
+  running["e"](false);
+
+  failed += check("pool retry", order.back() == "e" && sessions["e"] != lost && !results.count("e"));
+
+  sessions["e"]->iDown = true;
+
+  running["e"](false);
+
+  failed += check("pool retries exhausted", results.count("e") && !results["e"] && order.back() == "c");
+
+  running["c"](true);
+  running["d"](true);
+
+  failed += check("pool results", results == std::map<std::string, bool>{ { "a", true }, { "b", true }, { "c", true }, { "d", true }, { "e", false } });
+
+  pool->Close();
+
+  return report("test_ftp_pool", failed);
+}
+
+int test_file_copy(void)
+{
+  TestFile src("npl_copy_src.tmp"), dst("npl_copy_dst.tmp");
+
+  src.Fill(100000);
+
+  /**
+   * the source is only read, a read-only file is copied
+   */
+  std::filesystem::permissions(src.iName,
+    std::filesystem::perms::owner_read |
+    std::filesystem::perms::group_read |
+    std::filesystem::perms::others_read);
+
+  auto copy = NPL::make_file_copy(2, 16384, NPL::CopyMethod::ReadWrite);
+
+  bool started = copy->Start(src.iName, dst.iName);
+
+  int failed = check("copy read-only source", started && copy->Wait());
+
+  std::error_code ec;
+
+  failed += check("copy size", std::filesystem::file_size(dst.iName, ec) == 100000);
+
+  #ifdef linux
+  /**
+   * root opens a 0444 file for writing too, check the mode it is opened in
+   */
+  {
+    auto device = std::make_shared<NPL::CDevice>(src.iName, false, true);
+
+    failed += check("copy source opened read-only", (fcntl(device->iFD, F_GETFL) & O_ACCMODE) == O_RDONLY);
+  }
+  #endif
+
+  std::filesystem::permissions(src.iName, std::filesystem::perms::owner_write, std::filesystem::perm_options::add);
+
+  return report("test_file_copy", failed);
+}
+
+int test_ftp_upload_flow(void)
+{
+  int failed = 0;
+
+  #ifdef linux
+  int fds[2];
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+  {
+    return report("test_ftp_upload_flow", check("socketpair", false));
+  }
+
+  int sndbuf = 16 * 1024;
+
+  setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+
+  fcntl(fds[0], F_SETFL, O_NONBLOCK);
+  fcntl(fds[1], F_SETFL, O_NONBLOCK);
+
+  auto ftp = TestFTP::Create();
+
+  ftp->iDataChannel = std::make_shared<NPL::CDeviceSocket>(fds[0]);
+
+  ftp->iCmdQ.emplace_back("STOR", "remote", "local", nullptr, nullptr);
+
+  std::string data(1024 * 1024, 0);
+
+  for (size_t i = 0; i < data.size(); i++)
+  {
+    data[i] = (char) (i * 31 % 251);
+  }
+
+  /**
+   * a read buffer larger than the socket takes : the rest is kept,
+   * the buffer itself is gone once OnFileRead returns
+   */
+  {
+    std::string chunk = data;
+
+    ftp->OnFileRead((const uint8_t *) chunk.data(), chunk.size());
+
+    chunk.assign(chunk.size(), 0);
+  }
+
+  failed += check("upload tail kept", ftp->iTxLeft > 0 && ftp->iTxLeft < data.size());
+
+  std::string received;
+
+  for (int i = 0; i < 100000 && received.size() < data.size(); i++)
+  {
+    char buf[64 * 1024];
+
+    ssize_t rc;
+
+    while ((rc = read(fds[1], buf, sizeof(buf))) > 0)
+    {
+      received.append(buf, rc);
+    }
+
+    ftp->OnDataChannelWrite(nullptr, 0);
+  }
+
+  failed += check("upload tail sent", !ftp->iTxLeft && received == data);
+
+  ftp->iCmdQ.clear();
+
+  ftp->iDataChannel.reset();
+
+  close(fds[1]);
+  #endif
+
+  return report("test_ftp_upload_flow", failed);
+}
+
+/*
+ * runs f on the dispatcher thread and waits for it
+ */
+static void on_loop(std::function<void()> f)
+{
+  std::promise<void> done;
+
+  NPL::D->ScheduleTimer(0, [&f, &done] () {
+    f();
+    done.set_value();
+  });
+
+  done.get_future().wait();
+}
+
+#ifdef linux
+/*
+ * one RETR over loopback, through write-behind blocks of "block"
+ * bytes or with plain file writes for 0
+ */
+static int ftp_download(size_t block)
+{
+  int failed = 0;
+
+  TestFile file("npl_download.tmp");
+
+  int fds[2];
+
+  int ls = socket(AF_INET, SOCK_STREAM, 0);
+
+  struct sockaddr_in sa = {};
+
+  sa.sin_family = AF_INET;
+  sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  socklen_t len = sizeof(sa);
+
+  if (ls < 0 || bind(ls, (struct sockaddr *) &sa, len) != 0 || listen(ls, 1) != 0 ||
+      getsockname(ls, (struct sockaddr *) &sa, &len) != 0 || socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+  {
+    return check("sockets", false);
+  }
+
+  int port = ntohs(sa.sin_port);
+
+  std::string data(4 * 1024 * 1024 + 1000, 0);
+
+  for (size_t i = 0; i < data.size(); i++)
+  {
+    data[i] = (char) (i * 13 % 241);
+  }
+
+  /**
+   * the session hangs off a control socket in the dispatcher, its
+   * commands go to iSent and the replies are fed by hand
+   */
+  auto control = std::make_shared<NPL::CDeviceSocket>(fds[0]);
+
+  auto ftp = TestFTP::Create();
+
+  std::string reply;
+
+  bool done = false;
+
+  on_loop([&] () {
+    NPL::D->AddEventListener(control)->AddEventListener(ftp);
+
+    ftp->SetWriteBehind(block);
+
+    ftp->Download(nullptr, "remote", file.iName, NPL::DCProt::Clear,
+      [&reply, &done] (const std::string& r) {
+        reply = r;
+        done = true;
+      });
+
+    ftp->Reply("227 Entering Passive Mode (127,0,0,1," + std::to_string(port >> 8) + "," + std::to_string(port & 0xff) + ")\r\n");
+  });
+
+  int dc = accept(ls, nullptr, nullptr);
+
+  on_loop([&] () {
+    ftp->Reply("150 Opening BINARY mode data connection\r\n");
+  });
+
+  /**
+   * sent faster than small blocks reach the disk, the data channel
+   * is held while both are busy; the final reply comes in before
+   * the data is all written
+   */
+  for (size_t sent = 0; dc >= 0 && sent < data.size(); )
+  {
+    ssize_t rc = write(dc, data.data() + sent, data.size() - sent);
+
+    if (rc <= 0) break;
+
+    sent += rc;
+  }
+
+  on_loop([&] () {
+    ftp->Reply("226 Transfer complete\r\n");
+  });
+
+  close(dc);
+
+  bool finished = false;
+
+  for (int i = 0; i < 1000 && !finished; i++)
+  {
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    on_loop([&] () { finished = done; });
+  }
+
+  failed += check(block ? "download completed" : "download completed, plain writes", finished && reply.substr(0, 3) == "226");
+
+  std::ifstream in(file.iName, std::ios::binary);
+
+  std::string out((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+  failed += check(block ? "download content" : "download content, plain writes", out == data);
+
+  /**
+   * torn down on the loop, which may still hold the subjects
+   */
+  on_loop([&] () {
+    control->RemoveEventListener(ftp);
+    NPL::D->RemoveEventListener(control);
+    control.reset();
+    ftp.reset();
+  });
+
+  close(ls);
+  close(fds[1]);
+
+  return failed;
+}
+#endif
+
+int test_ftp_download_flow(void)
+{
+  int failed = 0;
+
+  #ifdef linux
+  failed += ftp_download(64 * 1024);
+  failed += ftp_download(0);
+  #endif
+
+  return report("test_ftp_download_flow", failed);
+}
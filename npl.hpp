@@ -5,7 +5,11 @@
 #include <CDispatcher.hpp>
 #include <CDeviceSocket.hpp>
 #include <CProtocolFTP.hpp>
+#include <CFTPMirror.hpp>
+#include <CFTPSessionPool.hpp>
+#include <CFileCopy.hpp>
 #include <CProtocolWS.hpp>
+#include <CWSFramer.hpp>
 
 namespace NPL
 {
@@ -36,6 +40,16 @@ namespace NPL
     return ftp;
   }
 
+  auto make_ftp_mirror(SPCProtocolFTP ftp, size_t concurrency = 4)
+  {
+    return std::make_shared<CFTPMirror>(ftp, concurrency);
+  }
+
+  auto make_ftp_pool(void)
+  {
+    return std::make_shared<CFTPSessionPool>();
+  }
+
   auto make_ws_server(const std::string& host, int port, TLS tls = TLS::No, TOnClientMessageCbk cbk = nullptr)
   {
     auto cc = std::make_shared<CDeviceSocket>();
@@ -56,6 +70,63 @@ namespace NPL
     return lso;
   }
 
+  auto make_ws_client(const std::string& host, int port, TLS tls = TLS::No, TOnClientMessageCbk cbk = nullptr, const std::string& path = "/")
+  {
+    auto sock = std::make_shared<CDeviceSocket>();
+    auto ws = std::make_shared<CProtocolWS>();
+
+    sock->SetTLS(tls);
+
+    sock->SetProperty("name", "ws-client-socket");
+
+    sock->SetHostAndPort(host, port);
+
+    ws->SetProperty("name", "ws-client");
+
+    ws->SetHostAndPath(host + ":" + std::to_string(port), path);
+
+    ws->SetClientCallback(cbk);
+
+    D->AddEventListener(sock)->AddEventListener(ws);
+
+    return ws;
+  }
+
+  /*
+   * fixed stacks, e.g. make_pipeline_client("127.0.0.1", 443, TLS::Yes, 
+   * CWSFramer("127.0.0.1:443"), MyHandler()); start them with 
+   * StartSocketClient() / StartSocketServer()
+   */
+  template <typename... Stages>
+  auto make_pipeline_client(const std::string& host, int port, TLS tls, Stages... stages)
+  {
+    auto p = std::make_shared<CPipeline<Stages...>>(std::move(stages)...);
+
+    p->SetTLS(tls);
+
+    p->SetHostAndPort(host, port);
+
+    p->SetProperty("name", "pipeline-client");
+
+    D->AddEventListener(p);
+
+    return p;
+  }
+
+  template <typename... Stages>
+  auto make_pipeline_server(const std::string& host, int port, Stages... stages)
+  {
+    auto p = std::make_shared<CPipeline<Stages...>>(std::move(stages)...);
+
+    p->SetHostAndPort(host, port);
+
+    p->SetProperty("name", "pipeline-server");
+
+    D->AddEventListener(p);
+
+    return p;
+  }
+
   auto make_http_client(const std::string& host, int port)
   {
     auto sock = std::make_shared<CDeviceSocket>();
@@ -73,9 +144,9 @@ namespace NPL
   }
 
   template <typename T>
-  auto make_file(const T& file, bool bCreate = false)
+  auto make_file(const T& file, bool bCreate = false, bool bReadOnly = false)
   {
-    auto device = std::make_shared<CDevice>(file, bCreate);
+    auto device = std::make_shared<CDevice>(file, bCreate, bReadOnly);
 
     if (device->IsConnected())
     {
@@ -89,6 +160,11 @@ namespace NPL
     return device;
   }
 
+  auto make_file_copy(size_t depth = 8, size_t chunk = 1024 * 1024, CopyMethod method = CopyMethod::Auto)
+  {
+    return std::make_shared<CFileCopy>(depth, chunk, method);
+  }
+
   void TEST_DISPATCHER()
   {
     for (int i = 0; i < 100; i++)